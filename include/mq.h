@@ -29,14 +29,18 @@
  *
  */
 
+#ifndef MQ_H_INCLUDED
+#define MQ_H_INCLUDED
+
 #include <stddef.h>
+#include <sys/uio.h>
 
 /**
  * \file mq.h
  * \brief MQ messaging interface for trackrdrd
  * \details MQ -- the messaging interface for the Varnish log tracking
  * reader
- * \version 5
+ * \version 8
  *
  * This header defines the interface to a messaging system, such as
  * ActiveMQ or Kafka, used by the tracking reader. It is responsible for
@@ -45,7 +49,9 @@
  *
  * An implementation of this interface is a dynamic library (shared
  * object) that must provide definitions for each of the functions
- * declared here (read by the tracking reader via dlsym(3)).
+ * declared here (read by the tracking reader via dlsym(3)), with the
+ * exception of MQ_SendBatch(), MQ_SendV(), MQ_SendRef() and MQ_Poll(),
+ * which are optional.
  *
  * The tracking reader starts a configurable number of worker threads that
  * are responsible for sending data to a messaging system, by calling the
@@ -94,8 +100,18 @@
  *   can be written to the log). If either of them fail, an error is
  *   logged, but the thread continues.
  * - The main loop of the worker thread calls MQ_Send() for every data
- *   record that it processes. See below for a description of how the
- *   tracking reader handles non-recoverable message send failures.
+ *   record that it processes; or, if the implementation provides
+ *   MQ_SendBatch(), calls it once for each batch of more than one
+ *   record that it has taken from the internal queue. If the
+ *   implementation provides MQ_SendV(), it is called instead of MQ_Send()
+ *   for records that are stored in more than one buffer internally (and
+ *   such records are not included in calls to MQ_SendBatch()). If the
+ *   tracking reader is configured with ``mq.zerocopy`` and the
+ *   implementation provides MQ_SendRef() and MQ_Poll(), MQ_SendRef() is
+ *   called for all other records, and MQ_Poll() is called instead of
+ *   waiting for new data while any of them have not been released. See
+ *   below for a description of how the tracking reader handles
+ *   non-recoverable message send failures.
  * - MQ_WorkerShutdown() is called when the worker thread is shutting
  *   down.
  *
@@ -111,7 +127,12 @@
  * - If MQ_Send() fails, the thread calls MQ_Reconnect(); the messaging
  *   implementation is expected to attempt a new connection, and may
  *   create a new private worker object. If MQ_Reconnect() succeeds,
- *   then MQ_Send() is attempted again with the same data.
+ *   then MQ_Send() is attempted again with the same data. This is also
+ *   the case for data that was first attempted with MQ_SendV().
+ * - If MQ_SendBatch() signals a non-recoverable error for one or more
+ *   records in a batch, then the thread calls MQ_Reconnect() at most
+ *   once for the batch, and resends each of the failed records with
+ *   MQ_Send().
  * - If either MQ_Reconnect() fails, or the resend after a successful call
  *   to MQ_Reconnect() fails, then the private worker object is discarded
  *   (with a call to MQ_WorkerShutdown()), and the worker thread
@@ -178,6 +199,136 @@ const char *MQ_WorkerInit(void **priv, int wrk_num);
 int MQ_Send(void *priv, const char *data, unsigned len,
             const char *key, unsigned keylen, const char **error);
 
+/**
+ * A data record to be sent by MQ_SendBatch(); the fields have the same
+ * meaning as the corresponding parameters of MQ_Send().
+ */
+struct mq_msg {
+    const char	*data;
+    unsigned	len;
+    const char	*key;
+    unsigned	keylen;
+};
+
+/**
+ * Send a batch of data records to the messaging system (optional).
+ *
+ * If an implementation does not define this method, the tracking reader
+ * calls MQ_Send() for each record. Otherwise it is called instead of
+ * MQ_Send() whenever a worker thread has more than one record ready to
+ * be sent, so that the implementation can hand them to the messaging
+ * system in a single operation.
+ *
+ * The status of each record is reported in the `status` array, with the
+ * same meaning as the return value of MQ_Send(). A record that could
+ * not be sent with status less than zero is resent by the tracking
+ * reader with MQ_Send() after a call to MQ_Reconnect().
+ *
+ * The implementation of this method must be thread-safe.
+ *
+ * @param priv private object handle
+ * @param msgs array of `n` records to be sent
+ * @param n number of records in `msgs`
+ * @param status array of `n` integers. The implementation is expected to
+ * set `status[i]` to zero if `msgs[i]` was sent successfully, >0 for a
+ * recoverable error, or <0 for a non-recoverable error.
+ * @param error pointer to an error message. The implementation is
+ * expected to place a message describing the most recent failure in this
+ * location when non-zero is returned.
+ * @return zero if all records were sent successfully, >0 if any record
+ * failed and all failures were recoverable, <0 if any record failed with
+ * a non-recoverable error
+ */
+int MQ_SendBatch(void *priv, const struct mq_msg *msgs, unsigned n,
+                 int *status, const char **error);
+
+/**
+ * Send data from a scatter/gather list to the messaging system (optional).
+ *
+ * Equivalent to MQ_Send() for the concatenation of the buffers in `iov`,
+ * so that the tracking reader does not have to copy data that it has
+ * stored in separate buffers into a contiguous buffer. If an
+ * implementation does not define this method, the tracking reader calls
+ * MQ_Send() instead.
+ *
+ * The implementation of this method must be thread-safe.
+ *
+ * @param priv private object handle
+ * @param iov array of buffers containing the data to be sent, see
+ * writev(2)
+ * @param iovcnt number of buffers in `iov`
+ * @param key an optional sharding key for the messaging system
+ * @param keylen length of the sharding key
+ * @param error pointer to an error message. The implementation is
+ * expected to place a message in this location when non-zero is returned.
+ * @return zero on success, >0 for a recoverable error, <0 for a
+ * non-recoverable error
+ */
+int MQ_SendV(void *priv, const struct iovec *iov, int iovcnt,
+             const char *key, unsigned keylen, const char **error);
+
+/**
+ * Function supplied to MQ_SendRef() to release the data of a message.
+ *
+ * @param ref the `ref` argument passed to MQ_SendRef()
+ * @param status zero if the message was delivered, non-zero if it could
+ * not be delivered
+ */
+typedef void mq_release_f(void *ref, int status);
+
+/**
+ * Send data to the messaging system without copying it (optional).
+ *
+ * Like MQ_Send(), except that the implementation may continue to use
+ * the memory at `data` after the call returns. If zero is returned, the
+ * implementation must call `release(ref, status)` exactly once when it
+ * no longer needs the data, for example after the message has been
+ * delivered; the call may be made from any thread, and may be made
+ * before MQ_SendRef() returns. If non-zero is returned, `release` must
+ * not be called, and the data remains owned by the tracking reader.
+ *
+ * The tracking reader uses this method only if it is configured with
+ * ``mq.zerocopy`` and MQ_Poll() is defined as well; otherwise, or if the
+ * method is not defined, it calls MQ_Send() instead. Records sent by
+ * reference are not counted as sent until `release` is called with
+ * status zero.
+ *
+ * The implementation of this method must be thread-safe.
+ *
+ * @param priv private object handle
+ * @param data pointer to the data to be sent
+ * @param len length of the data in bytes
+ * @param key an optional sharding key for the messaging system
+ * @param keylen length of the sharding key
+ * @param release function to be called when the data is released
+ * @param ref argument for `release`
+ * @param error pointer to an error message. The implementation is
+ * expected to place a message in this location when non-zero is returned.
+ * @return zero on success, >0 for a recoverable error, <0 for a
+ * non-recoverable error
+ */
+int MQ_SendRef(void *priv, const char *data, unsigned len,
+               const char *key, unsigned keylen, mq_release_f *release,
+               void *ref, const char **error);
+
+/**
+ * Make progress with messages sent by MQ_SendRef() (optional).
+ *
+ * Called by a worker thread that has no data to send, while messages
+ * that it sent with MQ_SendRef() have not been released. The
+ * implementation is expected to serve the messages of the worker object,
+ * for example by handling delivery reports, and to call their `release`
+ * functions when it is done with them, waiting at most `timeout`
+ * milliseconds for that to happen. The tracking reader may run out of
+ * storage for new data while messages are not released, so this method
+ * is required for the use of MQ_SendRef().
+ *
+ * @param priv private object handle
+ * @param timeout maximum time to wait in milliseconds
+ * @return `NULL` on success, an error message on failure
+ */
+const char *MQ_Poll(void *priv, unsigned timeout);
+
 /**
  * Return the version string of the messaging system.
  *
@@ -255,3 +406,5 @@ const char *MQ_WorkerShutdown(void **priv, int wrk_num);
  * @return `NULL` on success, an error message on failure
  */
 const char *MQ_GlobalShutdown(void);
+
+#endif
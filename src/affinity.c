@@ -0,0 +1,173 @@
+/*-
+ * Copyright (c) 2026 UPLEX Nils Goroll Systemoptimierung
+ * Copyright (c) 2026 Otto Gmbh & Co KG
+ * All rights reserved
+ * Use only with permission
+ *
+ * Author: agent <agent@local>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "vdef.h"
+#include "vas.h"
+
+#include "trackrdrd.h"
+
+/*
+ * CPU affinity and scheduling of the reader, worker and monitor threads.
+ *
+ * The reader's placement and scheduling are set by AFF_Reader() before
+ * the child process drops privileges. Threads started afterwards would
+ * inherit them, so workers and the monitor are created with attributes
+ * from AFF_Attr(): their own CPU list if one is configured, otherwise the
+ * CPUs of the process as it was started, and the default scheduling
+ * policy. The nice value is not a thread attribute; AFF_Thread() restores
+ * it when the thread starts.
+ */
+
+static cpu_set_t base_cpus, reader_cpus, worker_cpus, monitor_cpus;
+static int base_nice, initialized = 0, nice_set = 0;
+
+static int
+aff_cpus(const char *list, cpu_set_t *set)
+{
+    if (EMPTY(list)) {
+        memcpy(set, &base_cpus, sizeof(*set));
+        return(0);
+    }
+    if (NUMA_Cpulist(list, set) != 0 || CPU_COUNT(set) == 0)
+        return(EINVAL);
+    return(0);
+}
+
+static inline pid_t
+aff_tid(void)
+{
+    return (pid_t) syscall(SYS_gettid);
+}
+
+/*
+ * Reads the CPU lists from the config, called before any threads are
+ * started. Returns 0 or errno.
+ */
+int
+AFF_Init(void)
+{
+    initialized = 0;
+    nice_set = 0;
+    if (sched_getaffinity(0, sizeof(base_cpus), &base_cpus) != 0)
+        return(errno);
+    errno = 0;
+    base_nice = getpriority(PRIO_PROCESS, 0);
+    if (errno != 0)
+        return(errno);
+
+    if (aff_cpus(config.reader_cpus, &reader_cpus) != 0
+        || aff_cpus(config.worker_cpus, &worker_cpus) != 0
+        || aff_cpus(config.monitor_cpus, &monitor_cpus) != 0)
+        return(EINVAL);
+    initialized = 1;
+    return(0);
+}
+
+/*
+ * Applies reader.cpus, and reader.priority or reader.nice, to the calling
+ * thread. Returns 0 or errno.
+ */
+int
+AFF_Reader(void)
+{
+    struct sched_param param;
+    int err;
+
+    assert(initialized);
+    if (!EMPTY(config.reader_cpus)
+        && (err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                         &reader_cpus)) != 0)
+        return(err);
+
+    if (config.reader_priority > 0) {
+        param.sched_priority = config.reader_priority;
+        return(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param));
+    }
+    if (config.reader_nice != 0) {
+        if (setpriority(PRIO_PROCESS, aff_tid(), config.reader_nice) != 0)
+            return(errno);
+        nice_set = 1;
+    }
+    return(0);
+}
+
+/* Sets the attributes for a worker or monitor thread to be created */
+void
+AFF_Attr(pthread_attr_t *attr, aff_thread_t thread)
+{
+    struct sched_param param = { .sched_priority = 0 };
+    const char *list;
+    cpu_set_t *set;
+
+    if (!initialized)
+        return;
+    if (thread == AFF_MONITOR) {
+        list = config.monitor_cpus;
+        set = &monitor_cpus;
+    }
+    else {
+        list = config.worker_cpus;
+        set = &worker_cpus;
+    }
+    if (!EMPTY(list) || !EMPTY(config.reader_cpus))
+        AZ(pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), set));
+    if (config.reader_priority > 0) {
+        AZ(pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED));
+        AZ(pthread_attr_setschedpolicy(attr, SCHED_OTHER));
+        AZ(pthread_attr_setschedparam(attr, &param));
+    }
+}
+
+/*
+ * Called at the start of a worker or monitor thread, restores the nice
+ * value if it was changed for the reader. Returns 0 or errno.
+ */
+int
+AFF_Thread(void)
+{
+    if (!nice_set)
+        return(0);
+    if (setpriority(PRIO_PROCESS, aff_tid(), base_nice) != 0)
+        return(errno);
+    return(0);
+}
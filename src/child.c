@@ -55,6 +55,7 @@
 #include <dlfcn.h>
 #include <float.h>
 #include <inttypes.h>
+#include <sched.h>
 
 #include "trackrdrd.h"
 #include "config_common.h"
@@ -64,6 +65,7 @@
 
 #include "vapi/vsm.h"
 #include "vapi/vsl.h"
+#include "vapi/vsl_int.h"
 #include "miniobj.h"
 #include "vas.h"
 
@@ -71,11 +73,15 @@
 #define I_FILTER_VCL_LOG "VCL_log:^track "
 #define I_FILTER_TS "Timestamp:^Resp"
 
+/*
+ * VSL query for transaction groups with tracking data, so that the
+ * log API does not dispatch groups without them.
+ */
+#define TRACK_QUERY "VCL_Log ~ \"^track \""
+
 /* XXX: should these be configurable ? */
 #define TRACKLOG_PREFIX "track "
 #define TRACKLOG_PREFIX_LEN (sizeof(TRACKLOG_PREFIX)-1)
-#define REQEND_T_VAR "req_endt"
-#define REQEND_T_LEN (sizeof(REQEND_T_VAR "=1430176881.682097"))
 
 /*
  * See vsl.h for return values from VSLQ_Dispatch() and VSL_Next().
@@ -93,7 +99,20 @@
 #define DISPATCH_FLUSH 12
 #define DISPATCH_WRK_ABANDONED 13
 
-#define MAX_IDLE_PAUSE 0.01
+/*
+ * Polling at the end of the log: after POLL_SPINS empty polls with busy
+ * waits, and POLL_YIELDS with sched_yield(), the reader sleeps, doubling
+ * the pause up to idle.pause while the log stays empty. The first pause is
+ * a fraction of the mean gap between transactions, estimated by an EWMA of
+ * the arrival rate. Spinning is skipped if transactions arrive too rarely
+ * for it to pay off.
+ */
+#define POLL_SPINS 64
+#define POLL_SPIN_RELAX 32
+#define POLL_YIELDS 16
+#define POLL_MIN_PAUSE 1e-6
+#define POLL_SPIN_GAP 1e-4	/* max mean gap in seconds for spinning */
+#define POLL_EWMA_SHIFT 3	/* weight 1/8 for new rate samples */
 
 char cli_config_filename[PATH_MAX + 1];
 
@@ -105,42 +124,210 @@ static unsigned len_hi = 0, debug = 0, data_exhausted = 0, restart = 0;
 static unsigned long seen = 0, submitted = 0, len_overflows = 0, no_data = 0,
     no_free_data = 0, vcl_log_err = 0, vsl_errs = 0, closed = 0, overrun = 0,
     ioerr = 0, reacquire = 0, truncated = 0, key_hi = 0, key_overflows = 0,
-    no_free_chunk = 0, eol = 0, no_timestamp = 0, mgt_restart = 0;
+    no_free_chunk = 0, eol = 0, no_timestamp = 0, mgt_restart = 0,
+    skipped = 0, dispatched = 0, chunk_fallback = 0;
+
+/* dispatch rate in the last stats interval */
+static unsigned long stats_dispatched = 0;
+static double stats_t = 0.;
 
-static double idle_pause = MAX_IDLE_PAUSE;
+static unsigned long spins = 0, yields = 0, sleeps = 0, wakes = 0;
+
+/*
+ * Reader lag: the number of log segments and bytes by which the cursor is
+ * behind the segment that Varnish is writing, and the age of the newest
+ * transaction read, by its Timestamp:Resp. Varnish signals an overrun
+ * when the cursor is VSL_SEGMENTS - 2 segments behind.
+ */
+static const struct VSL_head *vsl_head = NULL;
+static const struct VSL_cursor *rdr_cursor = NULL;
+/* the mapping of vsl_head, and the VSM handle that mapped it */
+static struct vsm *lag_vsm = NULL;
+static struct vsm_fantom lag_vf;
+static unsigned lag_seg = 0, lag_seg_hi = 0, lag_seg_hi_this = 0;
+static unsigned long lag_bytes = 0, lag_bytes_hi = 0;
+static double lag_age = 0., lag_age_hi = 0., lag_age_hi_this = 0.,
+    newest_t = 0.;
+
+static struct {
+    double		rate;		/* EWMA of transactions per second */
+    double		last_t;		/* time of the last rate sample */
+    double		wait_t;		/* start of the last wait */
+    double		pause;		/* next sleep */
+    double		wake_sum;	/* sum of waits ended by new data */
+    unsigned long	last_seen;
+    unsigned		empty;		/* consecutive empty polls */
+} rdr_poll;
 
 static volatile sig_atomic_t flush = 0, term = 0;
 
 static struct sigaction terminate_action, dump_action, flush_action;
 
-/* Local freelists */
-static struct rechead_s reader_freerec = 
-    VSTAILQ_HEAD_INITIALIZER(reader_freerec);
-static chunkhead_t reader_freechunk = 
-    VSTAILQ_HEAD_INITIALIZER(reader_freechunk);
-static unsigned rdr_rec_free = 0, rdr_chunk_free = 0;
+/*
+ * Local freelists of the threads that build data records: the reader's
+ * at index 0, followed by those of the parse threads, if any. Each also
+ * holds the records that the thread has built, until they are enqueued
+ * for the workers together by submit_flush().
+ */
+struct freelist {
+    struct rechead_s	rec;
+    chunkhead_t		chunk[MAX_CHUNK_CLASSES];
+    unsigned		nrec, nchunk;
+    struct rechead_s	submit;
+    unsigned		nsubmit;
+};
+static struct freelist rdr_free[MAX_PARSE_THREADS + 1];
+static __thread struct freelist *local = &rdr_free[0];
+
+/*
+ * Parse pipeline: with parse.threads, dispatch() only copies the log
+ * records of interest into batches of transactions, and parse threads
+ * build the data records from the batches. Full batches are passed to
+ * the parse threads, and returned empty to the reader, on lists under
+ * one lock, so that the reader synchronizes once per batch.
+ */
+#define PARSE_BATCH_TX 64		/* transactions per batch */
+#define PARSE_BATCHES 4			/* batches per parse thread */
+#define RAW_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+
+/* a log record, followed by its payload and a null byte */
+struct rawrec {
+    uint64_t		xid;
+    uint32_t		tag;
+    uint32_t		len;
+};
+
+/* a transaction, followed by nrec records in len bytes */
+struct rawtx {
+    int64_t		vxid;
+    uint32_t		nrec;
+    uint32_t		len;
+};
+
+struct rawbatch {
+    unsigned		magic;
+#define RAWBATCH_MAGIC 0x7b0f3a5d
+    unsigned		ntx;
+    size_t		len;		/* bytes used in buf */
+    size_t		size;		/* bytes allocated */
+    size_t		tx;		/* offset of the current transaction */
+    char		*buf;
+    VSTAILQ_ENTRY(rawbatch) list;
+};
+
+VSTAILQ_HEAD(rawhead, rawbatch);
+
+static struct rawbatch *batch = NULL, *rawbatches = NULL;
+static struct rawhead parse_full = VSTAILQ_HEAD_INITIALIZER(parse_full),
+    parse_free = VSTAILQ_HEAD_INITIALIZER(parse_free);
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parse_full_cond = PTHREAD_COND_INITIALIZER,
+    parse_free_cond = PTHREAD_COND_INITIALIZER;
+/* serializes DATA_Grow() and DATA_Drain() among the parse threads */
+static pthread_mutex_t data_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t parsers[MAX_PARSE_THREADS];
+static unsigned nparsers = 0, parse_stop = 0;
+static unsigned long batches = 0, batch_waits = 0;
+
+/* max records held back before they are enqueued */
+#define SUBMIT_BATCH 64
+static unsigned long submit_batches = 0;
+
+/*
+ * Counters and high-water marks that parse threads update concurrently.
+ * The reader uses them in the same way, atomic operations are cheap when
+ * uncontended.
+ */
+#define RDR_INC(c) ((void) __atomic_add_fetch(&(c), 1, __ATOMIC_RELAXED))
+#define RDR_HI(hi, v) do {                                              \
+        __typeof__(hi) _v = (v),                                        \
+            _hi = __atomic_load_n(&(hi), __ATOMIC_RELAXED);             \
+        while (_v > _hi                                                 \
+               && !__atomic_compare_exchange_n(&(hi), &_hi, _v, 1,      \
+                                               __ATOMIC_RELAXED,        \
+                                               __ATOMIC_RELAXED))       \
+            ;                                                           \
+    } while (0)
+
+/*
+ * Set by the reader and parse threads when they find no free data, read
+ * by the workers. Only stored on a change, so that the cache line is not
+ * written for every record taken.
+ */
+static inline void
+rdr_exhausted(unsigned v)
+{
+    if (__atomic_load_n(&data_exhausted, __ATOMIC_RELAXED) != v)
+        __atomic_store_n(&data_exhausted, v, __ATOMIC_RELAXED);
+}
 
 /*--------------------------------------------------------------------*/
 
 void
 RDR_Stats(void)
 {
-    LOG_Log(LOG_INFO, "Reader: seen=%lu submitted=%lu nodata=%lu eol=%lu "
-            "idle_pause=%.09f free_rec=%u free_chunk=%u no_free_rec=%lu "
-            "no_free_chunk=%lu len_hi=%u key_hi=%lu len_overflows=%lu "
-            "truncated=%lu key_overflows=%lu vcl_log_err=%lu no_timestamp=%lu "
-            "vsl_err=%lu closed=%lu overrun=%lu ioerr=%lu reacquire=%lu "
-            "mgt_restart=%lu",
-            seen, submitted, no_data, eol, idle_pause, rdr_rec_free,
-            rdr_chunk_free, no_free_data, no_free_chunk, len_hi, key_hi,
-            len_overflows, truncated, key_overflows, vcl_log_err, no_timestamp,
-            vsl_errs, closed, overrun, ioerr, reacquire, mgt_restart);
+    unsigned free_rec = 0, free_chunk = 0;
+    double now = VTIM_mono(), dispatch_rate = 0.;
+
+    /* locking would be overkill */
+    for (unsigned i = 0; i <= nparsers; i++) {
+        free_rec += rdr_free[i].nrec;
+        free_chunk += rdr_free[i].nchunk;
+    }
+    if (stats_t > 0. && now > stats_t)
+        dispatch_rate = (dispatched - stats_dispatched) / (now - stats_t);
+    stats_dispatched = dispatched;
+    stats_t = now;
+    LOG_Log(LOG_INFO, "Reader: seen=%lu submitted=%lu submit_batches=%lu "
+            "nodata=%lu "
+            "dispatched=%lu dispatch_rate=%.1f eol=%lu idle_pause=%.09f "
+            "rate=%.1f spins=%lu yields=%lu sleeps=%lu "
+            "wake_latency=%.09f free_rec=%u free_chunk=%u no_free_rec=%lu "
+            "no_free_chunk=%lu chunk_fallback=%lu len_hi=%u key_hi=%lu "
+            "len_overflows=%lu truncated=%lu key_overflows=%lu "
+            "vcl_log_err=%lu no_timestamp=%lu vsl_err=%lu closed=%lu "
+            "overrun=%lu ioerr=%lu reacquire=%lu mgt_restart=%lu",
+            seen, submitted, submit_batches, no_data, dispatched,
+            dispatch_rate, eol,
+            rdr_poll.pause, rdr_poll.rate,
+            spins, yields, sleeps,
+            wakes > 0 ? rdr_poll.wake_sum / wakes : 0., free_rec,
+            free_chunk, no_free_data, no_free_chunk, chunk_fallback, len_hi,
+            key_hi, len_overflows, truncated, key_overflows, vcl_log_err,
+            no_timestamp, vsl_errs, closed, overrun, ioerr, reacquire,
+            mgt_restart);
+    LOG_Log(LOG_INFO, "Reader lag: segments=%u segments_hi=%u "
+            "segments_hi_this=%u bytes=%lu bytes_hi=%lu age=%.06f "
+            "age_hi=%.06f age_hi_this=%.06f", lag_seg, lag_seg_hi,
+            lag_seg_hi_this, lag_bytes, lag_bytes_hi, lag_age, lag_age_hi,
+            lag_age_hi_this);
+    SPMCQ_Log();
+    if (nparsers > 0)
+        LOG_Log(LOG_INFO, "Parse: threads=%u batches=%lu batch_waits=%lu",
+                nparsers, batches, batch_waits);
+    if (config.shards > 1)
+        LOG_Log(LOG_INFO, "Shard: shard=%u shards=%u skipped=%lu", shard_self,
+                config.shards, skipped);
+    SHARD_SET(seen, seen);
+    SHARD_SET(submitted, submitted);
+    SHARD_SET(skipped, skipped);
+    SHARD_SET(no_data, no_data);
+    SHARD_SET(no_free_rec, no_free_data);
+    SHARD_SET(overrun, overrun);
+    SHARD_SET(lag_seg, lag_seg_hi_this);
+    if (lag_seg_hi_this >= VSL_SEGMENTS - 4)
+        LOG_Log(LOG_WARNING, "Reader fell %u of %u log segments behind, "
+                "overruns are imminent", lag_seg_hi_this, VSL_SEGMENTS);
+
+    /* locking would be overkill */
+    lag_seg_hi_this = 0;
+    lag_age_hi_this = 0.;
 }
 
 int
 RDR_Exhausted(void)
 {
-    return data_exhausted;
+    return __atomic_load_n(&data_exhausted, __ATOMIC_RELAXED);
 }
 
 /*--------------------------------------------------------------------*/
@@ -173,22 +360,116 @@ sigflush(int sig)
 
 /*--------------------------------------------------------------------*/
 
-/* 
- * the first test is not synced, so we might enter the if body too late or
- * unnecessarily
- *
- * * too late: doesn't matter, will come back next time
- * * unnecessarily: we'll find out now
- */
 static inline void
 spmcq_signal(void)
 {
-    if (spmcq_datawaiter) {
-        AZ(pthread_mutex_lock(&spmcq_datawaiter_lock));
-        if (spmcq_datawaiter)
-            AZ(pthread_cond_signal(&spmcq_datawaiter_cond));
-        AZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+    (void) SPMCQ_Wake(1);
+}
+
+/*
+ * Enqueue the records held back by the calling thread in one operation,
+ * and wake up as many workers as the batch calls for.
+ */
+static inline void
+submit_flush(void)
+{
+    unsigned n = local->nsubmit;
+
+    if (n == 0)
+        return;
+    SPMCQ_EnqBatch(&local->submit, n);
+    local->nsubmit = 0;
+    RDR_INC(submit_batches);
+    (void) SPMCQ_Wake(SPMCQ_NeedWorkers(WRK_Running(), n));
+}
+
+static void
+freelist_init(struct freelist *fl)
+{
+    VSTAILQ_INIT(&fl->rec);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+        VSTAILQ_INIT(&fl->chunk[c]);
+    VSTAILQ_INIT(&fl->submit);
+    fl->nsubmit = 0;
+    fl->nrec = fl->nchunk = 0;
+}
+
+static inline int
+data_grow(void)
+{
+    int err;
+
+    if (nparsers == 0)
+        return DATA_Grow();
+    AZ(pthread_mutex_lock(&data_lock));
+    err = DATA_Grow();
+    AZ(pthread_mutex_unlock(&data_lock));
+    return err;
+}
+
+/*
+ * Taking from the global freelists takes all that are free. With more
+ * than one parse thread, each thread keeps a share of what it took and
+ * returns the rest, lest one of them hold all of the free data while the
+ * others discard transactions. The global lists may then appear empty
+ * for a moment while another thread returns its rest, which the global
+ * counts already include, so taking is retried a few times.
+ */
+#define PARSE_SHARE PARSE_BATCH_TX
+#define PARSE_TAKE_TRIES 100
+
+static inline void
+share_rec(void)
+{
+    struct rechead_s keep;
+    dataentry *de;
+    unsigned n = 0;
+
+    if (nparsers < 2 || local->nrec <= PARSE_SHARE)
+        return;
+    VSTAILQ_INIT(&keep);
+    while (n < PARSE_SHARE && (de = VSTAILQ_FIRST(&local->rec)) != NULL) {
+        VSTAILQ_REMOVE_HEAD(&local->rec, freelist);
+        VSTAILQ_INSERT_TAIL(&keep, de, freelist);
+        n++;
     }
+    DATA_Return_Freerec(&local->rec, local->nrec - n);
+    VSTAILQ_CONCAT(&local->rec, &keep);
+    local->nrec = n;
+}
+
+static inline void
+share_chunks(void)
+{
+    chunkhead_t keep[MAX_CHUNK_CLASSES];
+    chunk_t *chunk;
+    unsigned n = 0;
+
+    if (nparsers < 2 || local->nchunk <= PARSE_SHARE * CHUNK_NCLASSES)
+        return;
+    for (int c = 0; c < CHUNK_NCLASSES; c++) {
+        VSTAILQ_INIT(&keep[c]);
+        for (int i = 0; i < PARSE_SHARE
+                 && (chunk = VSTAILQ_FIRST(&local->chunk[c])) != NULL; i++) {
+            VSTAILQ_REMOVE_HEAD(&local->chunk[c], freelist);
+            VSTAILQ_INSERT_TAIL(&keep[c], chunk, freelist);
+            n++;
+        }
+    }
+    DATA_Return_Freechunk(local->chunk, local->nchunk - n);
+    for (int c = 0; c < CHUNK_NCLASSES; c++)
+        VSTAILQ_CONCAT(&local->chunk[c], &keep[c]);
+    local->nchunk = n;
+}
+
+static inline int
+take_retry(const unsigned *nfree, unsigned *tries)
+{
+    if (nparsers < 2 || __atomic_load_n(nfree, __ATOMIC_RELAXED) == 0
+        || (*tries)++ >= PARSE_TAKE_TRIES)
+        return 0;
+    (void) sched_yield();
+    return 1;
 }
 
 /* efficiently retrieve a single data entry */
@@ -197,45 +478,65 @@ static inline dataentry
 *data_get(void)
 {
     dataentry *data;
+    unsigned tries = 0;
 
-    while (VSTAILQ_EMPTY(&reader_freerec)) {
+    while (VSTAILQ_EMPTY(&local->rec)) {
+        /* the workers free the records that we are holding back */
+        submit_flush();
         spmcq_signal();
-        rdr_rec_free = DATA_Take_Freerec(&reader_freerec);
-        if (VSTAILQ_EMPTY(&reader_freerec)) {
-            data_exhausted = 1;
+        local->nrec = DATA_Take_Freerec(&local->rec);
+        share_rec();
+        if (VSTAILQ_EMPTY(&local->rec)) {
+            if (take_retry(&global_nfree_rec, &tries) || data_grow() == 0)
+                continue;
+            rdr_exhausted(1);
             return NULL;
         }
         if (debug)
             LOG_Log(LOG_DEBUG, "Reader: took %u free data entries",
-                    rdr_rec_free);
+                    local->nrec);
     }
-    data_exhausted = 0;
-    data = VSTAILQ_FIRST(&reader_freerec);
-    VSTAILQ_REMOVE_HEAD(&reader_freerec, freelist);
-    rdr_rec_free--;
+    rdr_exhausted(0);
+    data = VSTAILQ_FIRST(&local->rec);
+    VSTAILQ_REMOVE_HEAD(&local->rec, freelist);
+    local->nrec--;
     return (data);
 }
 
 static inline chunk_t
-*take_chunk(void)
+*take_chunk(unsigned class)
 {
     chunk_t *chunk;
+    chunkhead_t *freechunk = &local->chunk[class];
+    unsigned tries = 0;
+
+    while (VSTAILQ_EMPTY(freechunk)) {
+        unsigned taken;
 
-    while (VSTAILQ_EMPTY(&reader_freechunk)) {
+        submit_flush();
         spmcq_signal();
-        rdr_chunk_free = DATA_Take_Freechunk(&reader_freechunk);
-        if (VSTAILQ_EMPTY(&reader_freechunk)) {
-            data_exhausted = 1;
+        taken = DATA_Take_Freechunk(local->chunk);
+        local->nchunk += taken;
+        share_chunks();
+        /* the larger classes are smaller pools, see data_class_chunks() */
+        for (unsigned c = class; VSTAILQ_EMPTY(freechunk) && c > 0; )
+            freechunk = &local->chunk[--c];
+        if (VSTAILQ_EMPTY(freechunk)) {
+            freechunk = &local->chunk[class];
+            if (take_retry(&global_nfree_chunk, &tries) || data_grow() == 0)
+                continue;
+            rdr_exhausted(1);
             return NULL;
         }
+        if (freechunk != &local->chunk[class])
+            RDR_INC(chunk_fallback);
         if (debug)
-            LOG_Log(LOG_DEBUG, "Reader: took %u free chunks",
-                    rdr_chunk_free);
+            LOG_Log(LOG_DEBUG, "Reader: took %u free chunks", taken);
     }
-    data_exhausted = 0;
-    chunk = VSTAILQ_FIRST(&reader_freechunk);
-    VSTAILQ_REMOVE_HEAD(&reader_freechunk, freelist);
-    rdr_chunk_free--;
+    rdr_exhausted(0);
+    chunk = VSTAILQ_FIRST(freechunk);
+    VSTAILQ_REMOVE_HEAD(freechunk, freelist);
+    local->nchunk--;
     return (chunk);
 }
 
@@ -245,18 +546,29 @@ static inline void
 data_free(dataentry *de)
 {
     AN(de);
-    rdr_chunk_free += DATA_Reset(de, &reader_freechunk);
-    VSTAILQ_INSERT_HEAD(&reader_freerec, de, freelist);
+    /* an unsubmitted record only holds a reservation in the ring */
+    if (config.ring_size > 0)
+        de->data = NULL;
+    local->nchunk += DATA_Reset(de, local->chunk);
+    VSTAILQ_INSERT_HEAD(&local->rec, de, freelist);
+    local->nrec++;
 }
 
+/* the data between the space for the XID and the reserved end time */
+#define SUBMIT_LEN(de, xid) ((de)->end - DATA_Xidlen(xid) - DATA_TRL_LEN)
+
 static inline void
-data_submit(dataentry *de)
+data_submit(dataentry *de, uint64_t xid)
 {
-    int wrk_running;
-
     CHECK_OBJ_NOTNULL(de, DATA_MAGIC);
     assert(OCCUPIED(de));
-    if (debug) {
+    if (config.ring_size > 0) {
+        DATA_Ring_Commit(de);
+        if (debug)
+            LOG_Log(LOG_DEBUG, "submit: XID=%" PRIu64 " data=[%.*s]", xid,
+                    SUBMIT_LEN(de, xid), de->data + DATA_Xidlen(xid));
+    }
+    else if (debug) {
         chunk_t *chunk;
         char *p, *data = (char *) malloc(de->end);
         int n = de->end;
@@ -264,39 +576,212 @@ data_submit(dataentry *de)
         chunk = VSTAILQ_FIRST(&de->chunks);
         while (n > 0) {
             CHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
-            assert(OCCUPIED(chunk));
             int cp = n;
-            if (cp > config.chunk_size)
-                cp = config.chunk_size;
+            if (cp > CHUNK_LEN(chunk))
+                cp = CHUNK_LEN(chunk);
             memcpy(p, chunk->data, cp);
             chunk = VSTAILQ_NEXT(chunk, chunklist);
             n -= cp;
             p += cp;
         }
         assert(p == data + de->end);
-        LOG_Log(LOG_DEBUG, "submit: data=[%.*s]", de->end, data);
+        LOG_Log(LOG_DEBUG, "submit: XID=%" PRIu64 " data=[%.*s]", xid,
+                SUBMIT_LEN(de, xid), data + DATA_Xidlen(xid));
         free(data);
     }
 
-    SPMCQ_Enq(de);
-    submitted++;
-
-    /* should we wake up another worker?
-     * base case: wake up a worker if all are sleeping
-     *
-     * this is an un-synced access to spmcq_data_waiter, but
-     * if we don't wake them up now, we will next time around
+    /*
+     * held back until the end of the dispatch round or batch, or until
+     * enough have accumulated, see submit_flush()
      */
-    wrk_running = WRK_Running();
-    if (wrk_running == spmcq_datawaiter || SPMCQ_NeedWorker(wrk_running))
-        spmcq_signal();
+    VSTAILQ_INSERT_TAIL(&local->submit, de, spmcq);
+    RDR_INC(submitted);
+    if (++local->nsubmit >= SUBMIT_BATCH)
+        submit_flush();
 }
 
+/*
+ * Take the free data, and pass the local freelists to DATA_Drain(), which
+ * sees no others: every thread with local freelists calls this while a
+ * segment is draining (see parse_main()), and the parse threads' lists
+ * are returned to the global lists when they stop.
+ */
 static inline void
 take_free(void)
 {
-    rdr_rec_free += DATA_Take_Freerec(&reader_freerec);
-    rdr_chunk_free += DATA_Take_Freechunk(&reader_freechunk);
+    local->nrec += DATA_Take_Freerec(&local->rec);
+    local->nchunk += DATA_Take_Freechunk(local->chunk);
+    share_rec();
+    share_chunks();
+    if (nparsers == 0) {
+        DATA_Drain(&local->rec, &local->nrec, local->chunk, &local->nchunk);
+        return;
+    }
+    AZ(pthread_mutex_lock(&data_lock));
+    DATA_Drain(&local->rec, &local->nrec, local->chunk, &local->nchunk);
+    AZ(pthread_mutex_unlock(&data_lock));
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+rdr_poll_init(void)
+{
+    memset(&rdr_poll, 0, sizeof(rdr_poll));
+    rdr_poll.last_t = VTIM_mono();
+    rdr_poll.last_seen = seen;
+    rdr_poll.pause = config.idle_pause;
+}
+
+/* first sleep after an idle period begins */
+static inline double
+rdr_poll_pause(void)
+{
+    double pause = POLL_MIN_PAUSE;
+
+    if (rdr_poll.rate > 0)
+        pause = 0.25 / rdr_poll.rate;
+    if (pause < POLL_MIN_PAUSE)
+        pause = POLL_MIN_PAUSE;
+    if (pause > config.idle_pause)
+        pause = config.idle_pause;
+    return pause;
+}
+
+/* called at the end of the log, waits before the next poll */
+static void
+rdr_idle(void)
+{
+    double t = VTIM_mono();
+    unsigned nspin;
+
+    if (seen != rdr_poll.last_seen) {
+        double dt = t - rdr_poll.last_t;
+
+        /* the data arrived during the last wait, at the latest */
+        if (rdr_poll.empty > 0) {
+            wakes++;
+            rdr_poll.wake_sum += t - rdr_poll.wait_t;
+        }
+        if (dt > 0)
+            rdr_poll.rate += ((seen - rdr_poll.last_seen) / dt - rdr_poll.rate)
+                / (1 << POLL_EWMA_SHIFT);
+        rdr_poll.last_seen = seen;
+        rdr_poll.last_t = t;
+        rdr_poll.empty = 0;
+        rdr_poll.pause = rdr_poll_pause();
+    }
+
+    rdr_poll.empty++;
+    rdr_poll.wait_t = t;
+    nspin = rdr_poll.rate * POLL_SPIN_GAP >= 1. ? POLL_SPINS : 0;
+    if (rdr_poll.empty <= nspin) {
+        spins++;
+        for (int i = 0; i < POLL_SPIN_RELAX; i++)
+            CPU_RELAX();
+    }
+    else if (rdr_poll.empty <= nspin + POLL_YIELDS) {
+        yields++;
+        (void) sched_yield();
+    }
+    else {
+        sleeps++;
+        VTIM_sleep(rdr_poll.pause);
+        rdr_poll.pause *= 2;
+        if (rdr_poll.pause > config.idle_pause)
+            rdr_poll.pause = config.idle_pause;
+    }
+}
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * c is the cursor for the log query, which takes ownership of it. Lag is
+ * not measured when reading from a file (vsm == NULL). A previous mapping
+ * of the log header is released, so this must be called with vsm == NULL
+ * before the VSM handle that mapped it is destroyed.
+ */
+static void
+rdr_lag_init(struct vsm *vsm, const struct VSL_cursor *c)
+{
+    double zero = 0.;
+
+    if (lag_vsm != NULL) {
+        (void) VSM_Unmap(lag_vsm, &lag_vf);
+        lag_vsm = NULL;
+    }
+    vsl_head = NULL;
+    rdr_cursor = NULL;
+    __atomic_store(&newest_t, &zero, __ATOMIC_RELAXED);
+    if (vsm == NULL)
+        return;
+    rdr_cursor = c;
+    if (!VSM_Get(vsm, &lag_vf, VSL_CLASS, NULL)
+        || VSM_Map(vsm, &lag_vf) != 0) {
+        LOG_Log(LOG_WARNING, "Cannot map the log header, lag in segments "
+                "not measured: %s", VSM_Error(vsm));
+        VSM_ResetError(vsm);
+        return;
+    }
+    lag_vsm = vsm;
+    vsl_head = (const struct VSL_head *) lag_vf.b;
+}
+
+/*
+ * Record the end time of a transaction for the age of the newest, called
+ * concurrently by the parse threads; the reader takes and resets it in
+ * rdr_lag().
+ */
+static inline void
+rdr_newest(double t)
+{
+    double newest;
+
+    __atomic_load(&newest_t, &newest, __ATOMIC_RELAXED);
+    while (t > newest
+           && !__atomic_compare_exchange(&newest_t, &newest, &t, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* sample the lag after each dispatch */
+static inline void
+rdr_lag(void)
+{
+    double t, zero = 0.;
+
+    if (vsl_head != NULL && rdr_cursor->rec.ptr != NULL) {
+        unsigned segment_n = __atomic_load_n(&vsl_head->segment_n,
+                                             __ATOMIC_RELAXED);
+
+        lag_seg = segment_n - rdr_cursor->rec.priv;
+        lag_bytes = 0;
+        if (lag_seg > 0 && lag_seg < VSL_SEGMENTS) {
+            /* up to the start of the segment being written */
+            ssize_t ringw = vsl_head->segsize * VSL_SEGMENTS;
+            ssize_t w = vsl_head->offset[segment_n % VSL_SEGMENTS];
+            ssize_t r = rdr_cursor->rec.ptr - vsl_head->log;
+
+            lag_bytes = VSL_BYTES((w - r + ringw) % ringw);
+        }
+        if (lag_seg > lag_seg_hi)
+            lag_seg_hi = lag_seg;
+        if (lag_seg > lag_seg_hi_this)
+            lag_seg_hi_this = lag_seg;
+        if (lag_bytes > lag_bytes_hi)
+            lag_bytes_hi = lag_bytes;
+    }
+    if (rdr_cursor == NULL)
+        return;
+    __atomic_load(&newest_t, &t, __ATOMIC_RELAXED);
+    if (t > 0.) {
+        __atomic_exchange(&newest_t, &zero, &t, __ATOMIC_RELAXED);
+        lag_age = VTIM_real() - t;
+        if (lag_age > lag_age_hi)
+            lag_age_hi = lag_age;
+        if (lag_age > lag_age_hi_this)
+            lag_age_hi_this = lag_age;
+    }
 }
 
 /*--------------------------------------------------------------------*/
@@ -322,29 +807,92 @@ get_chunk(dataentry *entry)
 
     CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
 
-    chunk = take_chunk();
+    chunk = take_chunk(CHUNK_CLASS(entry->nchunks));
     if (chunk == NULL) {
-        no_free_chunk++;
+        RDR_INC(no_free_chunk);
         return NULL;
     }
     CHECK_OBJ(chunk, CHUNK_MAGIC);
-    assert(!OCCUPIED(chunk));
     entry->curchunk = chunk;
     entry->curchunkidx = 0;
     VSTAILQ_INSERT_TAIL(&entry->chunks, chunk, chunklist);
-    chunk->occupied = 1;
+    entry->nchunks++;
     return chunk;
 }
 
+static char *
+get_ring(dataentry *entry)
+{
+    CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+
+    entry->data = DATA_Ring_Reserve();
+    if (entry->data == NULL) {
+        submit_flush();
+        spmcq_signal();
+        rdr_exhausted(1);
+        no_free_chunk++;
+        return NULL;
+    }
+    rdr_exhausted(0);
+    return entry->data;
+}
+
+/*
+ * Copy n bytes from p to the end of the data in entry, taking chunks as
+ * needed, and stopping before a null byte in p. If p is NULL, the space is
+ * only reserved. Returns the number of chunks added, or -1 if no chunk
+ * could be taken.
+ */
+static int
+put(dataentry *entry, const char *p, int n)
+{
+    int chunks_added = 0;
+    unsigned chunksz;
+
+    if (config.ring_size > 0) {
+        AN(entry->data);
+        if (p != NULL)
+            n = COPY_Nul(&entry->data[entry->end], p, n);
+    }
+    else {
+        CHECK_OBJ_NOTNULL(entry->curchunk, CHUNK_MAGIC);
+        chunksz = CHUNK_LEN(entry->curchunk);
+        for (int left = n; left > 0; ) {
+            assert(entry->curchunkidx <= chunksz);
+            if (entry->curchunkidx == chunksz) {
+                if (get_chunk(entry) == NULL)
+                    return -1;
+                chunks_added++;
+                chunksz = CHUNK_LEN(entry->curchunk);
+            }
+            int cp = left;
+            if (cp + entry->curchunkidx > chunksz)
+                cp = chunksz - entry->curchunkidx;
+            if (p != NULL) {
+                char *dst = &entry->curchunk->data[entry->curchunkidx];
+                int copied = COPY_Nul(dst, p, cp);
+                if (copied < cp) {
+                    entry->curchunkidx += copied;
+                    n -= left - copied;
+                    break;
+                }
+                p += cp;
+            }
+            entry->curchunkidx += cp;
+            left -= cp;
+        }
+    }
+    entry->end += n;
+    RDR_HI(len_hi, entry->end);
+    return chunks_added;
+}
+
 static unsigned
 append(dataentry *entry, enum VSL_tag_e tag, uint64_t xid, const char *data,
        int datalen)
 {
-    chunk_t *chunk;
-    char *null;
-    const char *p;
-    unsigned chunks_added = 0;
-    int n;
+    int chunks_added, chunks;
+    unsigned start;
 
     CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
     /* Data overflow */
@@ -352,51 +900,51 @@ append(dataentry *entry, enum VSL_tag_e tag, uint64_t xid, const char *data,
         LOG_Log(LOG_ERR, "%s: Data too long, XID=%" PRIu64 ", "
                 "current length=%d, DISCARDING data=[%.*s]", VSL_tags[tag], xid,
                 entry->end, datalen, data);
-        len_overflows++;
+        RDR_INC(len_overflows);
         return -1;
     }
+
+    if ((chunks_added = put(entry, "&", 1)) < 0)
+        return -1;
+    start = entry->end;
+    if ((chunks = put(entry, data, datalen)) < 0)
+        return -1;
     /* Null chars in the payload means that the data was truncated in the
-       log, due to exceeding shm_reclen. */
-    if ((null = memchr(data, '\0', datalen)) != NULL) {
-        datalen = null - data;
+       log, due to exceeding shm_reclen. put() stops at the first one. */
+    if (entry->end - start < datalen) {
+        datalen = entry->end - start;
         LOG_Log(LOG_ERR, "%s: Data truncated in SHM log, XID=%" PRIu64 ", "
                 "data=[%.*s]", VSL_tags[tag], xid, datalen, data);
-        truncated++;
+        RDR_INC(truncated);
     }
+    return chunks_added + chunks;
+}
 
-    assert(entry->curchunkidx <= config.chunk_size);
-    if (entry->curchunkidx == config.chunk_size) {
-        chunk = get_chunk(entry);
-        if (chunk == NULL)
-            return -1;
-        chunks_added++;
-    }
-    entry->curchunk->data[entry->curchunkidx] = '&';
-    entry->curchunkidx++;
-    entry->end++;
+/*
+ * Reserve the space for the request end time after the data, and store
+ * the binary header in it, to be formatted by DATA_Format(). Returns the
+ * number of chunks added, or -1 if the record is discarded.
+ */
+static int
+finish(dataentry *entry, uint64_t xid, const struct timeval *reqend_t)
+{
+    struct datahdr hdr;
+    int chunks_added;
 
-    p = data;
-    n = datalen;
-    while (n > 0) {
-        assert(entry->curchunkidx <= config.chunk_size);
-        if (entry->curchunkidx == config.chunk_size) {
-            chunk = get_chunk(entry);
-            if (chunk == NULL)
-                return -1;
-            chunks_added++;
-        }
-        int cp = n;
-        if (cp + entry->curchunkidx > config.chunk_size)
-            cp = config.chunk_size - entry->curchunkidx;
-        memcpy(&entry->curchunk->data[entry->curchunkidx], p, cp);
-        entry->curchunkidx += cp;
-        p += cp;
-        n -= cp;
+    CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    if (entry->end + DATA_TRL_LEN > config.max_reclen) {
+        LOG_Log(LOG_ERR, "Data too long, XID=%" PRIu64 ", length=%d, "
+                "DISCARDING data", xid, entry->end);
+        RDR_INC(len_overflows);
+        return -1;
     }
-    assert(p == data + datalen);
-    entry->end += datalen;
-    if (entry->end > len_hi)
-        len_hi = entry->end;
+    if ((chunks_added = put(entry, NULL, DATA_TRL_LEN)) < 0)
+        return -1;
+
+    hdr.xid = xid;
+    hdr.sec = (uint32_t) reqend_t->tv_sec;
+    hdr.usec = (uint32_t) reqend_t->tv_usec;
+    DATA_Header(entry, &hdr);
     return chunks_added;
 }
 
@@ -409,38 +957,241 @@ addkey(dataentry *entry, enum VSL_tag_e tag, uint64_t xid, const char *key,
         LOG_Log(LOG_ERR, "%s: Key too long, XID=%" PRIu64 ", length=%d, "
                 "DISCARDING key=[%.*s]", VSL_tags[tag], xid, keylen,
                 keylen, key);
-        key_overflows++;
+        RDR_INC(key_overflows);
         return;
     }
         
     memcpy(entry->key, key, keylen);
     entry->keylen = keylen;
-    if (keylen > key_hi)
-        key_hi = keylen;
+    RDR_HI(key_hi, (unsigned long) keylen);
     return;
 }
 
-static int
-dispatch(struct VSL_data *vsl, struct VSL_transaction * const pt[], void *priv)
+/*
+ * The data record for a transaction is built in struct tx from the log
+ * records of interest, passed one at a time to tx_record(), either by
+ * the reader or by a parse thread.
+ */
+struct tx {
+    dataentry		*de;
+    int64_t		vxid;
+    struct timeval	latest_t;
+    unsigned		chunks_added;
+    int			hasdata;
+};
+
+static inline void
+tx_begin(struct tx *tx)
 {
-    int status = DISPATCH_RETURN_OK, hasdata = 0, chunks = 0;
-    dataentry *de = NULL;
-    char reqend_str[REQEND_T_LEN];
-    int64_t vxid = 0;
-    struct timeval latest_t = { 0, 0 };
-    unsigned chunks_added = 0;
-    (void) priv;
+    memset(tx, 0, sizeof(*tx));
+}
 
-    if (all_wrk_abandoned())
-        return DISPATCH_WRK_ABANDONED;
+/*
+ * Takes the data entry for the transaction when its first VCL_Log record
+ * arrives. Returns -1 if none is available, else 0.
+ */
+static int
+tx_alloc(struct tx *tx, int64_t vxid)
+{
+    dataentry *de;
+    chunk_t *chunk;
+    char *start = NULL;
 
     de = data_get();
     if (de == NULL) {
-        no_free_data++;
-        return status;
+        RDR_INC(no_free_data);
+        return -1;
     }
     CHECK_OBJ(de, DATA_MAGIC);
     assert(!OCCUPIED(de));
+    AZ(de->end);
+
+    if (config.ring_size > 0)
+        start = get_ring(de);
+    else if ((chunk = get_chunk(de)) != NULL) {
+        start = chunk->data;
+        tx->chunks_added++;
+    }
+    if (start == NULL) {
+        if (debug)
+            LOG_Log(LOG_DEBUG, "Free chunks exhausted, "
+                    "DATA DISCARDED: [Tx %" PRId64 "]", vxid);
+        data_free(de);
+        return -1;
+    }
+    tx->de = de;
+    tx->vxid = vxid;
+    /* space for the XID, filled in by the worker */
+    assert(config.chunk_size >= DATA_HDR_LEN);
+    de->curchunkidx = DATA_Xidlen((uint64_t) vxid);
+    de->end = de->curchunkidx;
+    de->occupied = 1;
+    RDR_HI(len_hi, de->end);
+    return 0;
+}
+
+/* Returns -1 if the record was discarded and its entry freed, else 0 */
+static int
+tx_record(struct tx *tx, int64_t vxid, enum VSL_tag_e tag, uint64_t xid,
+          const char *payload, int len)
+{
+    dataentry *de;
+    int datalen, err, chunks;
+    const char *data;
+    vcl_log_t data_type;
+    struct timeval reqend_t;
+
+    if (tag == SLT_VCL_Log && tx->de == NULL && tx_alloc(tx, vxid) != 0)
+        return -1;
+    de = tx->de;
+
+    if (debug)
+        LOG_Log(LOG_DEBUG, "Reader read record: [%" PRIu64 " %s %.*s]",
+                xid, VSL_tags[tag], len, payload);
+
+    switch (tag) {
+    case SLT_VCL_Log:
+        CHECK_OBJ_NOTNULL(de, DATA_MAGIC);
+        AZ(strncmp(payload, TRACKLOG_PREFIX, TRACKLOG_PREFIX_LEN));
+
+        err = Parse_VCL_Log(payload + TRACKLOG_PREFIX_LEN,
+                            len - TRACKLOG_PREFIX_LEN, &data,
+                            &datalen, &data_type);
+        if (err != 0) {
+            LOG_Log(LOG_ERR,
+                    "Cannot parse VCL_Log entry, DISCARDING [%.*s]: %s",
+                    datalen, data, strerror(err));
+            RDR_INC(vcl_log_err);
+        }
+
+        if (debug)
+            LOG_Log(LOG_DEBUG, "%s: XID=%" PRIu64 ", %s=[%.*s]",
+                    VSL_tags[tag], xid,
+                    data_type == VCL_LOG_DATA ? "data" : "key",
+                    datalen, data);
+
+        if (data_type == VCL_LOG_DATA) {
+            chunks = append(de, tag, xid, data, datalen);
+            if (chunks < 0) {
+                if (debug)
+                    LOG_Log(LOG_DEBUG, "Chunks exhausted, DATA "
+                            "DISCARDED: %.*s", datalen, data);
+                data_free(de);
+                return -1;
+            }
+            tx->chunks_added += chunks;
+            tx->hasdata = 1;
+        }
+        else
+            addkey(de, tag, xid, data, datalen);
+        break;
+
+    case SLT_Timestamp:
+        AZ(Parse_Timestamp(payload, len, &reqend_t));
+        if (debug)
+            LOG_Log(LOG_DEBUG, "%s: XID=%" PRIu64 " req_endt=%u.%06lu",
+                    VSL_tags[tag], xid, (unsigned) reqend_t.tv_sec,
+                    reqend_t.tv_usec);
+
+        if (reqend_t.tv_sec > tx->latest_t.tv_sec
+            || (reqend_t.tv_sec == tx->latest_t.tv_sec
+                && reqend_t.tv_usec > tx->latest_t.tv_usec))
+            memcpy(&tx->latest_t, &reqend_t, sizeof(struct timeval));
+        break;
+
+    case SLT_VSL:
+        RDR_INC(vsl_errs);
+        LOG_Log(LOG_ERR, "VSL diagnostic XID=%" PRId64 ": %.*s",
+                vxid, len, payload);
+        break;
+
+    default:
+        WRONG("Unexpected tag read from the Varnish log");
+    }
+    return 0;
+}
+
+/* Submits the record for the transaction, or discards it */
+static void
+tx_end(struct tx *tx)
+{
+    dataentry *de = tx->de;
+    int chunks;
+
+    if (!tx->hasdata) {
+        RDR_INC(no_data);
+        if (de != NULL)
+            data_free(de);
+        return;
+    }
+    CHECK_OBJ_NOTNULL(de, DATA_MAGIC);
+
+    if (tx->latest_t.tv_sec != 0)
+        rdr_newest(tx->latest_t.tv_sec + 1e-6 * tx->latest_t.tv_usec);
+    else {
+        double t = VTIM_real();
+        tx->latest_t.tv_sec = (long) t;
+        tx->latest_t.tv_usec = (t - (double)tx->latest_t.tv_sec) * 1e6;
+        RDR_INC(no_timestamp);
+    }
+    AN(tx->vxid);
+    chunks = finish(de, (uint64_t)tx->vxid, &tx->latest_t);
+    if (chunks < 0) {
+        if (debug)
+            LOG_Log(LOG_DEBUG, "Chunks exhausted, DATA DISCARDED: Tx %" PRId64,
+                    tx->vxid);
+        data_free(de);
+        return;
+    }
+    tx->chunks_added += chunks;
+    de->occupied = 1;
+    MON_StatsUpdate(STATS_OCCUPANCY, tx->chunks_added, 0);
+    data_submit(de, (uint64_t)tx->vxid);
+}
+
+/* Filter for the log records of interest */
+static inline int
+rdr_match(struct VSL_data *vsl, const struct VSL_cursor *c)
+{
+    /* Quick filter for the tags of interest */
+    switch(VSL_TAG(c->rec.ptr)) {
+    case SLT_VCL_Log:
+    case SLT_Timestamp:
+    case SLT_VSL:
+        break;
+    default:
+        return 0;
+    }
+
+    /* Now filter for regexen, etc. */
+    if (!VSL_Match(vsl, c))
+        return 0;
+
+    assert(VSL_CLIENT(c->rec.ptr));
+    return 1;
+}
+
+/*
+ * The shard of a transaction group, by a multiplicative hash of the VXID
+ * of the request. VXIDs are not evenly spread modulo the number of shards,
+ * since Varnish assigns them in sequence to sessions, requests and backend
+ * requests, so the high bits of the product are used.
+ */
+static inline unsigned
+rdr_shard(int64_t vxid)
+{
+    return (unsigned) ((((uint64_t) vxid * 0x9e3779b97f4a7c15ULL) >> 32)
+                       % config.shards);
+}
+
+/* Build the record for a transaction group in the reader */
+static int
+read_tx(struct VSL_data *vsl, struct VSL_transaction * const pt[])
+{
+    int status = DISPATCH_RETURN_OK;
+    struct tx tx;
+
+    tx_begin(&tx);
     seen++;
 
     for (struct VSL_transaction *t = pt[0]; t != NULL; t = *++pt) {
@@ -451,154 +1202,361 @@ dispatch(struct VSL_data *vsl, struct VSL_transaction * const pt[], void *priv)
             continue;
 
         while ((status = VSL_Next(t->c)) > 0) {
-            int len, err;
-            const char *payload;
-            uint64_t xid;
-            enum VSL_tag_e tag;
-
-            /* Quick filter for the tags of interest */
-            switch(VSL_TAG(t->c->rec.ptr)) {
-            case SLT_VCL_Log:
-            case SLT_Timestamp:
-            case SLT_VSL:
-                break;
-            default:
-                continue;
-            }
+            const uint32_t *ptr = t->c->rec.ptr;
 
-            /* Now filter for regexen, etc. */
-            if (!VSL_Match(vsl, t->c))
+            if (!rdr_match(vsl, t->c))
                 continue;
+            if (tx_record(&tx, t->vxid, VSL_TAG(ptr), VSL_ID(ptr),
+                          VSL_CDATA(ptr), VSL_LEN(ptr) - 1) != 0)
+                return status;
+        }
+    }
 
-            assert(VSL_CLIENT(t->c->rec.ptr));
+    tx_end(&tx);
+    return status;
+}
 
-            if (de->end == 0) {
-                chunk_t *chunk;
+/*--------------------------------------------------------------------*/
 
-                chunk = get_chunk(de);
-                if (chunk == NULL) {
-                    if (debug)
-                        LOG_Log(LOG_DEBUG, "Free chunks exhausted, "
-                                "DATA DISCARDED: [Tx %" PRId64 "]", t->vxid);
-                    data_free(de);
-                    return status;
-                }
-                vxid = t->vxid;
-                de->curchunk = chunk;
-                /* XXX: minimum chunk size */
-                snprintf(de->curchunk->data, config.chunk_size, "XID=%" PRId64,
-                         t->vxid);
-                de->curchunkidx = strlen(de->curchunk->data);
-                de->end = de->curchunkidx;
-                de->occupied = 1;
-                if (de->end > len_hi)
-                    len_hi = de->end;
-                chunks_added++;
-            }
+/* make room for n more bytes in the batch */
+static inline void
+raw_reserve(struct rawbatch *b, size_t n)
+{
+    if (b->len + n <= b->size)
+        return;
+    while (b->len + n > b->size)
+        b->size *= 2;
+    b->buf = realloc(b->buf, b->size);
+    AN(b->buf);
+}
 
-            len = VSL_LEN(t->c->rec.ptr) - 1;
-            payload = VSL_CDATA(t->c->rec.ptr);
-            xid = VSL_ID(t->c->rec.ptr);
-            tag = VSL_TAG(t->c->rec.ptr);
-            if (debug)
-                LOG_Log(LOG_DEBUG, "Reader read record: [%" PRIu64 " %s %.*s]",
-                        xid, VSL_tags[tag], len, payload);
-
-            switch (VSL_TAG(t->c->rec.ptr)) {
-                int datalen;
-                const char *data;
-                vcl_log_t data_type;
-                struct timeval reqend_t;
-
-            case SLT_VCL_Log:
-                AZ(strncmp(payload, TRACKLOG_PREFIX, TRACKLOG_PREFIX_LEN));
-        
-                err = Parse_VCL_Log(payload + TRACKLOG_PREFIX_LEN,
-                                    len - TRACKLOG_PREFIX_LEN, &data,
-                                    &datalen, &data_type);
-                if (err != 0) {
-                    LOG_Log(LOG_ERR,
-                            "Cannot parse VCL_Log entry, DISCARDING [%.*s]: %s",
-                            datalen, data, strerror(err));
-                    vcl_log_err++;
-                }
+static inline void
+raw_begin(struct rawbatch *b)
+{
+    struct rawtx *rtx;
+
+    raw_reserve(b, sizeof(*rtx));
+    b->tx = b->len;
+    rtx = (struct rawtx *) (b->buf + b->tx);
+    rtx->vxid = 0;
+    rtx->nrec = rtx->len = 0;
+    b->len += sizeof(*rtx);
+}
 
-                if (debug)
-                    LOG_Log(LOG_DEBUG, "%s: XID=%" PRIu64 ", %s=[%.*s]",
-                            VSL_tags[tag], xid,
-                            data_type == VCL_LOG_DATA ? "data" : "key",
-                            datalen, data);
-
-                if (data_type == VCL_LOG_DATA) {
-                    chunks = append(de, tag, xid, data, datalen);
-                    if (chunks < 0) {
-                        if (debug)
-                            LOG_Log(LOG_DEBUG, "Chunks exhausted, DATA "
-                                    "DISCARDED: %.*s", datalen, data);
-                        data_free(de);
-                        return status;
-                    }
-                    chunks_added += chunks;
-                    hasdata = 1;
-                }
-                else
-                    addkey(de, tag, xid, data, datalen);
-                break;
+static inline void
+raw_add(struct rawbatch *b, int64_t vxid, enum VSL_tag_e tag, uint64_t xid,
+        const char *payload, int len)
+{
+    struct rawtx *rtx;
+    struct rawrec *rec;
+    size_t sz = RAW_ALIGN(sizeof(*rec) + len + 1);
+
+    raw_reserve(b, sz);
+    rtx = (struct rawtx *) (b->buf + b->tx);
+    if (rtx->nrec == 0)
+        rtx->vxid = vxid;
+    rec = (struct rawrec *) (b->buf + b->len);
+    rec->xid = xid;
+    rec->tag = tag;
+    rec->len = len;
+    memcpy(rec + 1, payload, len);
+    ((char *) (rec + 1))[len] = '\0';
+    rtx->nrec++;
+    rtx->len += sz;
+    b->len += sz;
+}
 
-            case SLT_Timestamp:
-                AZ(Parse_Timestamp(payload, len, &reqend_t));
-                if (debug)
-                    LOG_Log(LOG_DEBUG, "%s: XID=%" PRIu64 " req_endt=%u.%06lu",
-                            VSL_tags[tag], xid, (unsigned) reqend_t.tv_sec,
-                            reqend_t.tv_usec);
-
-                if (reqend_t.tv_sec > latest_t.tv_sec
-                    || (reqend_t.tv_sec == latest_t.tv_sec
-                        && reqend_t.tv_usec > latest_t.tv_usec))
-                    memcpy(&latest_t, &reqend_t, sizeof(struct timeval));
+/* Returns 1 if the transaction was kept in the batch, 0 if it was empty */
+static inline int
+raw_end(struct rawbatch *b)
+{
+    struct rawtx *rtx = (struct rawtx *) (b->buf + b->tx);
+
+    if (rtx->nrec == 0) {
+        b->len = b->tx;
+        return 0;
+    }
+    b->ntx++;
+    return 1;
+}
+
+/* the batch being filled by the reader, waits for one if none is free */
+static struct rawbatch *
+raw_batch(void)
+{
+    if (batch != NULL)
+        return batch;
+    AZ(pthread_mutex_lock(&parse_lock));
+    while ((batch = VSTAILQ_FIRST(&parse_free)) == NULL) {
+        batch_waits++;
+        AZ(pthread_cond_wait(&parse_free_cond, &parse_lock));
+    }
+    VSTAILQ_REMOVE_HEAD(&parse_free, list);
+    AZ(pthread_mutex_unlock(&parse_lock));
+    CHECK_OBJ(batch, RAWBATCH_MAGIC);
+    AZ(batch->ntx);
+    AZ(batch->len);
+    return batch;
+}
+
+/* pass the current batch to the parse threads */
+static void
+raw_flush(void)
+{
+    if (batch == NULL || batch->ntx == 0)
+        return;
+    AZ(pthread_mutex_lock(&parse_lock));
+    VSTAILQ_INSERT_TAIL(&parse_full, batch, list);
+    AZ(pthread_cond_signal(&parse_full_cond));
+    AZ(pthread_mutex_unlock(&parse_lock));
+    batch = NULL;
+    batches++;
+}
+
+/* Copy the log records of interest for a transaction group to a batch */
+static int
+copy_tx(struct VSL_data *vsl, struct VSL_transaction * const pt[])
+{
+    int status = DISPATCH_RETURN_OK;
+    struct rawbatch *b = raw_batch();
+
+    seen++;
+    raw_begin(b);
+    for (struct VSL_transaction *t = pt[0]; t != NULL; t = *++pt) {
+        if (debug)
+            LOG_Log(LOG_DEBUG, "Reader read tx: [%" PRId64 "]", t->vxid);
+
+        if (t->type != VSL_t_req)
+            continue;
+
+        while ((status = VSL_Next(t->c)) > 0) {
+            const uint32_t *ptr = t->c->rec.ptr;
+
+            if (!rdr_match(vsl, t->c))
+                continue;
+            raw_add(b, t->vxid, VSL_TAG(ptr), VSL_ID(ptr), VSL_CDATA(ptr),
+                    VSL_LEN(ptr) - 1);
+        }
+    }
+
+    if (!raw_end(b))
+        RDR_INC(no_data);
+    else if (b->ntx == PARSE_BATCH_TX)
+        raw_flush();
+    return status;
+}
+
+/* Build the records for the transactions in a batch */
+static void
+parse_batch(struct rawbatch *b)
+{
+    char *p = b->buf;
+    struct tx tx;
+
+    CHECK_OBJ_NOTNULL(b, RAWBATCH_MAGIC);
+    for (unsigned i = 0; i < b->ntx; i++) {
+        struct rawtx *rtx = (struct rawtx *) p;
+        char *r = p + sizeof(*rtx);
+        unsigned n;
+
+        p = r + rtx->len;
+        tx_begin(&tx);
+        for (n = 0; n < rtx->nrec; n++) {
+            struct rawrec *rec = (struct rawrec *) r;
+
+            if (tx_record(&tx, rtx->vxid, rec->tag, rec->xid,
+                          (const char *) (rec + 1), rec->len) != 0)
                 break;
+            r += RAW_ALIGN(sizeof(*rec) + rec->len + 1);
+        }
+        if (n == rtx->nrec)
+            tx_end(&tx);
+    }
+    submit_flush();
+    assert(p == b->buf + b->len);
+    b->ntx = 0;
+    b->len = 0;
+}
 
-            case SLT_VSL:
-                vsl_errs++;
-                LOG_Log(LOG_ERR, "VSL diagnostic XID=%" PRId64 ": %.*s",
-                        t->vxid, len, payload);
+static void *
+parse_main(void *arg)
+{
+    struct rawbatch *b;
+    unsigned idle, stop;
+    int errnum;
+
+    local = (struct freelist *) arg;
+    freelist_init(local);
+    /* like the reader, each parse thread updates its own stats slot */
+    MON_StatsRegister();
+    if ((errnum = AFF_Thread()) != 0)
+        LOG_Log(LOG_WARNING, "Cannot reset nice value for parse thread: %s",
+                strerror(errnum));
+    numa_self = NUMA_Node();
+
+    for (;;) {
+        AZ(pthread_mutex_lock(&parse_lock));
+        if (VSTAILQ_EMPTY(&parse_full) && !parse_stop)
+            AZ(pthread_cond_wait(&parse_full_cond, &parse_lock));
+        if ((b = VSTAILQ_FIRST(&parse_full)) != NULL)
+            VSTAILQ_REMOVE_HEAD(&parse_full, list);
+        idle = VSTAILQ_EMPTY(&parse_full);
+        stop = parse_stop;
+        AZ(pthread_mutex_unlock(&parse_lock));
+        if (b == NULL) {
+            if (stop)
                 break;
-                    
-            default:
-                WRONG("Unexpected tag read from the Varnish log");
-            }
+            /* woken by parse_kick(), or spuriously */
+            if (DATA_Draining())
+                take_free();
+            continue;
         }
+
+        parse_batch(b);
+
+        AZ(pthread_mutex_lock(&parse_lock));
+        VSTAILQ_INSERT_HEAD(&parse_free, b, list);
+        AZ(pthread_cond_signal(&parse_free_cond));
+        AZ(pthread_mutex_unlock(&parse_lock));
+        /* like the reader at the end of the log, or to drain */
+        if (idle || DATA_Draining())
+            take_free();
     }
+    return NULL;
+}
 
-    if (!hasdata) {
-        no_data++;
-        data_free(de);
-        return status;
+/* Start the parse threads, returns 0 or errno */
+static int
+parse_start(unsigned n)
+{
+    pthread_attr_t attr;
+    int err = 0;
+
+    if (n == 0)
+        return(0);
+    rawbatches = calloc(n * PARSE_BATCHES, sizeof(*rawbatches));
+    if (rawbatches == NULL)
+        return(errno);
+    for (unsigned i = 0; i < n * PARSE_BATCHES; i++) {
+        struct rawbatch *b = &rawbatches[i];
+
+        b->magic = RAWBATCH_MAGIC;
+        b->size = config.max_reclen;
+        if ((b->buf = malloc(b->size)) == NULL)
+            return(errno);
+        VSTAILQ_INSERT_TAIL(&parse_free, b, list);
     }
 
-    if (latest_t.tv_sec == 0) {
-        double t = VTIM_real();
-        latest_t.tv_sec = (long) t;
-        latest_t.tv_usec = (t - (double)latest_t.tv_sec) * 1e6;
-        no_timestamp++;
-    }
-    snprintf(reqend_str, REQEND_T_LEN, "%s=%u.%06lu", REQEND_T_VAR,
-             (unsigned) latest_t.tv_sec, latest_t.tv_usec);
-    AN(vxid);
-    chunks = append(de, SLT_Timestamp, (uint64_t)vxid, reqend_str,
-                    REQEND_T_LEN - 1);
-    if (chunks < 0) {
-        if (debug)
-            LOG_Log(LOG_DEBUG, "Chunks exhausted, DATA DISCARDED: Tx %" PRId64,
-                    vxid);
-        data_free(de);
-        return status;
+    AZ(pthread_attr_init(&attr));
+    AFF_Attr(&attr, AFF_WORKER);
+    parse_stop = 0;
+    /* set first, the threads share the free data by their number */
+    nparsers = n;
+    for (unsigned i = 0; i < n; i++)
+        if ((err = pthread_create(&parsers[i], &attr, parse_main,
+                                  &rdr_free[i + 1])) != 0) {
+            nparsers = i;
+            break;
+        }
+    AZ(pthread_attr_destroy(&attr));
+    return(err);
+}
+
+/*
+ * Wake the idle parse threads while a segment is draining, so that they
+ * pass their local freelists to DATA_Drain(). Called by the reader at the
+ * end of the log.
+ */
+static void
+parse_kick(void)
+{
+    if (nparsers == 0 || !DATA_Draining())
+        return;
+    AZ(pthread_mutex_lock(&parse_lock));
+    AZ(pthread_cond_broadcast(&parse_full_cond));
+    AZ(pthread_mutex_unlock(&parse_lock));
+}
+
+/* Parse the pending batches, and stop the parse threads */
+static void
+parse_shutdown(void)
+{
+    if (nparsers == 0)
+        return;
+    raw_flush();
+    AZ(pthread_mutex_lock(&parse_lock));
+    parse_stop = 1;
+    AZ(pthread_cond_broadcast(&parse_full_cond));
+    AZ(pthread_mutex_unlock(&parse_lock));
+    for (unsigned i = 0; i < nparsers; i++) {
+        struct freelist *fl = &rdr_free[i + 1];
+
+        AZ(pthread_join(parsers[i], NULL));
+        /* so that the reader and workers may use or drain them */
+        AZ(fl->nsubmit);
+        if (fl->nrec > 0)
+            DATA_Return_Freerec(&fl->rec, fl->nrec);
+        if (fl->nchunk > 0)
+            DATA_Return_Freechunk(fl->chunk, fl->nchunk);
+        freelist_init(fl);
     }
-    chunks_added += chunks;
-    de->occupied = 1;
-    MON_StatsUpdate(STATS_OCCUPANCY, chunks_added, 0);
-    data_submit(de);
-        
+    LOG_Log(LOG_INFO, "%u parse threads stopped", nparsers);
+}
+
+/*
+ * Initialize the MQ implementation, which may start threads of its own.
+ * Run in a thread started with the attributes of a worker, so that the
+ * plugin's threads do not inherit the reader's CPUs or real-time
+ * scheduling. Sets *failed to 1 on error.
+ */
+static void *
+mq_init(void *arg)
+{
+    int *failed = (int *) arg;
+    const char *errmsg;
+    int errnum;
+
+    if ((errnum = AFF_Thread()) != 0)
+        LOG_Log(LOG_WARNING, "Cannot reset nice value for message broker "
+                "initialization: %s", strerror(errnum));
+
+    errmsg = mqf.global_init(config.nworkers, config.mq_config_file);
+    if (errmsg != NULL) {
+        LOG_Log(LOG_CRIT, "Cannot initialize message broker access: %s",
+                errmsg);
+        *failed = 1;
+        return NULL;
+    }
+
+    errmsg = mqf.init_connections();
+    if (errmsg != NULL) {
+        LOG_Log(LOG_CRIT, "Cannot initialize message broker connections: %s",
+                errmsg);
+        *failed = 1;
+    }
+    return NULL;
+}
+
+static int
+dispatch(struct VSL_data *vsl, struct VSL_transaction * const pt[], void *priv)
+{
+    int status;
+    (void) priv;
+
+    if (all_wrk_abandoned())
+        return DISPATCH_WRK_ABANDONED;
+    dispatched++;
+
+    /* discard the transactions of other shards before reading them */
+    if (config.shards > 1 && rdr_shard(pt[0]->vxid) != shard_self) {
+        skipped++;
+        status = DISPATCH_RETURN_OK;
+    }
+    else if (nparsers > 0)
+        status = copy_tx(vsl, pt);
+    else
+        status = read_tx(vsl, pt);
+
     if (term)
         return DISPATCH_TERMINATE;
     if (need_wrk_restart())
@@ -609,9 +1567,10 @@ dispatch(struct VSL_data *vsl, struct VSL_transaction * const pt[], void *priv)
 /*--------------------------------------------------------------------*/
 
 void
-CHILD_Main(int readconfig)
+CHILD_Main(int readconfig, unsigned shard)
 {
     int errnum, status = DISPATCH_CONTINUE;
+    unsigned shards = config.shards;
     const char *errmsg;
     pthread_t monitor;
     struct passwd *pw;
@@ -620,14 +1579,19 @@ CHILD_Main(int readconfig)
     struct VSLQ *vslq;
     struct vsm *vsm = NULL;
     struct VSL_cursor *cursor;
-    unsigned long last_seen = 0;
-    double last_t;
     char *vsm_name = NULL;
 
     MON_StatsInit();
+    /* the reader thread updates its own stats slot */
+    MON_StatsRegister();
     debug = (LOG_GetLevel() == LOG_DEBUG);
+    shard_self = shard;
         
-    LOG_Log0(LOG_NOTICE, "Worker process starting");
+    if (shards > 1)
+        LOG_Log(LOG_NOTICE, "Worker process starting for shard %u of %u",
+                shard, shards);
+    else
+        LOG_Log0(LOG_NOTICE, "Worker process starting");
 
     /* XXX: does not re-configure logging. Feature or bug? */
     if (readconfig) {
@@ -642,7 +1606,21 @@ CHILD_Main(int readconfig)
                     cli_config_filename);
             exit(EXIT_FAILURE);
         }
+        /* the management process forked the children for the shards */
+        if (config.shards != shards)
+            LOG_Log(LOG_WARNING, "shards cannot be changed by a reload, "
+                    "keeping shards = %u", shards);
+        config.shards = shards;
+    }
+
+    /* scheduling the reader may need privileges */
+    if ((errnum = AFF_Init()) != 0) {
+        LOG_Log(LOG_CRIT, "Cannot read CPU lists: %s", strerror(errnum));
+        exit(EXIT_FAILURE);
     }
+    if ((errnum = AFF_Reader()) != 0)
+        LOG_Log(LOG_WARNING, "Cannot set reader affinity or scheduling: %s",
+                strerror(errnum));
 
     PRIV_Sandbox();
     pw = getpwuid(geteuid());
@@ -671,8 +1649,15 @@ CHILD_Main(int readconfig)
         LOG_Log(LOG_CRIT, "error loading mq method %s: %s", #intfm, errmsg); \
         exit(EXIT_FAILURE);                                             \
     }
+#define OPTMETHOD(instm, intfm)                                         \
+    mqf.instm = dlsym(mqh, #intfm);                                     \
+    if ((errmsg = dlerror()) != NULL) {                                 \
+        LOG_Log(LOG_INFO, "mq method %s not provided", #intfm);         \
+        mqf.instm = NULL;                                               \
+    }
 #include "methods.h"
 #undef METHOD
+#undef OPTMETHOD
 
     /* install signal handlers */
     dump_action.sa_handler = dump;
@@ -693,10 +1678,34 @@ CHILD_Main(int readconfig)
 #undef PARENT
 #undef CHILD
 
+    if ((errnum = NUMA_Init()) != 0) {
+        LOG_Log(LOG_CRIT, "Cannot read NUMA topology: %s", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+    /*
+     * the reader stays on the node where it started, or on the node of
+     * the CPUs in reader.cpus
+     */
+    if (numa_nodes > 1) {
+        numa_self = numa_home = NUMA_Node();
+        if (EMPTY(config.reader_cpus)
+            && (errnum = NUMA_Bind_Thread(numa_home)) != 0)
+            LOG_Log(LOG_WARNING, "Cannot bind reader to NUMA node %u: %s",
+                    numa_home, strerror(errnum));
+    }
+
+    COPY_Init();
+    LOG_Log(LOG_INFO, "Payload copy: %s", COPY_Name());
+
+    freelist_init(&rdr_free[0]);
     if (DATA_Init() != 0) {
         LOG_Log(LOG_CRIT, "Cannot init data table: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    DATA_Log();
+    NUMA_Log();
+    if (numa_nodes > 1)
+        LOG_Log(LOG_INFO, "Reader running on NUMA node %u", numa_home);
 
     vsl = VSL_New();
 
@@ -735,7 +1744,8 @@ CHILD_Main(int readconfig)
         LOG_Log(LOG_CRIT, "Cannot open log: %s\n", VSL_Error(vsl));
         exit(EXIT_FAILURE);
     }
-    vslq = VSLQ_New(vsl, &cursor, VSL_g_request, NULL);
+    rdr_lag_init(vsm, cursor);
+    vslq = VSLQ_New(vsl, &cursor, VSL_g_request, TRACK_QUERY);
     if (vslq == NULL) {
         LOG_Log(LOG_CRIT, "Cannot init log query: %s\n", VSL_Error(vsl));
         exit(EXIT_FAILURE);
@@ -758,28 +1768,40 @@ CHILD_Main(int readconfig)
 
     /* Start the monitor thread */
     if (config.monitor_interval > 0.0) {
-        if (pthread_create(&monitor, NULL, MON_StatusThread,
-                           (void *) &config.monitor_interval) != 0) {
+        pthread_attr_t attr;
+
+        AZ(pthread_attr_init(&attr));
+        AFF_Attr(&attr, AFF_MONITOR);
+        if ((errnum = pthread_create(&monitor, &attr, MON_StatusThread,
+                                     (void *) &config.monitor_interval))
+            != 0) {
             LOG_Log(LOG_CRIT, "Cannot start monitoring thread: %s\n",
-                    strerror(errno));
+                    strerror(errnum));
             exit(EXIT_FAILURE);
         }
+        AZ(pthread_attr_destroy(&attr));
     }
     else
         LOG_Log0(LOG_INFO, "Monitoring thread not running");
 
-    errmsg = mqf.global_init(config.nworkers, config.mq_config_file);
-    if (errmsg != NULL) {
-        LOG_Log(LOG_CRIT, "Cannot initialize message broker access: %s",
-                errmsg);
-        exit(EXIT_FAILURE);
-    }
-
-    errmsg = mqf.init_connections();
-    if (errmsg != NULL) {
-        LOG_Log(LOG_CRIT, "Cannot initialize message broker connections: %s",
-                errmsg);
-        exit(EXIT_FAILURE);
+    /* Initialize the MQ implementation off the reader, see mq_init() */
+    {
+        pthread_attr_t attr;
+        pthread_t mq_thread;
+        int mq_failed = 0;
+
+        AZ(pthread_attr_init(&attr));
+        AFF_Attr(&attr, AFF_WORKER);
+        if ((errnum = pthread_create(&mq_thread, &attr, mq_init, &mq_failed))
+            != 0) {
+            LOG_Log(LOG_CRIT, "Cannot start message broker initialization: "
+                    "%s", strerror(errnum));
+            exit(EXIT_FAILURE);
+        }
+        AZ(pthread_attr_destroy(&attr));
+        AZ(pthread_join(mq_thread, NULL));
+        if (mq_failed)
+            exit(EXIT_FAILURE);
     }
 
     errnum = WRK_Init();
@@ -788,6 +1810,11 @@ CHILD_Main(int readconfig)
                 strerror(errnum));
         exit(EXIT_FAILURE);
     }
+    if (config.parse_threads > 0 && config.ring_size > 0) {
+        LOG_Log0(LOG_WARNING, "parse.threads is not used with ring.size, "
+                 "transactions are parsed by the reader");
+        config.parse_threads = 0;
+    }
     if ((errnum = SPMCQ_Init()) != 0) {
         LOG_Log(LOG_CRIT, "Cannot initialize internal worker queue: %s",
                 strerror(errnum));
@@ -810,39 +1837,42 @@ CHILD_Main(int readconfig)
     }
     else
         LOG_Log0(LOG_INFO, "Worker threads not running");
-        
+
+    if ((errnum = parse_start(config.parse_threads)) != 0) {
+        LOG_Log(LOG_CRIT, "Cannot start parse threads: %s", strerror(errnum));
+        exit(EXIT_FAILURE);
+    }
+    if (nparsers > 0)
+        LOG_Log(LOG_INFO, "%u parse threads running", nparsers);
+
     /* Main loop */
     if (vsm != NULL)
         (void)VSM_Status(vsm);
-    last_t = VTIM_mono();
+    rdr_poll_init();
     term = 0;
     while (!term) {
         status = VSLQ_Dispatch(vslq, dispatch, NULL);
+        submit_flush();
+        rdr_lag();
+        if (status != DISPATCH_CONTINUE)
+            raw_flush();
         switch(status) {
         case DISPATCH_CONTINUE:
         case DISPATCH_WRK_RESTART:
         case DISPATCH_WRK_ABANDONED:
             break;
         case DISPATCH_EOL:
-            take_free();
+            if (nparsers == 0)
+                take_free();
+            else
+                parse_kick();
             eol++;
-            /* re-adjust idle pause every 1024 seen txn */
-            if ((seen & (~0UL << 10)) > (last_seen & (~0UL << 10))) {
-                double t = VTIM_mono();
-                idle_pause = (t - last_t) / (double) (seen - last_seen);
-                last_seen = seen;
-                if (idle_pause > MAX_IDLE_PAUSE)
-                    idle_pause = MAX_IDLE_PAUSE;
-                if (idle_pause < 1e-6)
-                    idle_pause = 1e-6;
-                last_t = t;
-            }
             if (vsm != NULL &&
                 (VSM_Status(vsm) & (VSM_MGT_CHANGED | VSM_MGT_RESTARTED))) {
                 flush = 1;
                 restart = 1;
             }
-            VTIM_sleep(idle_pause);
+            rdr_idle();
             break;
         case DISPATCH_TERMINATE:
             AN(term);
@@ -893,9 +1923,12 @@ CHILD_Main(int readconfig)
 
         if (flush && !term) {
             LOG_Log0(LOG_NOTICE, "Flushing transactions");
-            take_free();
+            if (nparsers == 0)
+                take_free();
             do {}
             while (VSLQ_Flush(vslq, dispatch, NULL) != DISPATCH_RETURN_OK);
+            submit_flush();
+            raw_flush();
             flush = 0;
             if (!restart && EMPTY(config.varnish_bindump)
                 && status != DISPATCH_CLOSED && status != DISPATCH_OVERRUN
@@ -903,6 +1936,7 @@ CHILD_Main(int readconfig)
                 continue;
             VSLQ_Delete(&vslq);
             AZ(vslq);
+            rdr_lag_init(NULL, NULL);
             if (restart
                 || (VSM_Status(vsm) & (VSM_MGT_CHANGED | VSM_MGT_RESTARTED))) {
                 mgt_restart++;
@@ -946,7 +1980,8 @@ CHILD_Main(int readconfig)
                     VSL_ResetError(vsl);
                     continue;
                 }
-                vslq = VSLQ_New(vsl, &cursor, VSL_g_request, NULL);
+                rdr_lag_init(vsm, cursor);
+                vslq = VSLQ_New(vsl, &cursor, VSL_g_request, TRACK_QUERY);
                 AZ(cursor);
             }
             if (vslq != NULL) {
@@ -958,11 +1993,14 @@ CHILD_Main(int readconfig)
 
     if (term && status != DISPATCH_EOF && flush && vslq != NULL) {
         LOG_Log0(LOG_NOTICE, "Flushing transactions");
-        take_free();
+        if (nparsers == 0)
+            take_free();
         do {}
         while (VSLQ_Flush(vslq, dispatch, NULL) != DISPATCH_RETURN_OK);
+        submit_flush();
     }
 
+    parse_shutdown();
     WRK_Halt();
     WRK_Shutdown();
     if ((errmsg = mqf.global_shutdown()) != NULL)
@@ -1000,13 +2038,14 @@ static char
     entry.magic = DATA_MAGIC;
     VSTAILQ_INIT(&entry.chunks);
     chunk.magic = CHUNK_MAGIC;
+    chunk.class = 0;
     chunk.data = (char *) calloc(1, config.max_reclen);
     VSTAILQ_INSERT_TAIL(&entry.chunks, &chunk, chunklist);
     entry.curchunk = &chunk;
     entry.curchunkidx = 0;
+    entry.nchunks = 1;
     entry.end = 0;
     entry.occupied = 1;
-    chunk.occupied = 1;
     truncated = len_overflows = len_hi = 0;
     strcpy(config.log_file, "-");
     AZ(LOG_Open("test_append"));
@@ -1054,13 +2093,14 @@ static char
     entry.magic = DATA_MAGIC;
     VSTAILQ_INIT(&entry.chunks);
     chunk.magic = CHUNK_MAGIC;
+    chunk.class = 0;
     chunk.data = (char *) calloc(1, config.max_reclen);
     VSTAILQ_INSERT_TAIL(&entry.chunks, &chunk, chunklist);
     entry.curchunk = &chunk;
     entry.curchunkidx = 0;
+    entry.nchunks = 1;
     entry.end = 0;
     entry.occupied = 1;
-    chunk.occupied = 1;
     truncated = len_hi = 0;
     strcpy(config.log_file, "-");
     AZ(LOG_Open("test_append"));
@@ -1077,11 +2117,381 @@ static char
     return NULL;
 }
 
+static char
+*test_copy(void)
+{
+    char src[200], dst[200];
+    const char *name;
+    copy_nul_f *copy;
+
+    printf("... testing payload copy\n");
+
+    for (unsigned i = 0; i < sizeof(src); i++)
+        src[i] = 'a' + i % 26;
+    for (unsigned impl = 0; (copy = COPY_Impl(impl, &name)) != NULL; impl++) {
+        printf("    %s\n", name);
+        for (unsigned off = 0; off < 4; off++)
+            for (unsigned len = 0; len <= 100; len++) {
+                /* a null byte at each position, or none if nul == len */
+                for (unsigned nul = 0; nul <= len; nul++) {
+                    if (nul < len)
+                        src[off + nul] = '\0';
+                    memset(dst, 'X', sizeof(dst));
+                    size_t n = copy(dst + off, src + off, len);
+                    VMASSERT(n == nul, "%s: off=%u len=%u nul=%u n=%zu",
+                             name, off, len, nul, n);
+                    MAZ(memcmp(dst + off, src + off, n));
+                    MASSERT(dst[off + n] == 'X');
+                    src[off + nul] = 'a' + (off + nul) % 26;
+                }
+            }
+    }
+    MASSERT(COPY_Impl(0, NULL) != NULL);
+    return NULL;
+}
+
+static char
+*test_append_classes(void)
+{
+    dataentry *entry;
+    chunk_t *c;
+    chunkhead_t aside[MAX_CHUNK_CLASSES];
+    char data[DEF_MAX_RECLEN - 1], result[DEF_MAX_RECLEN];
+    unsigned chunks_added, idx = 0;
+    int n;
+
+    printf("... testing data append with chunk size classes\n");
+
+    config.max_reclen = DEF_MAX_RECLEN;
+    config.chunk_size = DEF_CHUNK_SIZE;
+    config.chunk_classes = 3;
+    config.chunk_classes_percent = 100;
+    config.max_records = DEF_MAX_RECORDS;
+    MAZ(DATA_Init());
+    freelist_init(local);
+    len_hi = 0;
+
+    entry = data_get();
+    MCHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    MAN(get_chunk(entry));
+    MASSERT(entry->nchunks == 1);
+
+    for (int i = 0; i < DEF_MAX_RECLEN - 1; i++)
+        data[i] = (i % 10) + '0';
+
+    /* 256 + 512 bytes fill the first two chunks */
+    chunks_added = append(entry, SLT_VCL_Log, 12345678, data,
+                          DEF_CHUNK_SIZE * 3 - 1);
+    MASSERT(chunks_added == 1);
+    MASSERT(entry->nchunks == 2);
+    MASSERT(entry->curchunkidx == DEF_CHUNK_SIZE * 2);
+
+    chunks_added = append(entry, SLT_VCL_Log, 12345678, data,
+                          DEF_MAX_RECLEN - DEF_CHUNK_SIZE * 3 - 1);
+    MASSERT(chunks_added == 1);
+    MASSERT(entry->nchunks == 3);
+    MASSERT(entry->end == DEF_MAX_RECLEN);
+
+    n = entry->end;
+    c = VSTAILQ_FIRST(&entry->chunks);
+    for (unsigned i = 0; n > 0; i++) {
+        CHECK_OBJ_NOTNULL(c, CHUNK_MAGIC);
+        MASSERT(c->class == CHUNK_CLASS(i));
+        int cp = n;
+        if (cp > CHUNK_LEN(c))
+            cp = CHUNK_LEN(c);
+        memcpy(&result[idx], c->data, cp);
+        n -= cp;
+        idx += cp;
+        c = VSTAILQ_NEXT(c, chunklist);
+    }
+    MAZ(c);
+    MASSERT(result[0] == '&');
+    MASSERT(memcmp(&result[1], data, DEF_CHUNK_SIZE * 3 - 1) == 0);
+    MASSERT(result[DEF_CHUNK_SIZE * 3] == '&');
+    MASSERT(memcmp(&result[DEF_CHUNK_SIZE * 3 + 1], data,
+                   DEF_MAX_RECLEN - DEF_CHUNK_SIZE * 3 - 1) == 0);
+
+    /* with the larger classes exhausted, chunks fall back to class 0 */
+    for (int i = 1; i < MAX_CHUNK_CLASSES; i++) {
+        VSTAILQ_INIT(&aside[i]);
+        VSTAILQ_CONCAT(&aside[i], &local->chunk[i]);
+    }
+    chunk_fallback = 0;
+    entry = data_get();
+    MCHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    MAN(get_chunk(entry));
+    chunks_added = append(entry, SLT_VCL_Log, 12345678, data,
+                          DEF_CHUNK_SIZE * 3 - 1);
+    MASSERT(chunks_added == 2);
+    MASSERT(entry->nchunks == 3);
+    MASSERT(chunk_fallback == 2);
+    VSTAILQ_FOREACH(c, &entry->chunks, chunklist)
+        MAZ(c->class);
+    for (int i = 1; i < MAX_CHUNK_CLASSES; i++)
+        VSTAILQ_CONCAT(&local->chunk[i], &aside[i]);
+
+    config.chunk_classes = 1;
+    return NULL;
+}
+
+static char
+*test_idle(void)
+{
+    printf("... testing adaptive polling at the end of the log\n");
+
+    config.idle_pause = 1e-3;
+    seen = 0;
+    spins = yields = sleeps = wakes = 0;
+    rdr_poll_init();
+
+    /* no arrivals yet: yield, then sleep with backoff up to idle.pause */
+    for (int i = 0; i < POLL_YIELDS; i++)
+        rdr_idle();
+    MAZ(spins);
+    MASSERT(yields == POLL_YIELDS);
+    MAZ(sleeps);
+    for (int i = 0; i < 16; i++)
+        rdr_idle();
+    MASSERT(sleeps == 16);
+    MASSERT(rdr_poll.pause == config.idle_pause);
+    MAZ(wakes);
+
+    /* a high arrival rate: spin first, and start with a short sleep */
+    seen += 1000;
+    rdr_poll.last_t = VTIM_mono() - 1e-3;
+    rdr_idle();
+    MASSERT(wakes == 1);
+    MASSERT(rdr_poll.rate * POLL_SPIN_GAP >= 1.);
+    MASSERT(rdr_poll.pause < config.idle_pause);
+    MASSERT(spins == 1);
+    for (int i = 1; i < POLL_SPINS + POLL_YIELDS; i++)
+        rdr_idle();
+    MASSERT(spins == POLL_SPINS);
+    MASSERT(yields == 2 * POLL_YIELDS);
+    MASSERT(sleeps == 16);
+
+    config.idle_pause = DEF_IDLE_PAUSE;
+    return NULL;
+}
+
+static char
+*test_lag(void)
+{
+    struct VSL_head *head;
+    struct VSL_cursor c;
+    ssize_t segsize = 16;
+
+    printf("... testing reader lag\n");
+
+    head = calloc(1, sizeof(*head)
+                  + VSL_SEGMENTS * segsize * sizeof(head->log[0]));
+    MAN(head);
+    head->segsize = segsize;
+    for (unsigned i = 0; i < VSL_SEGMENTS; i++)
+        head->offset[i] = i * segsize;
+    /* Varnish writes in segment 10, the reader is in segment 7 */
+    head->segment_n = 10;
+    c.rec.priv = 7;
+    c.rec.ptr = &head->log[7 % VSL_SEGMENTS * segsize + 4];
+    vsl_head = head;
+    rdr_cursor = &c;
+    lag_seg_hi = lag_seg_hi_this = 0;
+    lag_bytes_hi = 0;
+
+    rdr_lag();
+    MASSERT(lag_seg == 3);
+    MASSERT(lag_seg_hi == 3);
+    MASSERT(lag_bytes == VSL_BYTES(3 * segsize - 4));
+
+    /* caught up, high watermarks remain */
+    c.rec.priv = 10;
+    c.rec.ptr = &head->log[10 % VSL_SEGMENTS * segsize + 1];
+    rdr_lag();
+    MAZ(lag_seg);
+    MAZ(lag_bytes);
+    MASSERT(lag_seg_hi_this == 3);
+    MASSERT(lag_bytes_hi == VSL_BYTES(3 * segsize - 4));
+
+    /* age of the newest transaction */
+    newest_t = VTIM_real() - 2.;
+    rdr_lag();
+    MASSERT(lag_age >= 2. && lag_age < 3.);
+    MASSERT(lag_age_hi == lag_age);
+    MAZ(newest_t);
+
+    vsl_head = NULL;
+    rdr_cursor = NULL;
+    free(head);
+    return NULL;
+}
+
+#define TS_RESP "Resp: 1430176881.682097 0.000000 0.000000"
+
+static char
+*test_parse_batch(void)
+{
+    struct rawbatch *b;
+    struct tx tx;
+    dataentry *entry;
+    unsigned long nodata;
+    char *data;
+    int n;
+
+    printf("... testing the parse pipeline\n");
+
+    config.max_reclen = DEF_MAX_RECLEN;
+    config.chunk_size = DEF_CHUNK_SIZE;
+    config.max_records = DEF_MAX_RECORDS;
+    config.maxkeylen = DEF_MAXKEYLEN;
+    config.ring_size = 0;
+    config.queue_ring = 0;
+    MAZ(DATA_Init());
+    MAZ(SPMCQ_Init());
+    freelist_init(local);
+    nodata = no_data;
+
+    /* the batch grows as needed */
+    b = calloc(1, sizeof(*b));
+    MAN(b);
+    b->magic = RAWBATCH_MAGIC;
+    b->size = 16;
+    b->buf = malloc(b->size);
+    MAN(b->buf);
+
+    raw_begin(b);
+    raw_add(b, 1001, SLT_VCL_Log, 1002, "track foo=bar", 13);
+    raw_add(b, 1002, SLT_VCL_Log, 1002, "track key abc", 13);
+    raw_add(b, 1001, SLT_Timestamp, 1001, TS_RESP, sizeof(TS_RESP) - 1);
+    MASSERT(raw_end(b) == 1);
+    /* no records of interest */
+    raw_begin(b);
+    MAZ(raw_end(b));
+    /* no data */
+    raw_begin(b);
+    raw_add(b, 1003, SLT_Timestamp, 1003, TS_RESP, sizeof(TS_RESP) - 1);
+    MASSERT(raw_end(b) == 1);
+    MASSERT(b->ntx == 2);
+    MASSERT(b->len <= b->size);
+
+    parse_batch(b);
+    MAZ(b->ntx);
+    MAZ(b->len);
+    MASSERT(no_data == nodata + 1);
+
+    /* no data entry is taken before the first VCL_Log record */
+    tx_begin(&tx);
+    MAZ(tx_record(&tx, 1004, SLT_Timestamp, 1004, TS_RESP,
+                  sizeof(TS_RESP) - 1));
+    MAZ(tx.de);
+    tx_end(&tx);
+    MASSERT(no_data == nodata + 2);
+
+    SPMCQ_Drain();
+    entry = SPMCQ_Deq();
+    MCHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    MAZ(SPMCQ_Deq());
+    DATA_Format(entry);
+    data = VSTAILQ_FIRST(&entry->chunks)->data;
+    n = DATA_LEN(entry);
+    VMASSERT(n == sizeof("XID=1001&foo=bar&req_endt=1430176881.682097") - 1
+             && memcmp(data, "XID=1001&foo=bar&req_endt=1430176881.682097",
+                       n) == 0, "data=[%.*s]", n, data);
+    MASSERT(entry->keylen == 3 && memcmp(entry->key, "abc", 3) == 0);
+    data_free(entry);
+    free(b->buf);
+    free(b);
+
+    /* max.reclen limits the length of the formatted record */
+    char *payload = malloc(DEF_MAX_RECLEN);
+    unsigned long overflows = len_overflows;
+    MAN(payload);
+    n = DEF_MAX_RECLEN - strlen("XID=1005&") - DATA_TRL_LEN;
+    memcpy(payload, TRACKLOG_PREFIX, TRACKLOG_PREFIX_LEN);
+    memset(payload + TRACKLOG_PREFIX_LEN, 'a', n + 1);
+    for (int extra = 0; extra < 2; extra++) {
+        tx_begin(&tx);
+        MAZ(tx_record(&tx, 1005, SLT_VCL_Log, 1005, payload,
+                      TRACKLOG_PREFIX_LEN + n + extra));
+        MAZ(tx_record(&tx, 1005, SLT_Timestamp, 1005, TS_RESP,
+                      sizeof(TS_RESP) - 1));
+        tx_end(&tx);
+    }
+    MASSERT(len_overflows == overflows + 1);
+    submit_flush();
+    SPMCQ_Drain();
+    entry = SPMCQ_Deq();
+    MCHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    MAZ(SPMCQ_Deq());
+    DATA_Format(entry);
+    MASSERT(DATA_LEN(entry) == DEF_MAX_RECLEN);
+    data_free(entry);
+    free(payload);
+
+    /* the same through parse threads, which take the free data */
+    DATA_Return_Freerec(&local->rec, local->nrec);
+    DATA_Return_Freechunk(local->chunk, local->nchunk);
+    freelist_init(local);
+    MAZ(parse_start(2));
+    MASSERT(nparsers == 2);
+    for (int i = 0; i < PARSE_BATCH_TX * 3 + 1; i++) {
+        b = raw_batch();
+        raw_begin(b);
+        raw_add(b, i + 1, SLT_VCL_Log, i + 1, "track foo=bar", 13);
+        MASSERT(raw_end(b) == 1);
+        if (b->ntx == PARSE_BATCH_TX)
+            raw_flush();
+    }
+    parse_shutdown();
+    /* the parse threads' free data are returned */
+    for (unsigned i = 1; i <= nparsers; i++) {
+        MAZ(rdr_free[i].nrec);
+        MAZ(rdr_free[i].nchunk);
+    }
+    SPMCQ_Drain();
+    n = 0;
+    while ((entry = SPMCQ_Deq()) != NULL) {
+        MCHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+        n++;
+    }
+    MASSERT(n == PARSE_BATCH_TX * 3 + 1);
+    MASSERT(batches == 4);
+
+    nparsers = 0;
+    return NULL;
+}
+
+static char
+*test_shard(void)
+{
+    unsigned n[4] = { 0 };
+
+    printf("... testing shards\n");
+
+    config.shards = 4;
+    /* request VXIDs of sessions with one request, all odd */
+    for (int64_t vxid = 1; vxid < 8000; vxid += 2)
+        n[rdr_shard(vxid)]++;
+    for (unsigned i = 0; i < 4; i++)
+        VMASSERT(n[i] > 800 && n[i] < 1200, "shard %u: %u of 4000", i, n[i]);
+
+    config.shards = 1;
+    for (int64_t vxid = 1; vxid < 1000; vxid++)
+        MAZ(rdr_shard(vxid));
+    return NULL;
+}
+
 static const char
 *all_tests(void)
 {
     mu_run_test(test_append);
     mu_run_test(test_truncated);
+    mu_run_test(test_copy);
+    mu_run_test(test_append_classes);
+    mu_run_test(test_idle);
+    mu_run_test(test_lag);
+    mu_run_test(test_parse_batch);
+    mu_run_test(test_shard);
     return NULL;
 }
 
@@ -121,6 +121,25 @@ conf_getUnsignedInt(const char *rval, unsigned *i)
         return 0;                                               \
     }
 
+#define confBool(name,fld)                      \
+    if (strcmp(lval, (name)) == 0) {            \
+        if (strcasecmp(rval, "true") == 0       \
+            || strcasecmp(rval, "on") == 0      \
+            || strcasecmp(rval, "yes") == 0     \
+            || strcmp(rval, "1") == 0) {        \
+            config.fld = true;                  \
+            return(0);                          \
+        }                                       \
+        if (strcasecmp(rval, "false") == 0      \
+            || strcasecmp(rval, "off") == 0     \
+            || strcasecmp(rval, "no") == 0      \
+            || strcmp(rval, "0") == 0) {        \
+            config.fld = false;                 \
+            return(0);                          \
+        }                                       \
+        return(EINVAL);                         \
+    }
+
 int
 CONF_Add(const char *lval, const char *rval)
 {
@@ -136,6 +155,9 @@ CONF_Add(const char *lval, const char *rval)
     confString("varnish.bindump", varnish_bindump);
     confString("mq.module", mq_module);
     confString("mq.config_file", mq_config_file);
+    confString("reader.cpus", reader_cpus);
+    confString("worker.cpus", worker_cpus);
+    confString("monitor.cpus", monitor_cpus);
 
     confUnsigned("max.reclen", max_reclen);
     confUnsigned("maxkeylen", maxkeylen);
@@ -147,10 +169,21 @@ CONF_Add(const char *lval, const char *rval)
     confUnsigned("thread.restarts", thread_restarts);
     confUnsigned("monitor.interval", monitor_interval);
     confUnsigned("tx.limit", tx_limit);
+    confUnsigned("ring.size", ring_size);
+    confUnsigned("max.records.limit", max_records_limit);
 
     confNonNegativeDouble("idle.pause", idle_pause);
     confNonNegativeDouble("tx.timeout", tx_timeout);
 
+    confBool("monitor.workers", monitor_workers);
+    confBool("queue.ring", queue_ring);
+    confBool("queue.affinity", queue_affinity);
+    confBool("mq.zerocopy", mq_zerocopy);
+    confBool("data.hugepages", data_hugepages);
+    confBool("data.prefault", data_prefault);
+    confBool("data.mlock", data_mlock);
+    confBool("numa", numa);
+
     if (strcmp(lval, "chunk.size") == 0) {
         unsigned int i;
         int err = conf_getUnsignedInt(rval, &i);
@@ -162,6 +195,86 @@ CONF_Add(const char *lval, const char *rval)
         return(0);
     }
 
+    if (strcmp(lval, "chunk.classes") == 0) {
+        unsigned int i;
+        int err = conf_getUnsignedInt(rval, &i);
+        if (err != 0)
+            return err;
+        if (i == 0 || i > MAX_CHUNK_CLASSES)
+            return EINVAL;
+        config.chunk_classes = i;
+        return(0);
+    }
+
+    if (strcmp(lval, "chunk.classes.percent") == 0) {
+        unsigned int i;
+        int err = conf_getUnsignedInt(rval, &i);
+        if (err != 0)
+            return err;
+        if (i == 0 || i > 100)
+            return EINVAL;
+        config.chunk_classes_percent = i;
+        return(0);
+    }
+
+    if (strcmp(lval, "worker.batch") == 0) {
+        unsigned int i;
+        int err = conf_getUnsignedInt(rval, &i);
+        if (err != 0)
+            return err;
+        if (i == 0)
+            return EINVAL;
+        config.worker_batch = i;
+        return(0);
+    }
+
+    if (strcmp(lval, "parse.threads") == 0) {
+        unsigned int i;
+        int err = conf_getUnsignedInt(rval, &i);
+        if (err != 0)
+            return err;
+        if (i > MAX_PARSE_THREADS)
+            return EINVAL;
+        config.parse_threads = i;
+        return(0);
+    }
+
+    if (strcmp(lval, "shards") == 0) {
+        unsigned int i;
+        int err = conf_getUnsignedInt(rval, &i);
+        if (err != 0)
+            return err;
+        if (i == 0 || i > MAX_SHARDS)
+            return EINVAL;
+        config.shards = i;
+        return(0);
+    }
+
+    if (strcmp(lval, "reader.priority") == 0) {
+        unsigned int i;
+        int err = conf_getUnsignedInt(rval, &i);
+        if (err != 0)
+            return err;
+        if (i > 99)
+            return EINVAL;
+        config.reader_priority = i;
+        return(0);
+    }
+
+    if (strcmp(lval, "reader.nice") == 0) {
+        char *p;
+        long n;
+
+        errno = 0;
+        n = strtol(rval, &p, 10);
+        if (errno)
+            return errno;
+        if (p == rval || *p != '\0' || n < -20 || n > 19)
+            return EINVAL;
+        config.reader_nice = (int) n;
+        return(0);
+    }
+
     if (strcmp(lval, "max.records") == 0) {
         unsigned int i;
         int err = conf_getUnsignedInt(rval, &i);
@@ -197,24 +310,6 @@ CONF_Add(const char *lval, const char *rval)
         return(0);
     }
 
-    if (strcmp(lval, "monitor.workers") == 0) {
-        if (strcasecmp(rval, "true") == 0
-            || strcasecmp(rval, "on") == 0
-            || strcasecmp(rval, "yes") == 0
-            || strcmp(rval, "1") == 0) {
-            config.monitor_workers = true;
-            return(0);
-        }
-        if (strcasecmp(rval, "false") == 0
-            || strcasecmp(rval, "off") == 0
-            || strcasecmp(rval, "no") == 0
-            || strcmp(rval, "0") == 0) {
-            config.monitor_workers = false;
-            return(0);
-        }
-        return(EINVAL);
-    }
-
     return EINVAL;
 }
 
@@ -231,16 +326,35 @@ CONF_Init(void)
     config.monitor_interval = 30;
     config.monitor_workers = false;
     config.max_records = DEF_MAX_RECORDS;
+    config.max_records_limit = 0;
     config.max_reclen = DEF_MAX_RECLEN;
     config.chunk_size = DEF_CHUNK_SIZE;
+    config.chunk_classes = 1;
+    config.chunk_classes_percent = DEF_CHUNK_CLASSES_PERCENT;
+    config.ring_size = 0;
+    config.data_hugepages = false;
+    config.data_prefault = false;
+    config.data_mlock = false;
+    config.numa = false;
+    config.reader_cpus[0] = '\0';
+    config.worker_cpus[0] = '\0';
+    config.monitor_cpus[0] = '\0';
+    config.reader_priority = 0;
+    config.reader_nice = 0;
     config.maxkeylen = DEF_MAXKEYLEN;
     config.qlen_goal = DEF_QLEN_GOAL;
+    config.queue_ring = false;
+    config.queue_affinity = false;
     config.idle_pause = DEF_IDLE_PAUSE;
 
     config.mq_module[0] = '\0';
     config.mq_config_file[0] = '\0';
+    config.mq_zerocopy = false;
     config.nworkers = 1;
     config.worker_stack = 128 * 1024;
+    config.worker_batch = DEF_WORKER_BATCH;
+    config.parse_threads = 0;
+    config.shards = 1;
     config.restarts = 1;
     config.restart_pause = 1;
     config.thread_restarts = 1;
@@ -287,14 +401,37 @@ CONF_Dump(int level)
     confdump(level, "monitor.workers = %s",
              config.monitor_workers ? "true" : "false");
     confdump(level, "max.records = %u", config.max_records);
+    confdump(level, "max.records.limit = %u", config.max_records_limit);
     confdump(level, "max.reclen = %u", config.max_reclen);
     confdump(level, "chunk.size = %u", config.chunk_size);
+    confdump(level, "chunk.classes = %u", config.chunk_classes);
+    confdump(level, "chunk.classes.percent = %u",
+             config.chunk_classes_percent);
+    confdump(level, "ring.size = %u", config.ring_size);
+    confdump(level, "data.hugepages = %s",
+             config.data_hugepages ? "true" : "false");
+    confdump(level, "data.prefault = %s",
+             config.data_prefault ? "true" : "false");
+    confdump(level, "data.mlock = %s", config.data_mlock ? "true" : "false");
+    confdump(level, "numa = %s", config.numa ? "true" : "false");
+    confdump(level, "reader.cpus = %s", config.reader_cpus);
+    confdump(level, "worker.cpus = %s", config.worker_cpus);
+    confdump(level, "monitor.cpus = %s", config.monitor_cpus);
+    confdump(level, "reader.priority = %u", config.reader_priority);
+    confdump(level, "reader.nice = %d", config.reader_nice);
     confdump(level, "maxkeylen = %u", config.maxkeylen);
     confdump(level, "qlen.goal = %u", config.qlen_goal);
+    confdump(level, "queue.ring = %s", config.queue_ring ? "true" : "false");
+    confdump(level, "queue.affinity = %s",
+             config.queue_affinity ? "true" : "false");
 
     confdump(level, "mq.module = %s", config.mq_module);
     confdump(level, "mq.config_file = %s", config.mq_config_file);
+    confdump(level, "mq.zerocopy = %s", config.mq_zerocopy ? "true" : "false");
     confdump(level, "nworkers = %u", config.nworkers);
+    confdump(level, "worker.batch = %u", config.worker_batch);
+    confdump(level, "parse.threads = %u", config.parse_threads);
+    confdump(level, "shards = %u", config.shards);
     confdump(level, "restarts = %u", config.restarts);
     confdump(level, "restart.pause = %u", config.restart_pause);
     confdump(level, "idle.pause = %f", config.idle_pause);
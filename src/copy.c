@@ -0,0 +1,171 @@
+/*-
+ * Copyright (c) 2026 UPLEX Nils Goroll Systemoptimierung
+ * Copyright (c) 2026 Otto Gmbh & Co KG
+ * All rights reserved
+ * Use only with permission
+ *
+ * Author: agent <agent@local>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define COPY_X86 1
+#endif
+
+#include "trackrdrd.h"
+
+/*
+ * Copying of payloads from the log into data records, stopping at the
+ * first null byte. Varnish writes null bytes into a payload that was
+ * truncated due to exceeding shm_reclen, so that the scan for them and
+ * the copy touch each byte once.
+ *
+ * The vector versions load 16 or 32 bytes at a time, and store them if
+ * they contain no null byte. The bytes of the block before a null byte
+ * are copied with memcpy(), so that nothing past the null byte is
+ * written. The version is chosen at startup by COPY_Init(), depending on
+ * the CPU.
+ */
+
+static size_t
+copy_generic(char *dst, const char *src, size_t len)
+{
+    const char *nul = memchr(src, '\0', len);
+
+    if (nul != NULL)
+        len = nul - src;
+    memcpy(dst, src, len);
+    return len;
+}
+
+#ifdef COPY_X86
+
+/* SSE2 is part of the x86-64 baseline */
+static size_t
+copy_sse2(char *dst, const char *src, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        if (m != 0) {
+            size_t n = i + __builtin_ctz(m);
+            memcpy(dst + i, src + i, n - i);
+            return n;
+        }
+        _mm_storeu_si128((__m128i *) (dst + i), v);
+    }
+    return i + copy_generic(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+copy_avx2(char *dst, const char *src, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+        unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        if (m != 0) {
+            size_t n = i + __builtin_ctz(m);
+            memcpy(dst + i, src + i, n - i);
+            return n;
+        }
+        _mm256_storeu_si256((__m256i *) (dst + i), v);
+    }
+    return i + copy_sse2(dst + i, src + i, len - i);
+}
+
+static int
+have_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+/* in order of preference */
+static const struct copy_impl {
+    const char		*name;
+    copy_nul_f		*copy;
+    int			(*supported)(void);
+} impls[] = {
+#ifdef COPY_X86
+    { "avx2", copy_avx2, have_avx2 },
+    { "sse2", copy_sse2, NULL },
+#endif
+    { "generic", copy_generic, NULL },
+};
+
+#define NIMPLS (sizeof(impls) / sizeof(impls[0]))
+
+copy_nul_f *COPY_Nul = copy_generic;
+static const char *copy_name = "generic";
+
+void
+COPY_Init(void)
+{
+    for (unsigned i = 0; i < NIMPLS; i++)
+        if (impls[i].supported == NULL || impls[i].supported()) {
+            COPY_Nul = impls[i].copy;
+            copy_name = impls[i].name;
+            return;
+        }
+}
+
+const char *
+COPY_Name(void)
+{
+    return copy_name;
+}
+
+/*
+ * The i-th version that the CPU supports, and its name, for tests.
+ * Returns NULL if there is none.
+ */
+copy_nul_f *
+COPY_Impl(unsigned i, const char **name)
+{
+    for (unsigned j = 0; j < NIMPLS; j++) {
+        if (impls[j].supported != NULL && !impls[j].supported())
+            continue;
+        if (i-- == 0) {
+            if (name != NULL)
+                *name = impls[j].name;
+            return impls[j].copy;
+        }
+    }
+    return NULL;
+}
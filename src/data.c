@@ -30,10 +30,14 @@
  *
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "trackrdrd.h"
 #include "data.h"
@@ -43,6 +47,10 @@
 #include "miniobj.h"
 #include "vsb.h"
 
+#ifndef RUP2
+#define RUP2(x, y)  (((x)+((y)-1))&(~((uintptr_t)(y)-1UL)))
+#endif
+
 /* Preprend head2 before head1, result in head1, head2 empty afterward */
 #define	VSTAILQ_PREPEND(head1, head2) do {                      \
         if (VSTAILQ_EMPTY((head2)))                             \
@@ -55,84 +63,659 @@
         VSTAILQ_INIT((head2));                                  \
 } while (0)
 
-unsigned global_nfree_rec, global_nfree_chunk;
+unsigned global_nfree_rec, global_nfree_chunk, global_ring_used;
 
 struct rechead_s freerechead;
-chunkhead_t freechunkhead;
+chunkhead_t freechunkhead[MAX_CHUNK_CLASSES];
+
+/*
+ * Global freelists of the NUMA pools, the lists above are the pool of
+ * node 0. The reader takes from the pool of its own node, and from other
+ * pools only when its own pool is empty. Records and chunks are always
+ * returned to their own pools.
+ */
+static struct rechead_s node_freerec[MAX_NUMA_NODES - 1];
+static chunkhead_t node_freechunk[MAX_NUMA_NODES - 1][MAX_CHUNK_CLASSES];
+
+#define FREEREC(n) ((n) == 0 ? &freerechead : &node_freerec[(n) - 1])
+#define FREECHUNK(n) ((n) == 0 ? freechunkhead : node_freechunk[(n) - 1])
 dataentry *entrytbl;
 chunk_t *chunktbl;
 
-static pthread_mutex_t freerec_lock, freechunk_lock;
 static char *buf, *keybuf;
 
+/*
+ * With ring.size > 0, buf is a byte ring in which each record is stored
+ * contiguously. The reader reserves max.reclen bytes at the head of the
+ * ring when it starts a record, and commits the actual length when the
+ * record is submitted, taking the next slot in ringslots. Workers mark
+ * the slot as released when they reset the record, and the reader
+ * reclaims released slots from the tail in FIFO order. Padding left at
+ * the end of the ring when a reservation wraps around is counted as part
+ * of the next record.
+ *
+ * All of the ring state except the released flags is only accessed by
+ * the reader.
+ */
+struct ringslot {
+    unsigned		len;	/* bytes taken from the ring */
+    unsigned char	released;
+};
+
+static struct ringslot *ringslots;
+static unsigned ring_head, ring_tail, ring_pad, slot_head, slot_tail;
+
+/*
+ * The tables are allocated from the heap, unless data.hugepages is set,
+ * in which case they are mapped with MAP_HUGETLB, or with transparent
+ * hugepages if no hugepages are reserved. With data.prefault, every page
+ * is touched when a table is allocated, and with data.mlock the tables
+ * are locked into memory.
+ */
+enum { MEM_ENTRY, MEM_CHUNK, MEM_BUF, MEM_KEY, MEM_RINGSLOT, MEM_N };
+
+struct datamem {
+    void	*ptr;
+    size_t	len;
+    size_t	mapped;		/* length of the mapping, 0 for the heap */
+    size_t	pagesz;
+    const char	*backing;
+    int		lockerr;	/* errno from mlock() */
+    unsigned	locked;
+};
+
+static const char * const datamem_name[MEM_N] = {
+    [MEM_ENTRY]		= "records",
+    [MEM_CHUNK]		= "chunks",
+    [MEM_BUF]		= "data",
+    [MEM_KEY]		= "keys",
+    [MEM_RINGSLOT]	= "ring slots",
+};
+
+/*
+ * The tables are organized in segments of max.records records, each with
+ * its own chunks, data and keys. DATA_Init() sets up the first segment,
+ * which is never removed, and which is the one that entrytbl and chunktbl
+ * point to. If max.records.limit is greater than max.records, then the
+ * reader adds segments with DATA_Grow() when the freelists are exhausted.
+ *
+ * When the monitor finds that occupancy has stayed low, it requests the
+ * highest segment to be drained with DATA_Shrink(). The reader then parks
+ * the segment's records and chunks as they appear on its freelists in
+ * DATA_Drain(), and unmaps the segment when all of them have been parked.
+ * If the reader needs to grow while a segment is draining, the parked
+ * records and chunks are returned to the freelists instead.
+ *
+ * Except for the drain request, the segment state is only modified by
+ * the reader.
+ */
+struct datasegment {
+    struct datamem	mem[MEM_N];
+    unsigned		nrec;
+    unsigned		nchunk;
+    unsigned		nparked_rec;
+    unsigned		nparked_chunk;
+    struct rechead_s	parked_rec;
+    chunkhead_t		parked_chunk[MAX_CHUNK_CLASSES];
+};
+
+static struct datasegment segment[MAX_DATA_SEGMENTS], *draining;
+static unsigned maxsegments, drain_req;
+
+unsigned global_nsegments, global_nrec, global_nchunk;
+
+/* Hugepagesize from /proc/meminfo, 0 if unknown */
+static size_t
+data_hugepagesize(void)
+{
+    FILE *fp;
+    char line[BUFSIZ];
+    unsigned long kb = 0;
+
+    if ((fp = fopen("/proc/meminfo", "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+        if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb * 1024;
+}
+
+/* anonymous mapping of len bytes, aligned to align (a power of 2) */
+static void *
+data_map(size_t len, size_t align, int flags)
+{
+    char *p;
+    size_t lead, maplen = len + align;
+
+    p = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    lead = (align - ((uintptr_t) p & (align - 1))) & (align - 1);
+    if (lead > 0)
+        AZ(munmap(p, lead));
+    if (align - lead > 0)
+        AZ(munmap(p + lead + len, align - lead));
+    return p + lead;
+}
+
+/*
+ * Allocates zeroed memory for a table, aligned to at least align bytes.
+ * Returns 0 or errno.
+ */
+static int
+data_alloc(struct datamem *mem, size_t len, size_t align)
+{
+    size_t pagesz = (size_t) sysconf(_SC_PAGESIZE);
+
+    mem->ptr = NULL;
+    mem->len = len;
+    mem->mapped = 0;
+    mem->pagesz = pagesz;
+    mem->backing = "heap";
+    mem->locked = 0;
+    mem->lockerr = 0;
+    if (len == 0)
+        return 0;
+
+    if (config.data_hugepages) {
+        size_t hpsz = data_hugepagesize();
+
+#ifdef MAP_HUGETLB
+        if (hpsz > 0) {
+            size_t maplen = RUP2(len, hpsz);
+
+            /* hugetlb mappings are always aligned to the page size */
+            mem->ptr = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem->ptr == MAP_FAILED)
+                mem->ptr = NULL;
+            else {
+                mem->mapped = maplen;
+                mem->pagesz = hpsz;
+                mem->backing = "hugetlb";
+            }
+        }
+#endif
+        if (mem->ptr == NULL) {
+            if (hpsz == 0)
+                hpsz = pagesz;
+            mem->mapped = RUP2(len, hpsz);
+            mem->ptr = data_map(mem->mapped, hpsz, 0);
+            if (mem->ptr == NULL) {
+                mem->mapped = 0;
+                return errno;
+            }
+            mem->backing = "mmap";
+#ifdef MADV_HUGEPAGE
+            if (madvise(mem->ptr, mem->mapped, MADV_HUGEPAGE) == 0) {
+                mem->pagesz = hpsz;
+                mem->backing = "transparent hugepages";
+            }
+#endif
+        }
+    }
+    else if (align > sizeof(void *)) {
+        errno = posix_memalign(&mem->ptr, align, len);
+        if (errno != 0) {
+            mem->ptr = NULL;
+            return errno;
+        }
+        memset(mem->ptr, 0, len);
+    }
+    else if ((mem->ptr = calloc(len, 1)) == NULL)
+        return errno;
+    return 0;
+}
+
+/* Prefaults and locks a table, after its NUMA placement has been set */
+static void
+data_commit(struct datamem *mem)
+{
+    size_t pagesz = (size_t) sysconf(_SC_PAGESIZE);
+
+    if (mem->len == 0)
+        return;
+    /* write back what is there, since the table is already initialized */
+    if (config.data_prefault)
+        for (size_t off = 0; off < mem->len; off += pagesz) {
+            volatile char *p = (volatile char *) mem->ptr + off;
+            *p = *p;
+        }
+
+    if (config.data_mlock) {
+        if (mlock(mem->ptr, mem->len) == 0)
+            mem->locked = 1;
+        else
+            mem->lockerr = errno;
+    }
+}
+
+static void
+data_free(struct datamem *mem)
+{
+    if (mem->mapped > 0)
+        AZ(munmap(mem->ptr, mem->mapped));
+    else
+        free(mem->ptr);
+    mem->ptr = NULL;
+    mem->len = 0;
+    mem->mapped = 0;
+}
+
+static void
+data_segment_free(struct datasegment *seg)
+{
+    for (int m = 0; m < MEM_N; m++)
+        data_free(&seg->mem[m]);
+    seg->nrec = seg->nchunk = 0;
+}
+
 static void
 data_Cleanup(void)
 {
-    free(chunktbl);
-    free(entrytbl);
-    free(keybuf);
-    free(buf);
-    AZ(pthread_mutex_destroy(&freerec_lock));
-    AZ(pthread_mutex_destroy(&freechunk_lock));
+    for (int s = 0; s < MAX_DATA_SEGMENTS; s++)
+        data_segment_free(&segment[s]);
+    chunktbl = NULL;
+    entrytbl = NULL;
+    keybuf = buf = NULL;
+    ringslots = NULL;
+}
+
+/*
+ * Number of chunks needed to store len bytes, where the n-th chunk of a
+ * record has size CHUNK_SIZE(n). If perclass is not NULL, it is set to
+ * the number of chunks from each size class.
+ */
+unsigned
+DATA_Chunks(unsigned len, unsigned *perclass)
+{
+    unsigned n = 0, sz = 0;
+
+    if (perclass != NULL)
+        memset(perclass, 0, MAX_CHUNK_CLASSES * sizeof(*perclass));
+    while (sz < len) {
+        if (perclass != NULL)
+            perclass[CHUNK_CLASS(n)]++;
+        sz += CHUNK_SIZE(n);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * With NUMA pools, the elements of each table are divided into contiguous
+ * slices, one for each node, and each slice is placed on its node. The
+ * pool of a record or chunk is recorded in its node field.
+ */
+static inline unsigned
+data_node(unsigned i, unsigned n)
+{
+    return (unsigned) ((uint64_t) i * numa_nodes / n);
+}
+
+/* place the slices of a table of n elements of size sz on their nodes */
+static void
+data_bind(void *base, size_t sz, unsigned n)
+{
+    for (unsigned node = 0; node < numa_nodes; node++) {
+        unsigned lo = ((uint64_t) node * n + numa_nodes - 1) / numa_nodes;
+        unsigned hi = ((uint64_t) (node + 1) * n + numa_nodes - 1)
+            / numa_nodes;
+
+        NUMA_Bind_Mem((char *) base + lo * sz, (hi - lo) * sz, node);
+    }
+}
+
+/*
+ * Number of chunks in size class c of a segment: class 0 has the chunks
+ * of a record of max.reclen for every record, the larger classes only
+ * for chunk.classes.percent of the records, since most records are
+ * expected to fit into class 0. Records fall back to smaller chunks when
+ * a class is exhausted.
+ */
+static unsigned
+data_class_chunks(const unsigned *perclass, int c)
+{
+    uint64_t n = (uint64_t) perclass[c] * config.max_records;
+
+    if (c > 0)
+        n = (n * config.chunk_classes_percent + 99) / 100;
+    return (unsigned) n;
+}
+
+/*
+ * Allocates the tables of a segment, and appends its records and chunks
+ * to the freelists freerec and freechunk. Returns 0 or errno.
+ */
+static int
+data_segment_init(struct datasegment *seg, struct rechead_s *freerec,
+                  chunkhead_t *freechunk)
+{
+    unsigned perclass[MAX_CHUNK_CLASSES], nclass[MAX_CHUNK_CLASSES];
+    unsigned nchunks = 0;
+    size_t bufsz = 0;
+    int err;
+
+    if (config.ring_size > 0)
+        bufsz = config.ring_size;
+    else {
+        (void) DATA_Chunks(config.max_reclen, perclass);
+        for (int c = 0; c < CHUNK_NCLASSES; c++) {
+            nclass[c] = data_class_chunks(perclass, c);
+            nchunks += nclass[c];
+            bufsz += (size_t) nclass[c] * (config.chunk_size << c);
+        }
+    }
+
+    if ((err = data_alloc(&seg->mem[MEM_ENTRY],
+                          config.max_records * sizeof(dataentry),
+                          CACHELINE_SIZE)) != 0
+        || (err = data_alloc(&seg->mem[MEM_CHUNK], nchunks * sizeof(chunk_t),
+                             0)) != 0
+        || (err = data_alloc(&seg->mem[MEM_BUF], bufsz, 0)) != 0
+        || (err = data_alloc(&seg->mem[MEM_KEY],
+                             (size_t) config.max_records * config.maxkeylen,
+                             0)) != 0
+        || (err = data_alloc(&seg->mem[MEM_RINGSLOT], config.ring_size > 0
+                             ? config.max_records * sizeof(struct ringslot)
+                             : 0, 0)) != 0) {
+        data_segment_free(seg);
+        return(err);
+    }
+    seg->nrec = config.max_records;
+    seg->nchunk = nchunks;
+
+    /* chunks are laid out by size class */
+    dataentry *entry = (dataentry *) seg->mem[MEM_ENTRY].ptr;
+    chunk_t *chunk = (chunk_t *) seg->mem[MEM_CHUNK].ptr;
+    char *p = (char *) seg->mem[MEM_BUF].ptr;
+    char *key = (char *) seg->mem[MEM_KEY].ptr;
+    if (config.ring_size == 0)
+        for (int c = 0; c < CHUNK_NCLASSES; c++) {
+            unsigned n = nclass[c];
+
+            if (numa_nodes > 1) {
+                data_bind(chunk, sizeof(chunk_t), n);
+                data_bind(p, config.chunk_size << c, n);
+            }
+            for (unsigned i = 0; i < n; i++) {
+                chunk->magic = CHUNK_MAGIC;
+                chunk->node = data_node(i, n);
+                chunk->class = c;
+                chunk->data = p;
+                VSTAILQ_INSERT_TAIL(&freechunk[c], chunk, freelist);
+                p += config.chunk_size << c;
+                chunk++;
+            }
+        }
+    else if (numa_nodes > 1)
+        NUMA_Bind_Mem(p, bufsz, numa_home);
+    assert(chunk == (chunk_t *) seg->mem[MEM_CHUNK].ptr + nchunks);
+    assert(p == (char *) seg->mem[MEM_BUF].ptr
+           + (config.ring_size > 0 ? 0 : bufsz));
+
+    if (numa_nodes > 1 && config.ring_size > 0) {
+        NUMA_Bind_Mem(entry, config.max_records * sizeof(dataentry),
+                      numa_home);
+        NUMA_Bind_Mem(key, (size_t) config.max_records * config.maxkeylen,
+                      numa_home);
+    }
+    else if (numa_nodes > 1) {
+        data_bind(entry, sizeof(dataentry), config.max_records);
+        data_bind(key, config.maxkeylen, config.max_records);
+    }
+    for (unsigned i = 0; i < config.max_records; i++) {
+        entry[i].magic = DATA_MAGIC;
+        /* the ring is not divided into pools */
+        entry[i].node = config.ring_size > 0
+            ? numa_home : data_node(i, config.max_records);
+        entry[i].key = &key[(i * config.maxkeylen)];
+        VSTAILQ_INIT(&entry[i].chunks);
+        VSTAILQ_INSERT_TAIL(freerec, &entry[i], freelist);
+    }
+
+    for (int m = 0; m < MEM_N; m++)
+        data_commit(&seg->mem[m]);
+    return(0);
 }
 
 int
 DATA_Init(void)
 {
-    unsigned chunks_per_rec
-        = (config.max_reclen + config.chunk_size - 1) / config.chunk_size;
-    unsigned nchunks = chunks_per_rec * config.max_records;
+    struct rechead_s freerec;
+    chunkhead_t freechunk[MAX_CHUNK_CLASSES];
+    int err;
 
-    entrytbl = (dataentry *) calloc(config.max_records, sizeof(dataentry));
-    if (entrytbl == NULL)
-        return(errno);
+    if (config.ring_size > 0 && config.ring_size < config.max_reclen)
+        return(EINVAL);
+    if (CHUNK_MAX > MAX_CHUNKS_PER_REC)
+        return(EINVAL);
+    if (DATA_SEGMENTS > MAX_DATA_SEGMENTS)
+        return(EINVAL);
+    /* the ring is not segmented */
+    if (config.ring_size > 0 && DATA_SEGMENTS > 1)
+        return(EINVAL);
 
-    chunktbl = (chunk_t *) calloc(nchunks, sizeof(chunk_t));
-    if (chunktbl == NULL) {
-        free(entrytbl);
-        return(errno);
+    for (unsigned n = 0; n < MAX_NUMA_NODES; n++) {
+        VSTAILQ_INIT(FREEREC(n));
+        for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+            VSTAILQ_INIT(&FREECHUNK(n)[c]);
     }
+    VSTAILQ_INIT(&freerec);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+        VSTAILQ_INIT(&freechunk[c]);
 
-    buf = (char *) calloc(nchunks, config.chunk_size);
-    if (buf == NULL) {
-        free(entrytbl);
-        free(chunktbl);
-        return(errno);
+    /* segments left over from a previous call (in tests) */
+    for (int s = 1; s < MAX_DATA_SEGMENTS; s++)
+        data_segment_free(&segment[s]);
+    if ((err = data_segment_init(&segment[0], &freerec, freechunk)) != 0) {
+        errno = err;
+        return(err);
     }
+    entrytbl = (dataentry *) segment[0].mem[MEM_ENTRY].ptr;
+    chunktbl = (chunk_t *) segment[0].mem[MEM_CHUNK].ptr;
+    buf = (char *) segment[0].mem[MEM_BUF].ptr;
+    keybuf = (char *) segment[0].mem[MEM_KEY].ptr;
+    ringslots = (struct ringslot *) segment[0].mem[MEM_RINGSLOT].ptr;
+    ring_head = ring_tail = ring_pad = slot_head = slot_tail = 0;
+    global_ring_used = 0;
+
+    global_nsegments = 1;
+    maxsegments = DATA_SEGMENTS;
+    draining = NULL;
+    drain_req = 0;
+    global_nrec = segment[0].nrec;
+    global_nchunk = segment[0].nchunk;
+    global_nfree_rec = global_nfree_chunk = 0;
+    DATA_Return_Freerec(&freerec, segment[0].nrec);
+    DATA_Return_Freechunk(freechunk, segment[0].nchunk);
+
+    atexit(data_Cleanup);
+    return(0);
+}
+
+/* Logs the memory layout of the tables of a segment */
+static void
+data_log_segment(unsigned s)
+{
+    struct datamem *mem = segment[s].mem;
 
-    keybuf = (char *) calloc(config.max_records, config.maxkeylen);
-    if (keybuf == NULL) {
-        free(entrytbl);
-        free(chunktbl);
-        free(buf);
-        return(errno);
+    for (int m = 0; m < MEM_N; m++) {
+        if (mem[m].len == 0)
+            continue;
+        LOG_Log(LOG_INFO, "Data table %s (segment %u): %zu bytes, %s, "
+                "page size %zu%s%s", datamem_name[m], s, mem[m].len,
+                mem[m].backing, mem[m].pagesz,
+                config.data_prefault ? ", prefaulted" : "",
+                mem[m].locked ? ", locked" : "");
+        if (mem[m].lockerr != 0)
+            LOG_Log(LOG_WARNING, "Cannot lock data table %s (segment %u) "
+                    "into memory: %s", datamem_name[m], s,
+                    strerror(mem[m].lockerr));
     }
+}
+
+/* Logs the memory layout of the tables set up by DATA_Init() */
+void
+DATA_Log(void)
+{
+    data_log_segment(0);
+    if (maxsegments > 1)
+        LOG_Log(LOG_INFO, "Data table may grow to %u segments of %u records",
+                maxsegments, config.max_records);
+}
 
-    VSTAILQ_INIT(&freechunkhead);
-    VSTAILQ_INIT(&freerechead);
-    AZ(pthread_mutex_init(&freerec_lock, NULL));
-    AZ(pthread_mutex_init(&freechunk_lock, NULL));
+static inline int
+data_in_segment(const struct datasegment *seg, unsigned m, const void *p)
+{
+    return (const char *) p >= (const char *) seg->mem[m].ptr
+        && (const char *) p < (const char *) seg->mem[m].ptr + seg->mem[m].len;
+}
 
-    global_nfree_rec = config.max_records;
-    global_nfree_chunk = nchunks;
+/*
+ * Called by the reader when the freelists are exhausted. Returns 0 if
+ * records and chunks were added to the global freelists, by cancelling
+ * the drain of a segment or by adding a new segment, otherwise errno.
+ */
+int
+DATA_Grow(void)
+{
+    struct datasegment *seg;
+    struct rechead_s freerec;
+    chunkhead_t freechunk[MAX_CHUNK_CLASSES];
+    int err;
 
-    for (int i = 0; i < nchunks; i++) {
-        chunktbl[i].magic = CHUNK_MAGIC;
-        chunktbl[i].data = &buf[i * config.chunk_size];
-        VSTAILQ_INSERT_TAIL(&freechunkhead, &chunktbl[i], freelist);
+    if (draining != NULL) {
+        seg = draining;
+        __atomic_store_n(&draining, NULL, __ATOMIC_RELAXED);
+        LOG_Log(LOG_INFO, "Data table: cancelled draining segment %u",
+                (unsigned) (seg - segment));
+        DATA_Return_Freerec(&seg->parked_rec, seg->nparked_rec);
+        DATA_Return_Freechunk(seg->parked_chunk, seg->nparked_chunk);
+        seg->nparked_rec = seg->nparked_chunk = 0;
+        return(0);
     }
+    if (global_nsegments >= maxsegments)
+        return(ENOSPC);
 
-    for (unsigned i = 0; i < config.max_records; i++) {
-        entrytbl[i].magic = DATA_MAGIC;
-        entrytbl[i].key = &keybuf[(i * config.maxkeylen)];
-        VSTAILQ_INIT(&entrytbl[i].chunks);
-        VSTAILQ_INSERT_TAIL(&freerechead, &entrytbl[i], freelist);
+    seg = &segment[global_nsegments];
+    VSTAILQ_INIT(&freerec);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+        VSTAILQ_INIT(&freechunk[c]);
+    if ((err = data_segment_init(seg, &freerec, freechunk)) != 0) {
+        LOG_Log(LOG_ERR, "Cannot grow data table, growth disabled: %s",
+                strerror(err));
+        maxsegments = global_nsegments;
+        return(err);
     }
+    __atomic_add_fetch(&global_nrec, seg->nrec, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&global_nchunk, seg->nchunk, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&global_nsegments, 1, __ATOMIC_RELEASE);
+    LOG_Log(LOG_NOTICE, "Data table: added segment %u, records=%u chunks=%u",
+            (unsigned) (seg - segment), global_nrec, global_nchunk);
+    data_log_segment(seg - segment);
 
-    atexit(data_Cleanup);
+    DATA_Return_Freerec(&freerec, seg->nrec);
+    DATA_Return_Freechunk(freechunk, seg->nchunk);
     return(0);
 }
 
+/* Requests the highest segment to be drained, called by the monitor */
+void
+DATA_Shrink(void)
+{
+    __atomic_store_n(&drain_req, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Whether a drain is requested or in progress, so that threads with local
+ * freelists pass them to DATA_Drain(). May be called by any thread.
+ */
+int
+DATA_Draining(void)
+{
+    return __atomic_load_n(&drain_req, __ATOMIC_RELAXED)
+        || __atomic_load_n(&draining, __ATOMIC_RELAXED) != NULL;
+}
+
+/*
+ * Called by the reader with its local freelists: parks the records and
+ * chunks of the draining segment found on the lists, and removes the
+ * segment when all of them have been parked. The counts of free records
+ * and chunks are reduced by the number parked. Only the lists passed in
+ * are searched, so with parse threads, each of them calls this for its
+ * own lists while DATA_Draining(), serialized by the caller.
+ */
+void
+DATA_Drain(struct rechead_s *freerec, unsigned *nfree_rec,
+           chunkhead_t *freechunk, unsigned *nfree_chunk)
+{
+    struct datasegment *seg;
+    struct rechead_s keeprec;
+    chunkhead_t keepchunk;
+    dataentry *entry;
+    chunk_t *chunk;
+
+    if (draining == NULL) {
+        if (!__atomic_load_n(&drain_req, __ATOMIC_RELAXED))
+            return;
+        __atomic_store_n(&drain_req, 0, __ATOMIC_RELAXED);
+        if (global_nsegments <= 1)
+            return;
+        __atomic_store_n(&draining, &segment[global_nsegments - 1],
+                         __ATOMIC_RELAXED);
+        draining->nparked_rec = draining->nparked_chunk = 0;
+        VSTAILQ_INIT(&draining->parked_rec);
+        for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+            VSTAILQ_INIT(&draining->parked_chunk[c]);
+        LOG_Log(LOG_INFO, "Data table: draining segment %u",
+                global_nsegments - 1);
+    }
+    seg = draining;
+
+    VSTAILQ_INIT(&keeprec);
+    while ((entry = VSTAILQ_FIRST(freerec)) != NULL) {
+        VSTAILQ_REMOVE_HEAD(freerec, freelist);
+        if (!data_in_segment(seg, MEM_ENTRY, entry)) {
+            VSTAILQ_INSERT_TAIL(&keeprec, entry, freelist);
+            continue;
+        }
+        VSTAILQ_INSERT_HEAD(&seg->parked_rec, entry, freelist);
+        seg->nparked_rec++;
+        if (*nfree_rec > 0)
+            (*nfree_rec)--;
+    }
+    VSTAILQ_CONCAT(freerec, &keeprec);
+
+    for (int c = 0; c < CHUNK_NCLASSES; c++) {
+        VSTAILQ_INIT(&keepchunk);
+        while ((chunk = VSTAILQ_FIRST(&freechunk[c])) != NULL) {
+            VSTAILQ_REMOVE_HEAD(&freechunk[c], freelist);
+            if (!data_in_segment(seg, MEM_CHUNK, chunk)) {
+                VSTAILQ_INSERT_TAIL(&keepchunk, chunk, freelist);
+                continue;
+            }
+            VSTAILQ_INSERT_HEAD(&seg->parked_chunk[c], chunk, freelist);
+            seg->nparked_chunk++;
+            if (*nfree_chunk > 0)
+                (*nfree_chunk)--;
+        }
+        VSTAILQ_CONCAT(&freechunk[c], &keepchunk);
+    }
+
+    if (seg->nparked_rec < seg->nrec || seg->nparked_chunk < seg->nchunk)
+        return;
+    __atomic_sub_fetch(&global_nrec, seg->nrec, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&global_nchunk, seg->nchunk, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&global_nsegments, 1, __ATOMIC_RELEASE);
+    data_segment_free(seg);
+    __atomic_store_n(&draining, NULL, __ATOMIC_RELAXED);
+    LOG_Log(LOG_NOTICE, "Data table: removed segment %u, records=%u chunks=%u",
+            global_nsegments, global_nrec, global_nchunk);
+}
+
 unsigned
 DATA_Reset(dataentry * const restrict entry,
            chunkhead_t * const restrict freechunk)
@@ -141,73 +724,380 @@ DATA_Reset(dataentry * const restrict entry,
     unsigned nchunk = 0;
 
     CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    /*
+     * Only the record's own cache line and the chunk links are written.
+     * The key and the chunk data are delimited by keylen and end, so
+     * their buffers are not cleared.
+     */
     entry->occupied = 0;
     entry->end = 0;
     entry->keylen = 0;
-    *entry->key = '\0';
-    entry->curchunk = NULL;
     entry->curchunkidx = 0;
+    entry->nchunks = 0;
+
+    if (ringslots != NULL && entry->data != NULL)
+        __atomic_store_n(&ringslots[entry->ringslot].released, 1,
+                         __ATOMIC_RELEASE);
+    /* also clears data */
+    entry->curchunk = NULL;
 
     while ((chunk = VSTAILQ_FIRST(&entry->chunks)) != NULL) {
         CHECK_OBJ(chunk, CHUNK_MAGIC);
-        chunk->occupied = 0;
-        *chunk->data = '\0';
         VSTAILQ_REMOVE_HEAD(&entry->chunks, chunklist);
-        VSTAILQ_INSERT_HEAD(freechunk, chunk, freelist);
+        VSTAILQ_INSERT_HEAD(&freechunk[chunk->class], chunk, freelist);
         nchunk++;
     }
     assert(VSTAILQ_EMPTY(&entry->chunks));
     return nchunk;
 }
 
-/* 
- * prepend a global freelist to the reader's freelist for access with rare
- * locking
+/*
+ * The global freelists are lock-free stacks of list segments. Only the
+ * head's first pointer is maintained after DATA_Init(), and it is only
+ * modified atomically: returning pushes a whole segment with CAS, and
+ * taking detaches the entire list with an atomic exchange. Since
+ * elements are never popped singly, there is no ABA problem.
+ *
+ * Counts are added before a segment is pushed and subtracted after it
+ * has been taken, so the global counts never fall below the number of
+ * listed elements, and are exact when the lists are quiescent.
  */
-#define DATA_Take_Free(type)                            \
-unsigned                                                \
-DATA_Take_Free##type(struct type##head_s *dst)          \
-{                                                       \
-    unsigned nfree;                                     \
-                                                        \
-    AZ(pthread_mutex_lock(&free##type##_lock));         \
-    VSTAILQ_PREPEND(dst, &free##type##head);            \
-    nfree = global_nfree_##type;                        \
-    global_nfree_##type = 0;                            \
-    AZ(pthread_mutex_unlock(&free##type##_lock));       \
-    return nfree;                                       \
+
+/* prepend a global freelist to a local freelist without locking */
+#define data_take(type)                                                 \
+static inline unsigned                                                  \
+data_take_##type(struct type##head_s *src, struct type##head_s *dst)    \
+{                                                                       \
+    struct type##head_s taken;                                          \
+    unsigned nfree = 0;                                                 \
+                                                                        \
+    VSTAILQ_FIRST(&taken)                                               \
+        = __atomic_exchange_n(&VSTAILQ_FIRST(src), NULL, __ATOMIC_ACQUIRE); \
+    for (taken.vstqh_last = &VSTAILQ_FIRST(&taken);                     \
+         *taken.vstqh_last != NULL;                                     \
+         taken.vstqh_last = &VSTAILQ_NEXT(*taken.vstqh_last, freelist)) \
+        nfree++;                                                        \
+    if (nfree > 0)                                                      \
+        VSTAILQ_PREPEND(dst, &taken);                                   \
+    return nfree;                                                       \
 }
 
-DATA_Take_Free(rec)
-DATA_Take_Free(chunk)
+data_take(rec)
+data_take(chunk)
+
+/* push a local freelist onto a global freelist without locking */
+#define data_return(type)                                               \
+static inline void                                                      \
+data_return_##type(struct type##head_s *dst, struct type##head_s *returned) \
+{                                                                       \
+    __typeof__(VSTAILQ_FIRST(returned)) top;                            \
+                                                                        \
+    if (VSTAILQ_EMPTY(returned))                                        \
+        return;                                                         \
+    top = __atomic_load_n(&VSTAILQ_FIRST(dst), __ATOMIC_RELAXED);       \
+    do                                                                  \
+        *returned->vstqh_last = top;                                    \
+    while (!__atomic_compare_exchange_n(&VSTAILQ_FIRST(dst), &top,      \
+                                        VSTAILQ_FIRST(returned), 1,     \
+                                        __ATOMIC_RELEASE,               \
+                                        __ATOMIC_RELAXED));             \
+    VSTAILQ_INIT(returned);                                             \
+}
+
+data_return(rec)
+data_return(chunk)
+
+unsigned
+DATA_Take_Freerec(struct rechead_s *dst)
+{
+    unsigned nfree = data_take_rec(FREEREC(numa_self), dst);
+
+    for (unsigned n = 0; nfree == 0 && n < numa_nodes; n++)
+        if (n != numa_self)
+            nfree = data_take_rec(FREEREC(n), dst);
+    __atomic_sub_fetch(&global_nfree_rec, nfree, __ATOMIC_RELAXED);
+    return nfree;
+}
+
+/* dst is an array of freelists, one for each chunk size class */
+unsigned
+DATA_Take_Freechunk(struct chunkhead_s *dst)
+{
+    unsigned nfree = 0;
+
+    for (int c = 0; c < CHUNK_NCLASSES; c++) {
+        unsigned nclass = data_take_chunk(&FREECHUNK(numa_self)[c], &dst[c]);
+
+        for (unsigned n = 0; nclass == 0 && n < numa_nodes; n++)
+            if (n != numa_self)
+                nclass = data_take_chunk(&FREECHUNK(n)[c], &dst[c]);
+        nfree += nclass;
+    }
+    __atomic_sub_fetch(&global_nfree_chunk, nfree, __ATOMIC_RELAXED);
+    return nfree;
+}
 
 /*
  * return to global freelist
  * returned must be locked by caller, if required
  */
-#define DATA_Return_Free(type)                                          \
-void                                                                    \
-DATA_Return_Free##type(struct type##head_s *returned, unsigned nreturned) \
-{                                                                       \
-    AZ(pthread_mutex_lock(&free##type##_lock));                         \
-    VSTAILQ_PREPEND(&free##type##head, returned);                       \
-    global_nfree_##type += nreturned;                                   \
-    AZ(pthread_mutex_unlock(&free##type##_lock));                       \
+void
+DATA_Return_Freerec(struct rechead_s *returned, unsigned nreturned)
+{
+    struct rechead_s pool[MAX_NUMA_NODES];
+    dataentry *entry;
+
+    if (VSTAILQ_EMPTY(returned))
+        return;
+    __atomic_add_fetch(&global_nfree_rec, nreturned, __ATOMIC_RELAXED);
+    if (numa_nodes == 1) {
+        data_return_rec(&freerechead, returned);
+        return;
+    }
+
+    /* divide the list by pool */
+    for (unsigned n = 0; n < numa_nodes; n++)
+        VSTAILQ_INIT(&pool[n]);
+    while ((entry = VSTAILQ_FIRST(returned)) != NULL) {
+        VSTAILQ_REMOVE_HEAD(returned, freelist);
+        assert(entry->node < numa_nodes);
+        VSTAILQ_INSERT_TAIL(&pool[entry->node], entry, freelist);
+    }
+    for (unsigned n = 0; n < numa_nodes; n++)
+        data_return_rec(FREEREC(n), &pool[n]);
+}
+
+/* returned is an array of freelists, one for each chunk size class */
+void
+DATA_Return_Freechunk(struct chunkhead_s *returned, unsigned nreturned)
+{
+    chunkhead_t pool[MAX_NUMA_NODES];
+    chunk_t *chunk;
+
+    __atomic_add_fetch(&global_nfree_chunk, nreturned, __ATOMIC_RELAXED);
+    for (int c = 0; c < CHUNK_NCLASSES; c++) {
+        if (numa_nodes == 1) {
+            data_return_chunk(&freechunkhead[c], &returned[c]);
+            continue;
+        }
+        for (unsigned n = 0; n < numa_nodes; n++)
+            VSTAILQ_INIT(&pool[n]);
+        while ((chunk = VSTAILQ_FIRST(&returned[c])) != NULL) {
+            VSTAILQ_REMOVE_HEAD(&returned[c], freelist);
+            assert(chunk->node < numa_nodes);
+            VSTAILQ_INSERT_TAIL(&pool[chunk->node], chunk, freelist);
+        }
+        for (unsigned n = 0; n < numa_nodes; n++)
+            data_return_chunk(&FREECHUNK(n)[c], &pool[n]);
+    }
 }
 
-DATA_Return_Free(rec)
-DATA_Return_Free(chunk)
+/* reclaim released records from the tail of the ring */
+static inline void
+data_ring_reclaim(void)
+{
+    struct ringslot *slot;
+
+    while (slot_tail != slot_head) {
+        slot = &ringslots[slot_tail % config.max_records];
+        if (!__atomic_load_n(&slot->released, __ATOMIC_ACQUIRE))
+            break;
+        slot->released = 0;
+        ring_tail = (ring_tail + slot->len) % config.ring_size;
+        global_ring_used -= slot->len;
+        slot_tail++;
+    }
+}
+
+/*
+ * Reserve max.reclen contiguous bytes in the ring for the next record,
+ * returns NULL if the ring is full. Only called by the reader.
+ */
+char *
+DATA_Ring_Reserve(void)
+{
+    AN(ringslots);
+    data_ring_reclaim();
+    if (slot_head - slot_tail == config.max_records)
+        return NULL;
+    if (global_ring_used == 0)
+        ring_head = ring_tail = 0;
+
+    ring_pad = 0;
+    if (ring_head < ring_tail || global_ring_used == config.ring_size) {
+        /* free space is [ring_head, ring_tail) */
+        if (ring_tail - ring_head < config.max_reclen)
+            return NULL;
+    }
+    else if (config.ring_size - ring_head < config.max_reclen) {
+        /* free space is [ring_head, ring_size) and [0, ring_tail) */
+        if (ring_tail < config.max_reclen)
+            return NULL;
+        ring_pad = config.ring_size - ring_head;
+        return buf;
+    }
+    return &buf[ring_head];
+}
+
+/*
+ * Commit the record stored at the last reservation. Only called by the
+ * reader.
+ */
+void
+DATA_Ring_Commit(dataentry *entry)
+{
+    struct ringslot *slot;
+
+    CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    AN(ringslots);
+    assert(entry->data == &buf[ring_pad > 0 ? 0 : ring_head]);
+    assert(entry->end <= config.max_reclen);
+    assert(slot_head - slot_tail < config.max_records);
+
+    entry->ringslot = slot_head % config.max_records;
+    slot = &ringslots[entry->ringslot];
+    AZ(slot->released);
+    slot->len = ring_pad + entry->end;
+    ring_head = (ring_head + slot->len) % config.ring_size;
+    global_ring_used += slot->len;
+    ring_pad = 0;
+    slot_head++;
+}
+
+/* copy len bytes from src to offset off of the data in entry's chunks */
+static void
+data_write(dataentry *entry, unsigned off, const char *src, unsigned len)
+{
+    chunk_t *chunk;
+    unsigned base = 0;
+
+    if (config.ring_size > 0) {
+        memcpy(entry->data + off, src, len);
+        return;
+    }
+    chunk = VSTAILQ_FIRST(&entry->chunks);
+    while (len > 0) {
+        CHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
+        unsigned sz = CHUNK_LEN(chunk);
+
+        if (off < base + sz) {
+            unsigned cp = base + sz - off;
+            if (cp > len)
+                cp = len;
+            memcpy(chunk->data + off - base, src, cp);
+            src += cp;
+            off += cp;
+            len -= cp;
+        }
+        base += sz;
+        chunk = VSTAILQ_NEXT(chunk, chunklist);
+    }
+}
+
+/* copy len bytes from offset off of the data in entry's chunks to dst */
+static void
+data_read(const dataentry *entry, unsigned off, char *dst, unsigned len)
+{
+    const chunk_t *chunk;
+    unsigned base = 0;
+
+    if (config.ring_size > 0) {
+        memcpy(dst, entry->data + off, len);
+        return;
+    }
+    chunk = VSTAILQ_FIRST(&entry->chunks);
+    while (len > 0) {
+        CHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
+        unsigned sz = CHUNK_LEN(chunk);
+
+        if (off < base + sz) {
+            unsigned cp = base + sz - off;
+            if (cp > len)
+                cp = len;
+            memcpy(dst, chunk->data + off - base, cp);
+            dst += cp;
+            off += cp;
+            len -= cp;
+        }
+        base += sz;
+        chunk = VSTAILQ_NEXT(chunk, chunklist);
+    }
+}
+
+/* Length of "XID=<xid>" */
+unsigned
+DATA_Xidlen(uint64_t xid)
+{
+    unsigned len = sizeof("XID=0") - 1;
+
+    while (xid >= 10) {
+        xid /= 10;
+        len++;
+    }
+    return len;
+}
+
+/*
+ * Store the binary header in the space reserved at the end of a record,
+ * which may span two chunks. Called by the reader after reserving it.
+ */
+void
+DATA_Header(dataentry *entry, const struct datahdr *hdr)
+{
+    CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    assert(entry->end >= DATA_Xidlen(hdr->xid) + DATA_TRL_LEN);
+
+    data_write(entry, entry->end - DATA_TRL_LEN, (const char *) hdr,
+               sizeof(*hdr));
+    entry->formatted = 0;
+}
+
+/*
+ * Renders the wire format of a record as submitted by the reader, from
+ * the binary header in the space reserved at its end. Called by the
+ * worker that sends the record, before the data are read.
+ */
+void
+DATA_Format(dataentry *entry)
+{
+    struct datahdr hdr;
+    char xid[DATA_HDR_LEN + 1], reqend[DATA_TRL_LEN + 1];
+    unsigned xidlen, reqendlen, body;
+
+    CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    assert(OCCUPIED(entry));
+    AZ(entry->formatted);
+    assert(entry->end >= DATA_TRL_LEN);
+
+    body = entry->end - DATA_TRL_LEN;
+    data_read(entry, body, (char *) &hdr, sizeof(hdr));
+
+    xidlen = snprintf(xid, sizeof(xid), "XID=%" PRIu64, hdr.xid);
+    assert(xidlen == DATA_Xidlen(hdr.xid));
+    assert(xidlen <= body);
+    data_write(entry, 0, xid, xidlen);
+
+    reqendlen = snprintf(reqend, sizeof(reqend), "&%s=%u.%06u", REQEND_T_VAR,
+                         hdr.sec, hdr.usec);
+    assert(reqendlen <= DATA_TRL_LEN);
+    data_write(entry, body, reqend, reqendlen);
+    entry->end = body + reqendlen;
+    entry->formatted = 1;
+}
 
 void
 DATA_Dump(void)
 {
     struct vsb *data = VSB_new_auto();
 
-    for (int i = 0; i < config.max_records; i++) {
-        dataentry *entry = &entrytbl[i];
+    /* entries are numbered consecutively across segments */
+    for (int i = 0; i < global_nsegments * config.max_records; i++) {
+        dataentry *entry = (dataentry *)
+            segment[i / config.max_records].mem[MEM_ENTRY].ptr;
 
         if (entry == NULL)
             continue;
+        entry += i % config.max_records;
         if (entry->magic != DATA_MAGIC) {
             LOG_Log(LOG_ERR, "Invalid data entry at index %d, magic = 0x%08x, "
                     "expected 0x%08x", i, entry->magic, DATA_MAGIC);
@@ -216,7 +1106,9 @@ DATA_Dump(void)
             continue;
 
         VSB_clear(data);
-        if (entry->end) {
+        if (entry->end && config.ring_size > 0)
+            VSB_bcat(data, entry->data, entry->end);
+        else if (entry->end) {
             int n = entry->end;
             chunk_t *chunk = VSTAILQ_FIRST(&entry->chunks);
             while (n > 0 && chunk != NULL) {
@@ -228,16 +1120,28 @@ DATA_Dump(void)
                     continue;
                 }
                 int cp = n;
-                if (cp > config.chunk_size)
-                    cp = config.chunk_size;
+                if (cp > CHUNK_LEN(chunk))
+                    cp = CHUNK_LEN(chunk);
                 VSB_bcat(data, chunk->data, cp);
                 n -= cp;
                 chunk = VSTAILQ_NEXT(chunk, chunklist);
             }
         }
         VSB_finish(data);
+        /* skip the XID and binary header of records not yet formatted */
+        unsigned start = 0, end = entry->end;
+        if (!DATA_FORMATTED(entry) && end >= DATA_TRL_LEN) {
+            struct datahdr hdr;
+
+            end -= DATA_TRL_LEN;
+            memcpy(&hdr, VSB_data(data) + end, sizeof(hdr));
+            start = DATA_Xidlen(hdr.xid);
+            if (start > end)
+                start = end;
+        }
         LOG_Log(LOG_INFO,
                 "Data entry %d: data=[%.*s] key=[%.*s]",
-                i, entry->end, VSB_data(data), entry->keylen, entry->key);
+                i, end - start, VSB_data(data) + start, entry->keylen,
+                entry->key);
     }
 }
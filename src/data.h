@@ -30,9 +30,9 @@
  *
  */
 
-/* Heads of the global free lists */
+/* Heads of the global free lists (only the first pointers are maintained) */
 extern struct rechead_s freerechead;
-extern chunkhead_t freechunkhead;
+extern chunkhead_t freechunkhead[MAX_CHUNK_CLASSES];
 
 /* Tables of records and chunks */
 extern dataentry *entrytbl;
@@ -38,3 +38,11 @@ METHOD(client_id, MQ_ClientID)
 METHOD(reconnect, MQ_Reconnect)
 METHOD(worker_shutdown, MQ_WorkerShutdown)
 METHOD(global_shutdown, MQ_GlobalShutdown)
+
+/* optional methods, may be NULL */
+#ifdef OPTMETHOD
+OPTMETHOD(send_batch, MQ_SendBatch)
+OPTMETHOD(sendv, MQ_SendV)
+OPTMETHOD(send_ref, MQ_SendRef)
+OPTMETHOD(poll, MQ_Poll)
+#endif
@@ -33,44 +33,178 @@
 #include <time.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
 #include "trackrdrd.h"
 #include "vdef.h"
 #include "vas.h"
+#include "miniobj.h"
 
 static int run;
 
+struct shard_stats *shard_stats = NULL;
+unsigned shard_self = 0;
+
+/*
+ * Statistics counters are kept in per-thread slots, each of which is only
+ * written by the thread that registered it with MON_StatsRegister(), so
+ * that updates need no locking. Threads without a slot (such as threads
+ * of the MQ plugin that release records) update a shared slot under the
+ * mutex. The slots are summed up when stats are logged.
+ *
+ * Occupancy is the difference of the number of records (or chunks) added
+ * to and removed from the data table, and the high water marks are
+ * derived from it at sample time. Chunk occupancy per size class is
+ * derived from the number of chunks in each record, counting the n-th
+ * chunk of a record in class CHUNK_CLASS(n), so chunks taken from a
+ * smaller class when that class was exhausted (the reader's
+ * chunk_fallback) are counted in the class that was wanted.
+ */
+struct mon_stats {
+    unsigned		magic;
+#define MON_STATS_MAGIC 0x3f5b0c61
+    unsigned long	occ_in;		/* Records added to the data table */
+    unsigned long	occ_out;	/* Records sent or failed */
+    unsigned long	occ_chunk_in;
+    unsigned long	occ_chunk_out;
+    unsigned long	occ_class_in[MAX_CHUNK_CLASSES];
+    unsigned long	occ_class_out[MAX_CHUNK_CLASSES];
+    unsigned long	sent;		/* Sent successfully to MQ */
+    unsigned long	bytes;		/* Total bytes successfully sent */
+    unsigned long	failed;		/* MQ send fails */
+    unsigned long	reconnects;	/* Reconnects to MQ */
+    unsigned long	restarts;	/* Worker thread restarts */
+    unsigned long	xnode;		/* Records handed across NUMA nodes */
+    struct mon_stats	*next;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+/* Only the owner writes a slot, others read with atomic loads */
+#define STATS_ADD(s, fld, n) \
+    __atomic_store_n(&(s)->fld, (s)->fld + (n), __ATOMIC_RELAXED)
+#define STATS_GET(s, fld) __atomic_load_n(&(s)->fld, __ATOMIC_RELAXED)
+
 static pthread_mutex_t	mutex;
-static unsigned		occ = 0;
-static unsigned		occ_chunk = 0;
-static unsigned	long	sent = 0;	/* Sent successfully to MQ */
-static unsigned	long	bytes = 0;	/* Total bytes successfully sent */
-static unsigned	long	failed = 0;	/* MQ send fails */
-static unsigned	long	reconnects = 0;	/* Reconnects to MQ */
-static unsigned	long	restarts = 0;	/* Worker thread restarts */
+static struct mon_stats	shared = { .magic = MON_STATS_MAGIC };
+static struct mon_stats	*slots = NULL;
+static __thread struct mon_stats *slot = NULL;
+
 static unsigned		occ_hi = 0;	/* Occupancy high water mark */ 
 static unsigned		occ_hi_this = 0;/* Occupancy high water mark
                                            this reporting interval */
 static unsigned		occ_chunk_hi = 0;
 static unsigned		occ_chunk_hi_this = 0;
 
+/*
+ * If the data table has grown, and record occupancy stays below half of
+ * the capacity without the highest segment for this many consecutive
+ * reporting intervals, then the segment is drained.
+ */
+#define SHRINK_INTERVALS 3
+static unsigned		occ_low = 0;
+
+static void
+stats_add(struct mon_stats *sum, struct mon_stats *s)
+{
+    CHECK_OBJ_NOTNULL(s, MON_STATS_MAGIC);
+    sum->occ_in += STATS_GET(s, occ_in);
+    sum->occ_out += STATS_GET(s, occ_out);
+    sum->occ_chunk_in += STATS_GET(s, occ_chunk_in);
+    sum->occ_chunk_out += STATS_GET(s, occ_chunk_out);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++) {
+        sum->occ_class_in[c] += STATS_GET(s, occ_class_in[c]);
+        sum->occ_class_out[c] += STATS_GET(s, occ_class_out[c]);
+    }
+    sum->sent += STATS_GET(s, sent);
+    sum->bytes += STATS_GET(s, bytes);
+    sum->failed += STATS_GET(s, failed);
+    sum->reconnects += STATS_GET(s, reconnects);
+    sum->restarts += STATS_GET(s, restarts);
+    sum->xnode += STATS_GET(s, xnode);
+}
+
+static void
+stats_sum(struct mon_stats *sum)
+{
+    struct mon_stats *s;
+
+    memset(sum, 0, sizeof(*sum));
+    stats_add(sum, &shared);
+    for (s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); s != NULL; s = s->next)
+        stats_add(sum, s);
+}
+
 static void
 log_output(void)
 {
     static int wrk_running_hi = 0;
     int wrk_active = WRK_Running();
     int wrk_running = wrk_active - spmcq_datawaiter;
+    struct mon_stats sum;
+    unsigned occ = 0, occ_chunk = 0;
+    char classes[MAX_CHUNK_CLASSES * sizeof(" occ_chunk_4294967295=4294967295")];
 
     if (wrk_running > wrk_running_hi)
         wrk_running_hi = wrk_running;
 
+    stats_sum(&sum);
+    /* the sums are not a consistent snapshot */
+    if (sum.occ_in > sum.occ_out)
+        occ = sum.occ_in - sum.occ_out;
+    if (sum.occ_chunk_in > sum.occ_chunk_out)
+        occ_chunk = sum.occ_chunk_in - sum.occ_chunk_out;
+    if (occ > occ_hi)
+        occ_hi = occ;
+    if (occ > occ_hi_this)
+        occ_hi_this = occ;
+    if (occ_chunk > occ_chunk_hi)
+        occ_chunk_hi = occ_chunk;
+    if (occ_chunk > occ_chunk_hi_this)
+        occ_chunk_hi_this = occ_chunk;
+
+    if (global_nsegments > 1
+        && occ < (global_nrec - config.max_records) / 2) {
+        if (++occ_low >= SHRINK_INTERVALS) {
+            DATA_Shrink();
+            occ_low = 0;
+        }
+    }
+    else
+        occ_low = 0;
+
+    /* occupancy per chunk size class, named by chunk size */
+    classes[0] = '\0';
+    if (CHUNK_NCLASSES > 1)
+        for (int c = 0, n = 0; c < CHUNK_NCLASSES; c++) {
+            unsigned occ_class = 0;
+            if (sum.occ_class_in[c] > sum.occ_class_out[c])
+                occ_class = sum.occ_class_in[c] - sum.occ_class_out[c];
+            n += snprintf(classes + n, sizeof(classes) - n,
+                          " occ_chunk_%u=%u", config.chunk_size << c,
+                          occ_class);
+        }
+
+    SHARD_SET(occ_rec, occ);
+    SHARD_SET(sent, sum.sent);
+    SHARD_SET(failed, sum.failed);
+    SHARD_SET(bytes, sum.bytes);
+    SHARD_SET(reconnects, sum.reconnects);
+    SHARD_SET(restarts, sum.restarts);
+
     LOG_Log(LOG_INFO, "Data table: len=%u occ_rec=%u occ_rec_hi=%u "
             "occ_rec_hi_this=%u occ_chunk=%u occ_chunk_hi=%u "
-            "occ_chunk_hi_this=%u global_free_rec=%u global_free_chunk=%u",
-            config.max_records, occ, occ_hi, occ_hi_this, occ_chunk,
+            "occ_chunk_hi_this=%u global_free_rec=%u global_free_chunk=%u%s",
+            global_nrec, occ, occ_hi, occ_hi_this, occ_chunk,
             occ_chunk_hi, occ_chunk_hi_this, global_nfree_rec,
-            global_nfree_chunk);
+            global_nfree_chunk, classes);
+    if (DATA_SEGMENTS > 1)
+        LOG_Log(LOG_INFO, "Data segments: segments=%u max=%u records=%u "
+                "chunks=%u", global_nsegments, DATA_SEGMENTS, global_nrec,
+                global_nchunk);
+    if (config.ring_size > 0)
+        LOG_Log(LOG_INFO, "Data ring: size=%u used=%u", config.ring_size,
+                global_ring_used);
 
     /* Eliminate the dependency of trackrdrd.o for unit tests */
 #ifndef TEST_DRIVER
@@ -85,7 +219,11 @@ log_output(void)
             "exited=%d abandoned=%u reconnects=%lu restarts=%lu sent=%lu "
             "failed=%lu bytes=%lu",
             wrk_active, wrk_running, spmcq_datawaiter, wrk_running_hi,
-            WRK_Exited(), abandoned, reconnects, restarts, sent, failed, bytes);
+            WRK_Exited(), abandoned, sum.reconnects, sum.restarts, sum.sent,
+            sum.failed, sum.bytes);
+    if (numa_nodes > 1)
+        LOG_Log(LOG_INFO, "NUMA: nodes=%u reader_node=%u xnode=%lu",
+                numa_nodes, numa_home, sum.xnode);
 
     /* locking would be overkill */
     occ_hi_this = 0;
@@ -109,10 +247,14 @@ void
 {
     struct timespec t;
     unsigned *interval = (unsigned *) arg;
+    int errnum;
 
     t.tv_sec = (time_t) *interval;
     t.tv_nsec = 0;
     LOG_Log(LOG_INFO, "Monitor thread running every %u secs", t.tv_sec);
+    if ((errnum = AFF_Thread()) != 0)
+        LOG_Log(LOG_WARNING, "Monitor thread cannot restore nice value: %s",
+                strerror(errnum));
     run = 1;
 
     pthread_cleanup_push(monitor_cleanup, arg);
@@ -161,49 +303,144 @@ MON_StatsInit(void)
     AZ(pthread_mutex_init(&mutex, NULL));
 }
 
+/*
+ * Give the calling thread its own slot for stats updates. The slot is
+ * never freed, so that the counts of exited threads are kept.
+ */
 void
-MON_StatsUpdate(stats_update_t update, unsigned nchunks, unsigned nbytes)
+MON_StatsRegister(void)
 {
+    struct mon_stats *s;
+
+    if (slot != NULL)
+        return;
+    AZ(posix_memalign((void **) &s, CACHELINE_SIZE, sizeof(*s)));
+    memset(s, 0, sizeof(*s));
+    s->magic = MON_STATS_MAGIC;
     AZ(pthread_mutex_lock(&mutex));
+    s->next = slots;
+    __atomic_store_n(&slots, s, __ATOMIC_RELEASE);
+    AZ(pthread_mutex_unlock(&mutex));
+    slot = s;
+}
+
+/* count the chunks of a record with nchunks chunks per size class */
+#define STATS_ADD_CLASSES(s, fld, nchunks) do {                         \
+        unsigned last = CHUNK_NCLASSES - 1;                             \
+        if (last == 0)                                                  \
+            break;                                                      \
+        for (unsigned c = 0; c < last && c < (nchunks); c++)            \
+            STATS_ADD(s, fld[c], 1);                                    \
+        if ((nchunks) > last)                                           \
+            STATS_ADD(s, fld[last], (nchunks) - last);                  \
+    } while (0)
+
+static inline void
+stats_update(struct mon_stats *s, stats_update_t update, unsigned nchunks,
+             unsigned nbytes)
+{
     switch(update) {
         
     case STATS_SENT:
-        sent++;
-        bytes += nbytes;
-        occ--;
-        occ_chunk -= nchunks;
+        STATS_ADD(s, sent, 1);
+        STATS_ADD(s, bytes, nbytes);
+        STATS_ADD(s, occ_out, 1);
+        STATS_ADD(s, occ_chunk_out, nchunks);
+        STATS_ADD_CLASSES(s, occ_class_out, nchunks);
         break;
         
     case STATS_FAILED:
-        failed++;
-        occ--;
-        occ_chunk -= nchunks;
+        STATS_ADD(s, failed, 1);
+        STATS_ADD(s, occ_out, 1);
+        STATS_ADD(s, occ_chunk_out, nchunks);
+        STATS_ADD_CLASSES(s, occ_class_out, nchunks);
         break;
         
     case STATS_RECONNECT:
-        reconnects++;
+        STATS_ADD(s, reconnects, 1);
         break;
 
     case STATS_OCCUPANCY:
-        occ++;
-        occ_chunk += nchunks;
-        if (occ > occ_hi)
-            occ_hi = occ;
-        if (occ > occ_hi_this)
-            occ_hi_this = occ;
-        if (occ_chunk > occ_chunk_hi)
-            occ_chunk_hi = occ_chunk;
-        if (occ_chunk > occ_chunk_hi_this)
-            occ_chunk_hi_this = occ_chunk;
+        STATS_ADD(s, occ_in, 1);
+        STATS_ADD(s, occ_chunk_in, nchunks);
+        STATS_ADD_CLASSES(s, occ_class_in, nchunks);
         break;
 
     case STATS_RESTART:
-        restarts++;
+        STATS_ADD(s, restarts, 1);
+        break;
+
+    case STATS_XNODE:
+        STATS_ADD(s, xnode, 1);
         break;
         
     default:
         /* Unreachable */
         AN(NULL);
     }
+}
+
+void
+MON_StatsUpdate(stats_update_t update, unsigned nchunks, unsigned nbytes)
+{
+    if (slot != NULL) {
+        stats_update(slot, update, nchunks, nbytes);
+        return;
+    }
+    AZ(pthread_mutex_lock(&mutex));
+    stats_update(&shared, update, nchunks, nbytes);
     AZ(pthread_mutex_unlock(&mutex));
 }
+
+/*
+ * Called by the management process before forking n children. The slots
+ * survive restarts of a child, whose new stats replace the old ones at
+ * its first monitor interval. Returns 0 or errno.
+ */
+int
+MON_ShardsInit(unsigned n)
+{
+    void *p;
+
+    assert(n > 1 && n <= MAX_SHARDS);
+    p = mmap(NULL, n * sizeof(struct shard_stats), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return errno;
+    shard_stats = p;
+    return 0;
+}
+
+#define SHARD_GET(i, fld) __atomic_load_n(&shard_stats[i].fld, __ATOMIC_RELAXED)
+
+void
+MON_ShardsLog(unsigned n)
+{
+    struct shard_stats sum;
+    unsigned lag_seg_hi = 0;
+
+    AN(shard_stats);
+    memset(&sum, 0, sizeof(sum));
+    for (unsigned i = 0; i < n; i++) {
+        sum.seen += SHARD_GET(i, seen);
+        sum.submitted += SHARD_GET(i, submitted);
+        sum.skipped += SHARD_GET(i, skipped);
+        sum.no_data += SHARD_GET(i, no_data);
+        sum.no_free_rec += SHARD_GET(i, no_free_rec);
+        sum.overrun += SHARD_GET(i, overrun);
+        sum.sent += SHARD_GET(i, sent);
+        sum.failed += SHARD_GET(i, failed);
+        sum.bytes += SHARD_GET(i, bytes);
+        sum.reconnects += SHARD_GET(i, reconnects);
+        sum.restarts += SHARD_GET(i, restarts);
+        sum.occ_rec += SHARD_GET(i, occ_rec);
+        if (SHARD_GET(i, lag_seg) > lag_seg_hi)
+            lag_seg_hi = SHARD_GET(i, lag_seg);
+    }
+    LOG_Log(LOG_INFO, "Shards: shards=%u seen=%lu submitted=%lu skipped=%lu "
+            "nodata=%lu no_free_rec=%lu overrun=%lu occ_rec=%u "
+            "lag_segments_hi=%u sent=%lu failed=%lu bytes=%lu reconnects=%lu "
+            "restarts=%lu", n, sum.seen, sum.submitted, sum.skipped,
+            sum.no_data, sum.no_free_rec, sum.overrun, sum.occ_rec, lag_seg_hi,
+            sum.sent, sum.failed, sum.bytes, sum.reconnects, sum.restarts);
+}
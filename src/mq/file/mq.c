@@ -34,7 +34,9 @@
 #include <string.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
+#include <sys/uio.h>
 
 #include "mq.h"
 #include "config_common.h"
@@ -56,6 +58,10 @@ typedef struct wrk_s {
 #define FILE_WRK_MAGIC 0x50bff5f0
     int n;
     char errmsg[LINE_MAX];
+    char *buf;		/* output buffer for MQ_SendBatch() */
+    size_t bufsz;
+    struct iovec *iov;	/* output list for MQ_SendV() */
+    int niov;
 } wrk_t;
 
 static FILE *out;
@@ -66,6 +72,7 @@ static wrk_t *workers;
 static char fname[PATH_MAX + 1] = "";
 static char errmsg[LINE_MAX];
 static char _version[LINE_MAX];
+static char keyprefix[] = "key=", keysep[] = ": ", newline[] = "\n";
 
 static int
 conf_add(const char *lval, const char *rval)
@@ -163,6 +170,165 @@ MQ_Send(void *priv, const char *data, unsigned len, const char *key,
     return 0;
 }
 
+static inline char *
+buf_cat(char *p, const char *s, size_t len)
+{
+    if (len > 0)
+        memcpy(p, s, len);
+    return p + len;
+}
+
+/*
+ * Format all of the records in the worker's buffer, and write them with
+ * a single call to fwrite(3).
+ */
+int
+MQ_SendBatch(void *priv, const struct mq_msg *msgs, unsigned n, int *status,
+             const char **error)
+{
+    wrk_t *wrk;
+    size_t len = 0;
+    char *p;
+    int ret = 0;
+
+    if (priv == NULL) {
+        for (unsigned i = 0; i < n; i++)
+            status[i] = -1;
+        *error = "MQ_SendBatch() called with NULL worker object";
+        return -1;
+    }
+
+    CAST_OBJ(wrk, priv, FILE_WRK_MAGIC);
+    for (unsigned i = 0; i < n; i++)
+        len += (sizeof("key=: \n") - 1) + msgs[i].keylen + msgs[i].len;
+    if (len > wrk->bufsz) {
+        errno = 0;
+        p = realloc(wrk->buf, len);
+        if (p == NULL) {
+            snprintf(wrk->errmsg, LINE_MAX,
+                     "worker %d: cannot allocate output buffer: %s", wrk->n,
+                     strerror(errno));
+            ret = 1;
+            goto done;
+        }
+        wrk->buf = p;
+        wrk->bufsz = len;
+    }
+
+    p = wrk->buf;
+    for (unsigned i = 0; i < n; i++) {
+        p = buf_cat(p, "key=", 4);
+        p = buf_cat(p, msgs[i].key, msgs[i].keylen);
+        p = buf_cat(p, ": ", 2);
+        p = buf_cat(p, msgs[i].data, msgs[i].len);
+        *p++ = '\n';
+    }
+    assert((size_t) (p - wrk->buf) == len);
+
+    if (len > 0 && fwrite(wrk->buf, 1, len, out) != len) {
+        snprintf(wrk->errmsg, LINE_MAX, "worker %d: error writing output",
+                 wrk->n);
+        ret = 1;
+    }
+
+ done:
+    for (unsigned i = 0; i < n; i++)
+        status[i] = ret;
+    if (ret != 0)
+        *error = wrk->errmsg;
+    return ret;
+}
+
+/* The line is written synchronously, so the data is released at once */
+int
+MQ_SendRef(void *priv, const char *data, unsigned len, const char *key,
+           unsigned keylen, mq_release_f *release, void *ref,
+           const char **error)
+{
+    int ret;
+
+    ret = MQ_Send(priv, data, len, key, keylen, error);
+    if (ret == 0)
+        release(ref, 0);
+    return ret;
+}
+
+/* Nothing is outstanding after MQ_SendRef(), see above */
+const char *
+MQ_Poll(void *priv, unsigned timeout)
+{
+    wrk_t *wrk;
+
+    CAST_OBJ_NOTNULL(wrk, priv, FILE_WRK_MAGIC);
+    (void) timeout;
+    return NULL;
+}
+
+/*
+ * Write the line with writev(2) directly from the caller's buffers. The
+ * stream is locked and flushed first, so that the output stays in order
+ * with lines written by other workers through stdio.
+ */
+int
+MQ_SendV(void *priv, const struct iovec *iov, int iovcnt, const char *key,
+         unsigned keylen, const char **error)
+{
+    wrk_t *wrk;
+    ssize_t len, ret;
+    int n = 0;
+
+    if (priv == NULL) {
+        *error = "MQ_SendV() called with NULL worker object";
+        return -1;
+    }
+
+    CAST_OBJ(wrk, priv, FILE_WRK_MAGIC);
+    if (iovcnt + 4 > wrk->niov) {
+        struct iovec *p;
+
+        errno = 0;
+        p = realloc(wrk->iov, (iovcnt + 4) * sizeof(struct iovec));
+        if (p == NULL) {
+            snprintf(wrk->errmsg, LINE_MAX,
+                     "worker %d: cannot allocate output list: %s", wrk->n,
+                     strerror(errno));
+            *error = wrk->errmsg;
+            return 1;
+        }
+        wrk->iov = p;
+        wrk->niov = iovcnt + 4;
+    }
+
+    wrk->iov[n].iov_base = keyprefix;
+    wrk->iov[n++].iov_len = sizeof(keyprefix) - 1;
+    wrk->iov[n].iov_base = (void *) (uintptr_t) key;
+    wrk->iov[n++].iov_len = keylen;
+    wrk->iov[n].iov_base = keysep;
+    wrk->iov[n++].iov_len = sizeof(keysep) - 1;
+    len = (sizeof(keyprefix) - 1) + keylen + (sizeof(keysep) - 1) + 1;
+    for (int i = 0; i < iovcnt; i++) {
+        wrk->iov[n++] = iov[i];
+        len += iov[i].iov_len;
+    }
+    wrk->iov[n].iov_base = newline;
+    wrk->iov[n++].iov_len = 1;
+
+    flockfile(out);
+    if (fflush(out) != 0)
+        ret = -1;
+    else
+        ret = writev(fileno(out), wrk->iov, n);
+    funlockfile(out);
+
+    if (ret != len) {
+        snprintf(wrk->errmsg, LINE_MAX, "worker %d: error writing output",
+                 wrk->n);
+        *error = wrk->errmsg;
+        return 1;
+    }
+    return 0;
+}
+
 const char *
 MQ_Reconnect(void **priv)
 {
@@ -206,6 +372,10 @@ MQ_WorkerShutdown(void **priv, int wrk_num)
 const char *
 MQ_GlobalShutdown(void)
 {
+    for (int i = 0; i < nwrk; i++) {
+        free(workers[i].buf);
+        free(workers[i].iov);
+    }
     free(workers);
 
     if (out != stdout) {
@@ -109,7 +109,6 @@ void
 CB_DeliveryReport(rd_kafka_t *rk, void *payload, size_t len,
                   rd_kafka_resp_err_t err, void *opaque, void *msg_opaque)
 {
-    (void) msg_opaque;
     kafka_wrk_t *wrk = (kafka_wrk_t *) opaque;
     CHECK_OBJ_NOTNULL(wrk, KAFKA_WRK_MAGIC);
 
@@ -131,6 +130,12 @@ CB_DeliveryReport(rd_kafka_t *rk, void *payload, size_t len,
             MQ_LOG_Log(LOG_DEBUG, "Delivered (client ID = %s): msg = [%.*s]",
                        rd_kafka_name(rk), (int) len, (char *) payload);
     }
+
+    /* Message produced by MQ_SendRef(), hand the payload back */
+    if (msg_opaque != NULL) {
+        AN(wrk->release);
+        wrk->release(msg_opaque, err != RD_KAFKA_RESP_ERR_NO_ERROR);
+    }
 }
 
 void
@@ -31,6 +31,8 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 #include <syslog.h>
@@ -271,29 +273,14 @@ MQ_WorkerInit(void **priv, int wrk_num)
     return NULL;
 }
 
-int
-MQ_Send(void *priv, const char *data, unsigned len, const char *key,
-        unsigned keylen, const char **error)
+/*
+ * Validate a message for MQ_Send() or MQ_SendBatch(). Returns 0 if the
+ * message can be produced, or 1 with an error message in wrk->errmsg.
+ */
+static int
+check_msg(kafka_wrk_t *wrk, const char *data, unsigned len, const char *key,
+          unsigned keylen)
 {
-    kafka_wrk_t *wrk;
-    void *payload = NULL;
-
-    if (priv == NULL) {
-        MQ_LOG_Log(LOG_ERR, "MQ_Send() called with NULL worker object");
-        *error = "MQ_Send() called with NULL worker object";
-        return -1;
-    }
-    CAST_OBJ(wrk, priv, KAFKA_WRK_MAGIC);
-    wrk->seen++;
-
-    /* XXX: error? */
-    if (len == 0) {
-        wrk->nodata++;
-        return 0;
-    }
-
-    rd_kafka_poll(wrk->kafka, 0);
-
     if (key == NULL || keylen == 0) {
         snprintf(wrk->errmsg, LINE_MAX, "%s message shard key is missing",
                  rd_kafka_name(wrk->kafka));
@@ -307,7 +294,6 @@ MQ_Send(void *priv, const char *data, unsigned len, const char *key,
                        rd_kafka_name(wrk->kafka), len, data);
         }
         wrk->nokey++;
-        *error = wrk->errmsg;
         return 1;
     }
     if (data == NULL) {
@@ -323,7 +309,6 @@ MQ_Send(void *priv, const char *data, unsigned len, const char *key,
                        rd_kafka_name(wrk->kafka), keylen, key);
         }
         wrk->nodata++;
-        *error = wrk->errmsg;
         return 1;
     }
 
@@ -343,14 +328,26 @@ MQ_Send(void *priv, const char *data, unsigned len, const char *key,
                            rd_kafka_name(wrk->kafka), len, data, keylen, key);
 
             }
-            *error = wrk->errmsg;
             wrk->badkey++;
             return 1;
         }
 
-    REPLACE(payload, data);
-    if (rd_kafka_produce(wrk->topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_FREE,
-                         payload, len, key, keylen, NULL) == -1) {
+    return 0;
+}
+
+/*
+ * Produce a message with the rdkafka message flags in msgflags. If the
+ * payload is to be freed by rdkafka after delivery (RD_KAFKA_MSG_F_FREE),
+ * it is freed here if the produce operation fails.
+ */
+static int
+produce(kafka_wrk_t *wrk, void *payload, size_t len, const char *key,
+        unsigned keylen, int msgflags, void *msg_opaque, const char **error)
+{
+    if (rd_kafka_produce(wrk->topic, RD_KAFKA_PARTITION_UA, msgflags,
+                         payload, len, key, keylen, msg_opaque) == -1) {
+        if (msgflags & RD_KAFKA_MSG_F_FREE)
+            free(payload);
         snprintf(wrk->errmsg, LINE_MAX, "%s",
                  rd_kafka_err2str(rd_kafka_last_error()));
         MQ_LOG_Log(LOG_ERR, "%s message send failure (%d): %s",
@@ -364,6 +361,234 @@ MQ_Send(void *priv, const char *data, unsigned len, const char *key,
     return 0;
 }
 
+int
+MQ_Send(void *priv, const char *data, unsigned len, const char *key,
+        unsigned keylen, const char **error)
+{
+    kafka_wrk_t *wrk;
+    void *payload = NULL;
+
+    if (priv == NULL) {
+        MQ_LOG_Log(LOG_ERR, "MQ_Send() called with NULL worker object");
+        *error = "MQ_Send() called with NULL worker object";
+        return -1;
+    }
+    CAST_OBJ(wrk, priv, KAFKA_WRK_MAGIC);
+    wrk->seen++;
+
+    /* XXX: error? */
+    if (len == 0) {
+        wrk->nodata++;
+        return 0;
+    }
+
+    rd_kafka_poll(wrk->kafka, 0);
+
+    if (check_msg(wrk, data, len, key, keylen) != 0) {
+        *error = wrk->errmsg;
+        return 1;
+    }
+    if (keylen > 8)
+        keylen = 8;
+
+    REPLACE(payload, data);
+    return produce(wrk, payload, len, key, keylen, RD_KAFKA_MSG_F_FREE, NULL,
+                   error);
+}
+
+#ifdef RD_KAFKA_PURGE_F_QUEUE
+/*
+ * The payload is produced in place (neither copied nor freed by rdkafka),
+ * and handed back to the caller from CB_DeliveryReport().
+ *
+ * Only defined if rdkafka can purge messages, so that every payload is
+ * handed back when a worker object is shut down (see WRK_Fini()).
+ * Otherwise the tracking reader copies the data for MQ_Send().
+ */
+int
+MQ_SendRef(void *priv, const char *data, unsigned len, const char *key,
+           unsigned keylen, mq_release_f *release, void *ref,
+           const char **error)
+{
+    kafka_wrk_t *wrk;
+
+    if (priv == NULL) {
+        MQ_LOG_Log(LOG_ERR, "MQ_SendRef() called with NULL worker object");
+        *error = "MQ_SendRef() called with NULL worker object";
+        return -1;
+    }
+    CAST_OBJ(wrk, priv, KAFKA_WRK_MAGIC);
+    AN(release);
+    AN(ref);
+    wrk->seen++;
+
+    if (len == 0) {
+        wrk->nodata++;
+        release(ref, 0);
+        return 0;
+    }
+
+    rd_kafka_poll(wrk->kafka, 0);
+
+    if (check_msg(wrk, data, len, key, keylen) != 0) {
+        *error = wrk->errmsg;
+        return 1;
+    }
+    if (keylen > 8)
+        keylen = 8;
+
+    wrk->release = release;
+    return produce(wrk, (void *) (uintptr_t) data, len, key, keylen, 0, ref,
+                   error);
+}
+
+/* Delivery reports, and with them releases, are served by rd_kafka_poll() */
+const char *
+MQ_Poll(void *priv, unsigned timeout)
+{
+    kafka_wrk_t *wrk;
+
+    CAST_OBJ_NOTNULL(wrk, priv, KAFKA_WRK_MAGIC);
+    rd_kafka_poll(wrk->kafka, timeout);
+    return NULL;
+}
+#endif
+
+int
+MQ_SendV(void *priv, const struct iovec *iov, int iovcnt, const char *key,
+         unsigned keylen, const char **error)
+{
+    kafka_wrk_t *wrk;
+    char *payload, *p;
+    size_t len = 0;
+
+    if (priv == NULL) {
+        MQ_LOG_Log(LOG_ERR, "MQ_SendV() called with NULL worker object");
+        *error = "MQ_SendV() called with NULL worker object";
+        return -1;
+    }
+    CAST_OBJ(wrk, priv, KAFKA_WRK_MAGIC);
+    wrk->seen++;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len == 0) {
+        wrk->nodata++;
+        return 0;
+    }
+
+    rd_kafka_poll(wrk->kafka, 0);
+
+    /* Gather into the payload, the only copy of the data in the plugin */
+    payload = malloc(len);
+    AN(payload);
+    p = payload;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    if (check_msg(wrk, payload, len, key, keylen) != 0) {
+        free(payload);
+        *error = wrk->errmsg;
+        return 1;
+    }
+    if (keylen > 8)
+        keylen = 8;
+
+    return produce(wrk, payload, len, key, keylen, RD_KAFKA_MSG_F_FREE, NULL,
+                   error);
+}
+
+int
+MQ_SendBatch(void *priv, const struct mq_msg *msgs, unsigned n, int *status,
+             const char **error)
+{
+    kafka_wrk_t *wrk;
+    unsigned nmsgs = 0;
+    int ret = 0;
+
+    if (priv == NULL) {
+        MQ_LOG_Log(LOG_ERR, "MQ_SendBatch() called with NULL worker object");
+        for (unsigned i = 0; i < n; i++)
+            status[i] = -1;
+        *error = "MQ_SendBatch() called with NULL worker object";
+        return -1;
+    }
+    CAST_OBJ(wrk, priv, KAFKA_WRK_MAGIC);
+
+    if (n > wrk->nbatch) {
+        rd_kafka_message_t *batch;
+        unsigned *batchidx;
+
+        batch = realloc(wrk->batch, n * sizeof(*batch));
+        AN(batch);
+        wrk->batch = batch;
+        batchidx = realloc(wrk->batchidx, n * sizeof(*batchidx));
+        AN(batchidx);
+        wrk->batchidx = batchidx;
+        wrk->nbatch = n;
+    }
+
+    rd_kafka_poll(wrk->kafka, 0);
+
+    for (unsigned i = 0; i < n; i++) {
+        unsigned keylen = msgs[i].keylen;
+        rd_kafka_message_t *msg;
+
+        wrk->seen++;
+        status[i] = 0;
+        if (msgs[i].len == 0) {
+            wrk->nodata++;
+            continue;
+        }
+        if (check_msg(wrk, msgs[i].data, msgs[i].len, msgs[i].key, keylen)
+            != 0) {
+            status[i] = 1;
+            if (ret == 0)
+                ret = 1;
+            *error = wrk->errmsg;
+            continue;
+        }
+        if (keylen > 8)
+            keylen = 8;
+
+        msg = &wrk->batch[nmsgs];
+        memset(msg, 0, sizeof(*msg));
+        msg->payload = (void *) (uintptr_t) msgs[i].data;
+        msg->len = msgs[i].len;
+        msg->key = (void *) (uintptr_t) msgs[i].key;
+        msg->key_len = keylen;
+        wrk->batchidx[nmsgs++] = i;
+    }
+
+    if (nmsgs > 0) {
+        /*
+         * The payloads belong to the caller, so they are copied. Failed
+         * messages are flagged in their err field.
+         */
+        (void) rd_kafka_produce_batch(wrk->topic, RD_KAFKA_PARTITION_UA,
+                                      RD_KAFKA_MSG_F_COPY, wrk->batch,
+                                      nmsgs);
+        for (unsigned i = 0; i < nmsgs; i++) {
+            if (wrk->batch[i].err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+                wrk->produced++;
+                continue;
+            }
+            snprintf(wrk->errmsg, LINE_MAX, "%s",
+                     rd_kafka_err2str(wrk->batch[i].err));
+            MQ_LOG_Log(LOG_ERR, "%s message send failure: %s",
+                       rd_kafka_name(wrk->kafka), wrk->errmsg);
+            status[wrk->batchidx[i]] = -1;
+            ret = -1;
+            *error = wrk->errmsg;
+        }
+    }
+
+    rd_kafka_poll(wrk->kafka, 0);
+    return ret;
+}
+
 const char *
 MQ_Reconnect(void **priv)
 {
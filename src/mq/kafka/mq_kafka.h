@@ -36,6 +36,8 @@
 
 #include <syslog.h>
 
+#include "mq.h"
+
 #define AZ(foo)         do { assert((foo) == 0); } while (0)
 #define AN(foo)         do { assert((foo) != 0); } while (0)
 
@@ -53,6 +55,12 @@ typedef struct kafka_wrk {
     unsigned long	nokey;
     unsigned long	badkey;
     unsigned long	nodata;
+    /* messages for rd_kafka_produce_batch() in MQ_SendBatch() */
+    rd_kafka_message_t	*batch;
+    unsigned		*batchidx; /* index of batch[i] in the msgs array */
+    unsigned		nbatch;
+    /* set by MQ_SendRef(), called from CB_DeliveryReport() */
+    mq_release_f	*release;
 } kafka_wrk_t;
 
 extern kafka_wrk_t **workers;
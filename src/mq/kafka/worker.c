@@ -155,8 +155,23 @@ WRK_Fini(kafka_wrk_t *wrk)
         }
     }
 
+#ifdef RD_KAFKA_PURGE_F_QUEUE
+    /*
+     * Fail any messages left after the timeout, so that their delivery
+     * reports are served, and payloads produced by MQ_SendRef() are
+     * released. MQ_SendRef() is not defined without rd_kafka_purge().
+     */
+    if (rd_kafka_outq_len(wrk->kafka) > 0) {
+        rd_kafka_purge(wrk->kafka,
+                       RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT);
+        rd_kafka_poll(wrk->kafka, 0);
+    }
+#endif
+
     rd_kafka_topic_destroy(wrk->topic);
     rd_kafka_destroy(wrk->kafka);
+    free(wrk->batch);
+    free(wrk->batchidx);
     FREE_OBJ(wrk);
     workers[wrk_num] = NULL;
 }
@@ -0,0 +1,218 @@
+/*-
+ * Copyright (c) 2026 UPLEX Nils Goroll Systemoptimierung
+ * Copyright (c) 2026 Otto Gmbh & Co KG
+ * All rights reserved
+ * Use only with permission
+ *
+ * Author: agent <agent@local>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "vdef.h"
+#include "vas.h"
+
+#include "trackrdrd.h"
+
+/*
+ * NUMA topology as read from sysfs, without a dependency on libnuma.
+ * Nodes are numbered densely from 0 to numa_nodes - 1; node_id holds
+ * the kernel's node numbers, which may be sparse.
+ *
+ * Without numa = true, or on a single-node system, numa_nodes is 1 and
+ * all threads and memory are on node 0, so that callers need not
+ * distinguish the cases.
+ */
+
+#define NODE_PATH "/sys/devices/system/node/node%d/cpulist"
+
+/* mbind(2) constants, to avoid the dependency on numaif.h */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+unsigned numa_nodes = 1, numa_home = 0;
+__thread unsigned numa_self = 0;
+
+static int node_id[MAX_NUMA_NODES];
+static cpu_set_t node_cpus[MAX_NUMA_NODES];
+static unsigned char cpu_node[CPU_SETSIZE];
+static unsigned bind_errs = 0;
+
+/* parse a cpulist such as "0-3,8-11", returns 0 or EINVAL */
+int
+NUMA_Cpulist(const char *list, cpu_set_t *set)
+{
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    while (*list != '\0' && *list != '\n') {
+        lo = hi = strtol(list, &end, 10);
+        if (end == list || lo < 0)
+            return(EINVAL);
+        if (*end == '-') {
+            list = end + 1;
+            hi = strtol(list, &end, 10);
+            if (end == list || hi < lo)
+                return(EINVAL);
+        }
+        for (long cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, set);
+        list = end;
+        if (*list == ',')
+            list++;
+    }
+    return(0);
+}
+
+/*
+ * Reads the topology if config.numa is set. Returns 0 or errno; a system
+ * without NUMA information is treated as a single node.
+ */
+int
+NUMA_Init(void)
+{
+    char path[sizeof(NODE_PATH) + 10], line[BUFSIZ];
+    FILE *fp;
+    unsigned n = 0;
+
+    numa_nodes = 1;
+    numa_self = numa_home = 0;
+    memset(cpu_node, 0, sizeof(cpu_node));
+    if (!config.numa)
+        return(0);
+
+    for (int id = 0; id < 64 && n < MAX_NUMA_NODES; id++) {
+        sprintf(path, NODE_PATH, id);
+        if ((fp = fopen(path, "r")) == NULL)
+            continue;
+        if (fgets(line, sizeof(line), fp) == NULL) {
+            fclose(fp);
+            continue;
+        }
+        fclose(fp);
+        if (NUMA_Cpulist(line, &node_cpus[n]) != 0)
+            return(EINVAL);
+        /* memory-only nodes have no CPUs to place threads on */
+        if (CPU_COUNT(&node_cpus[n]) == 0)
+            continue;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &node_cpus[n]))
+                cpu_node[cpu] = n;
+        node_id[n++] = id;
+    }
+    if (n > 0)
+        numa_nodes = n;
+    return(0);
+}
+
+/* Node of the CPU on which the calling thread is running */
+unsigned
+NUMA_Node(void)
+{
+    int cpu;
+
+    if (numa_nodes == 1 || (cpu = sched_getcpu()) < 0 || cpu >= CPU_SETSIZE)
+        return 0;
+    return cpu_node[cpu];
+}
+
+/* Restricts the calling thread to the CPUs of node. Returns 0 or errno. */
+int
+NUMA_Bind_Thread(unsigned node)
+{
+    int err;
+
+    assert(node < numa_nodes);
+    if (numa_nodes == 1)
+        return(0);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                 &node_cpus[node]);
+    if (err == 0)
+        numa_self = node;
+    return(err);
+}
+
+/*
+ * Sets the preferred node for the pages in [p, p + len), moving pages
+ * that have already been faulted in. Only whole pages within the range
+ * are affected. Failures are counted and reported by NUMA_Log().
+ */
+void
+NUMA_Bind_Mem(void *p, size_t len, unsigned node)
+{
+#ifdef __linux__
+    uintptr_t pagesz = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) p + pagesz - 1) & ~(pagesz - 1);
+    uintptr_t end = ((uintptr_t) p + len) & ~(pagesz - 1);
+    unsigned long mask;
+
+    assert(node < numa_nodes);
+    if (numa_nodes == 1 || end <= start)
+        return;
+    mask = 1UL << node_id[node];
+    if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &mask,
+                sizeof(mask) * 8, MPOL_MF_MOVE) != 0)
+        bind_errs++;
+#else
+    (void) p;
+    (void) len;
+    (void) node;
+#endif
+}
+
+void
+NUMA_Log(void)
+{
+    if (!config.numa)
+        return;
+    if (numa_nodes == 1) {
+        LOG_Log0(LOG_INFO, "NUMA: single node, placement not in effect");
+        return;
+    }
+    for (unsigned n = 0; n < numa_nodes; n++)
+        LOG_Log(LOG_INFO, "NUMA: node %u (system node %d): %d CPUs", n,
+                node_id[n], CPU_COUNT(&node_cpus[n]));
+    if (bind_errs > 0)
+        LOG_Log(LOG_WARNING, "NUMA: memory placement failed for %u ranges",
+                bind_errs);
+}
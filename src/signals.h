@@ -34,6 +34,7 @@ PARENT(SIGINT, terminate_action);
 PARENT(SIGHUP, restart_action);
 PARENT(SIGUSR1, restart_action);
 PARENT(SIGUSR2, ignore_action);
+PARENT(SIGALRM, stats_action);
 #ifndef DISABLE_STACKTRACE
 PARENT(SIGABRT, stacktrace_action);
 PARENT(SIGSEGV, stacktrace_action);
@@ -45,6 +46,7 @@ CHILD(SIGINT, terminate_action);
 CHILD(SIGUSR1, dump_action);
 CHILD(SIGUSR2, ignore_action);
 CHILD(SIGHUP, flush_action);
+CHILD(SIGALRM, ignore_action);
 #ifndef DISABLE_STACKTRACE
 CHILD(SIGABRT, stacktrace_action);
 CHILD(SIGSEGV, stacktrace_action);
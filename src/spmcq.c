@@ -35,15 +35,31 @@
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include <syslog.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 #include "trackrdrd.h"
 #include "vdef.h"
 #include "vas.h"
 #include "vqueue.h"
+#include "vtim.h"
 
-pthread_cond_t  spmcq_datawaiter_cond;
 pthread_mutex_t spmcq_datawaiter_lock;
 int		spmcq_datawaiter;
+int		spmcq_remotewaiter;
+
+/*
+ * Parked workers, as stacks under spmcq_datawaiter_lock: workers on the
+ * reader's NUMA node, and the others. SPMCQ_Wake() pops the worker that
+ * parked last, whose cache is most likely to be warm, and leaves the
+ * longest waiting workers parked while fewer suffice.
+ */
+static struct spmcq_waiter *local_top, *remote_top;
 
 static volatile unsigned long enqs = 0, deqs = 0;
 static pthread_mutex_t spmcq_lock;
@@ -55,10 +71,103 @@ struct spmcq_s spmcq_head = VSTAILQ_HEAD_INITIALIZER(spmcq_head);
 struct spmcq_s enq_head = VSTAILQ_HEAD_INITIALIZER(enq_head);
 struct spmcq_s deq_head = VSTAILQ_HEAD_INITIALIZER(deq_head);
 
+/*
+ * Lock-free alternative (config param queue.ring): a power-of-two ring
+ * of record pointers. The producer owns the tail and publishes slots
+ * with a release store; consumers claim slots by CAS on the head. Head
+ * and tail are kept on separate cache lines, so that the producer and
+ * the consumers do not invalidate each other's lines on every access.
+ *
+ * The ring holds at least as many entries as the data tables can grow
+ * to (MAX_RECORDS), and a record can only be in the queue once, so the
+ * ring can never overflow.
+ *
+ * With queue.affinity, there is one ring per worker, and the producer
+ * routes each record to a ring by its shard key (see spmcq_route()), so
+ * that records with the same key are sent by the same worker, in order,
+ * unless they are stolen. A worker takes records from its own ring
+ * first; if that is empty, it steals from the longest ring, if at least
+ * worker.batch records are waiting there. Thieves take from the head,
+ * like the owner, since the tail belongs to the producer; so they take
+ * the oldest records, and only contend with the owner on the CAS.
+ */
+struct spmcq_idx_s {
+    unsigned long	idx;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+struct spmcq_ring {
+    struct spmcq_idx_s	head;
+    struct spmcq_idx_s	tail;
+    /* the producer's: next slot to fill, and cached view of head */
+    struct {
+        unsigned long	next;
+        unsigned long	head_cache;
+    } __attribute__((aligned(CACHELINE_SIZE))) prod;
+    dataentry		**slot;
+    unsigned long	mask;
+    /* the worker that owns the ring, NULL if none, see SPMCQ_Own() */
+    struct spmcq_waiter	*owner;
+};
+
+static struct spmcq_ring *rings;
+static unsigned nrings;
+/* producer's turn for records without a key */
+static unsigned route_rr;
+static unsigned long steals;
+
+static unsigned ring_mode, initialized = 0;
+/* more than one parse thread enqueues, see parse.threads */
+static unsigned multi_producer;
+
+/*
+ * Measured rates for SPMCQ_NeedWorkers(). The producer samples the
+ * arrivals and the workers' busy time reported by SPMCQ_Served() at most
+ * every RATE_INTERVAL seconds, and keeps moving averages of the arrival
+ * rate and of the service time per record, with the weight RATE_WEIGHT
+ * for the latest sample. Workers are woken up to keep their utilization
+ * at RATE_UTIL.
+ */
+#define RATE_INTERVAL 0.01
+#define RATE_WEIGHT 0.25
+#define RATE_UTIL 0.8
+
+static struct spmcq_served_s {
+    unsigned long	n;
+    unsigned long	ns;
+} __attribute__((aligned(CACHELINE_SIZE))) served;
+
+static double rate_t, arrival_rate, svc_time;
+static unsigned long arrivals, rate_arrivals, rate_served, rate_ns;
+
+static inline unsigned long
+spmcq_ring_len(struct spmcq_ring *r)
+{
+    /* head first, since the tail never falls behind it */
+    unsigned long head = __atomic_load_n(&r->head.idx, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(&r->tail.idx, __ATOMIC_RELAXED) - head;
+}
+
 static inline unsigned
 spmcq_len(void)
 {
-    return enqs - deqs;
+    unsigned long len = 0;
+
+    if (!ring_mode)
+        return enqs - deqs;
+    for (unsigned q = 0; q < nrings; q++)
+        len += spmcq_ring_len(&rings[q]);
+    return len;
+}
+
+static void
+spmcq_rings_free(void)
+{
+    for (unsigned q = 0; q < nrings; q++)
+        free(rings[q].slot);
+    free(rings);
+    rings = NULL;
+    nrings = 0;
 }
 
 static void
@@ -66,33 +175,287 @@ spmcq_cleanup(void)
 {
     AZ(pthread_mutex_destroy(&spmcq_lock));
     AZ(pthread_mutex_destroy(&spmcq_deq_lock));
+    AZ(pthread_mutex_destroy(&spmcq_datawaiter_lock));
+    spmcq_rings_free();
+}
+
+static inline double
+spmcq_rate_avg(double avg, double sample)
+{
+    if (avg == 0.)
+        return sample;
+    return avg + RATE_WEIGHT * (sample - avg);
+}
+
+/* called by the producer, under spmcq_lock if there are several */
+static inline void
+spmcq_arrive(unsigned n)
+{
+    double now, t, v;
+    unsigned long nserved, ns;
+
+    arrivals += n;
+    now = VTIM_mono();
+    if ((t = now - rate_t) < RATE_INTERVAL)
+        return;
+    if (rate_t > 0.) {
+        v = spmcq_rate_avg(arrival_rate, (arrivals - rate_arrivals) / t);
+        __atomic_store(&arrival_rate, &v, __ATOMIC_RELAXED);
+        nserved = __atomic_load_n(&served.n, __ATOMIC_RELAXED);
+        ns = __atomic_load_n(&served.ns, __ATOMIC_RELAXED);
+        if (nserved > rate_served) {
+            v = spmcq_rate_avg(svc_time, (ns - rate_ns) * 1e-9
+                               / (nserved - rate_served));
+            __atomic_store(&svc_time, &v, __ATOMIC_RELAXED);
+        }
+        rate_served = nserved;
+        rate_ns = ns;
+    }
+    rate_arrivals = arrivals;
+    rate_t = now;
+}
+
+static int
+spmcq_ring_init(unsigned n)
+{
+    unsigned long sz = 1;
+
+    while (sz < MAX_RECORDS)
+        sz <<= 1;
+    spmcq_rings_free();
+    if (posix_memalign((void **) &rings, CACHELINE_SIZE,
+                       n * sizeof(struct spmcq_ring)) != 0)
+        return(ENOMEM);
+    memset(rings, 0, n * sizeof(struct spmcq_ring));
+    nrings = n;
+    for (unsigned q = 0; q < n; q++) {
+        rings[q].slot = calloc(sz, sizeof(dataentry *));
+        if (rings[q].slot == NULL)
+            return(errno);
+        rings[q].mask = sz - 1;
+    }
+    return(0);
 }
 
 int
 SPMCQ_Init(void)
 {
-    if (pthread_mutex_init(&spmcq_lock, NULL) != 0)
-        return(errno);
-    if (pthread_mutex_init(&spmcq_deq_lock, NULL) != 0)
-        return(errno);
-    
+    int err;
+
+    /* may be called again (in tests) to switch modes */
+    if (!initialized) {
+        if (pthread_mutex_init(&spmcq_lock, NULL) != 0)
+            return(errno);
+        if (pthread_mutex_init(&spmcq_deq_lock, NULL) != 0)
+            return(errno);
+        if (pthread_mutex_init(&spmcq_datawaiter_lock, NULL) != 0)
+            return(errno);
+        atexit(spmcq_cleanup);
+        initialized = 1;
+    }
+
     qlen_goal = config.qlen_goal;
-    
-    atexit(spmcq_cleanup);
+    ring_mode = config.queue_ring || config.queue_affinity;
+    multi_producer = config.parse_threads > 1;
+    spmcq_datawaiter = spmcq_remotewaiter = 0;
+    local_top = remote_top = NULL;
+    rate_t = arrival_rate = svc_time = 0.;
+    arrivals = rate_arrivals = rate_served = rate_ns = 0;
+    served.n = served.ns = 0;
+    route_rr = 0;
+    steals = 0;
+    if (ring_mode
+        && (err = spmcq_ring_init(config.queue_affinity && config.nworkers > 1
+                                  ? config.nworkers : 1)) != 0)
+        return(err);
+
     return(0);
 }
 
+/* Fills the next slot, which becomes visible with spmcq_ring_publish() */
+static inline void
+spmcq_ring_put(struct spmcq_ring *r, dataentry *ptr)
+{
+    unsigned long next = r->prod.next;
+
+    if (next - r->prod.head_cache > r->mask) {
+        r->prod.head_cache = __atomic_load_n(&r->head.idx, __ATOMIC_ACQUIRE);
+        assert(next - r->prod.head_cache <= r->mask);
+    }
+    __atomic_store_n(&r->slot[next & r->mask], ptr, __ATOMIC_RELAXED);
+    r->prod.next = next + 1;
+}
+
+/* returns whether there were filled slots to publish */
+static inline int
+spmcq_ring_publish(struct spmcq_ring *r)
+{
+    if (r->prod.next == r->tail.idx)
+        return 0;
+    __atomic_store_n(&r->tail.idx, r->prod.next, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline unsigned
+spmcq_ring_deqbatch(struct spmcq_ring *r, dataentry **out, unsigned max)
+{
+    unsigned long head, n;
+
+    head = __atomic_load_n(&r->head.idx, __ATOMIC_RELAXED);
+    do {
+        n = __atomic_load_n(&r->tail.idx, __ATOMIC_ACQUIRE) - head;
+        if (n == 0)
+            return 0;
+        if (n > max)
+            n = max;
+        /*
+         * If another consumer claims these slots first, the CAS fails
+         * and the values read here are discarded, even if the producer
+         * has overwritten the slots in the meantime.
+         */
+        for (unsigned i = 0; i < n; i++)
+            out[i] = __atomic_load_n(&r->slot[(head + i) & r->mask],
+                                     __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&r->head.idx, &head, head + n, 1,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+    return n;
+}
+
+/*
+ * Ring for a record with queue.affinity. Keys whose first 8 characters
+ * (or all of them, if shorter) are hex digits are routed by the value of
+ * those digits, as the Kafka plugin partitions them, so that with a
+ * multiple of nworkers partitions, each worker sends to its own subset
+ * of the partitions. Other keys are hashed with FNV-1a, and records
+ * without a key take turns.
+ */
+static inline unsigned
+spmcq_route(const dataentry *ptr)
+{
+    unsigned long key = 0;
+    uint32_t h = 2166136261U;
+    unsigned i;
+
+    if (nrings == 1)
+        return 0;
+    if (ptr->keylen == 0)
+        return route_rr++ % nrings;
+    for (i = 0; i < ptr->keylen && i < 8; i++) {
+        char c = ptr->key[i];
+
+        if (c >= '0' && c <= '9')
+            key = key << 4 | (c - '0');
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            key = key << 4 | ((c | 0x20) - 'a' + 10);
+        else
+            break;
+    }
+    if (i == ptr->keylen || i == 8)
+        return key % nrings;
+    for (i = 0; i < ptr->keylen; i++) {
+        h ^= (unsigned char) ptr->key[i];
+        h *= 16777619U;
+    }
+    return h % nrings;
+}
+
+/*
+ * The ring to take records from if not the worker's own: one whose
+ * owner is gone, or else the longest with at least min records.
+ */
+static inline struct spmcq_ring *
+spmcq_victim(unsigned min)
+{
+    struct spmcq_ring *v = NULL;
+    unsigned long len, max = 0;
+
+    if (nrings == 1)
+        return &rings[0];
+    for (unsigned q = 0; q < nrings; q++) {
+        if ((len = spmcq_ring_len(&rings[q])) == 0)
+            continue;
+        if (__atomic_load_n(&rings[q].owner, __ATOMIC_RELAXED) == NULL)
+            return &rings[q];
+        if (len >= min && len > max) {
+            v = &rings[q];
+            max = len;
+        }
+    }
+    return v;
+}
+
+static void spmcq_wake_owner(struct spmcq_ring *r);
+
+/* called by the producer, under spmcq_lock if there are several */
+static inline void
+spmcq_ring_enqlist(struct rechead_s *list)
+{
+    dataentry *ptr;
+
+    VSTAILQ_FOREACH(ptr, list, spmcq)
+        spmcq_ring_put(&rings[spmcq_route(ptr)], ptr);
+    for (unsigned q = 0; q < nrings; q++)
+        if (spmcq_ring_publish(&rings[q]) && nrings > 1)
+            spmcq_wake_owner(&rings[q]);
+}
+
 void
 SPMCQ_Enq(dataentry *ptr)
 {
+    if (ring_mode) {
+        struct spmcq_ring *r;
+
+        /* the ring has a single producer, so producers take turns */
+        if (multi_producer)
+            AZ(pthread_mutex_lock(&spmcq_lock));
+        r = &rings[spmcq_route(ptr)];
+        spmcq_ring_put(r, ptr);
+        if (spmcq_ring_publish(r) && nrings > 1)
+            spmcq_wake_owner(r);
+        spmcq_arrive(1);
+        if (multi_producer)
+            AZ(pthread_mutex_unlock(&spmcq_lock));
+        return;
+    }
     AZ(pthread_mutex_lock(&spmcq_lock));
 #if 0
-    assert(enqs - deqs < config.max_records);
+    assert(enqs - deqs < MAX_RECORDS);
 #endif
     enqs++;
     VSTAILQ_INSERT_TAIL(&enq_head, ptr, spmcq);
     if (VSTAILQ_EMPTY(&spmcq_head))
         VSTAILQ_CONCAT(&spmcq_head, &enq_head);
+    spmcq_arrive(1);
+    AZ(pthread_mutex_unlock(&spmcq_lock));
+}
+
+/*
+ * Enqueues the n records on list, linked by their spmcq fields, in one
+ * operation, and leaves list empty. In ring mode, the slots are written
+ * first and published with one store of the tail of each ring.
+ */
+void
+SPMCQ_EnqBatch(struct rechead_s *list, unsigned n)
+{
+    if (n == 0)
+        return;
+    if (ring_mode) {
+        if (multi_producer)
+            AZ(pthread_mutex_lock(&spmcq_lock));
+        spmcq_ring_enqlist(list);
+        spmcq_arrive(n);
+        if (multi_producer)
+            AZ(pthread_mutex_unlock(&spmcq_lock));
+        VSTAILQ_INIT(list);
+        return;
+    }
+    AZ(pthread_mutex_lock(&spmcq_lock));
+    enqs += n;
+    VSTAILQ_CONCAT(&enq_head, list);
+    if (VSTAILQ_EMPTY(&spmcq_head))
+        VSTAILQ_CONCAT(&spmcq_head, &enq_head);
+    spmcq_arrive(n);
     AZ(pthread_mutex_unlock(&spmcq_lock));
 }
 
@@ -101,6 +464,15 @@ dataentry
 {
     void *ptr;
 
+    if (ring_mode) {
+        struct spmcq_ring *r = spmcq_victim(1);
+        dataentry *entry;
+
+        if (r == NULL || spmcq_ring_deqbatch(r, &entry, 1) == 0)
+            return NULL;
+        return entry;
+    }
+
     AZ(pthread_mutex_lock(&spmcq_deq_lock));
     if (VSTAILQ_EMPTY(&deq_head)) {
         AZ(pthread_mutex_lock(&spmcq_lock));
@@ -118,9 +490,79 @@ dataentry
     return ptr;
 }
 
+unsigned
+SPMCQ_DeqBatch(dataentry **out, unsigned max)
+{
+    unsigned n = 0;
+
+    AN(out);
+    assert(max > 0);
+
+    if (ring_mode) {
+        struct spmcq_ring *r = spmcq_victim(1);
+
+        return r == NULL ? 0 : spmcq_ring_deqbatch(r, out, max);
+    }
+
+    AZ(pthread_mutex_lock(&spmcq_deq_lock));
+    if (VSTAILQ_EMPTY(&deq_head)) {
+        AZ(pthread_mutex_lock(&spmcq_lock));
+        VSTAILQ_CONCAT(&deq_head, &spmcq_head);
+        AZ(pthread_mutex_unlock(&spmcq_lock));
+    }
+    while (n < max && !VSTAILQ_EMPTY(&deq_head)) {
+        out[n++] = VSTAILQ_FIRST(&deq_head);
+        VSTAILQ_REMOVE_HEAD(&deq_head, spmcq);
+    }
+    deqs += n;
+    AZ(pthread_mutex_unlock(&spmcq_deq_lock));
+    return n;
+}
+
+/*
+ * As SPMCQ_DeqBatch(), for the worker that owns ring q with
+ * queue.affinity: from its own ring, or else stolen from another.
+ */
+unsigned
+SPMCQ_DeqBatchOwn(unsigned q, dataentry **out, unsigned max)
+{
+    struct spmcq_ring *r;
+    unsigned n;
+
+    if (!ring_mode || nrings == 1 || q >= nrings)
+        return SPMCQ_DeqBatch(out, max);
+    AN(out);
+    assert(max > 0);
+    if ((n = spmcq_ring_deqbatch(&rings[q], out, max)) > 0)
+        return n;
+    if ((r = spmcq_victim(config.worker_batch)) == NULL)
+        return 0;
+    if ((n = spmcq_ring_deqbatch(r, out, max)) > 0)
+        __atomic_add_fetch(&steals, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+/*
+ * With queue.affinity, sets the waiter of the worker that owns ring q,
+ * which is woken up when records are routed to the ring. With NULL, the
+ * ring is left to the other workers, as when its worker is abandoned.
+ */
+void
+SPMCQ_Own(unsigned q, struct spmcq_waiter *w)
+{
+    if (!ring_mode || nrings == 1 || q >= nrings)
+        return;
+    if (w != NULL)
+        w->queue = q;
+    __atomic_store_n(&rings[q].owner, w, __ATOMIC_RELEASE);
+}
+
 void
 SPMCQ_Drain(void)
 {
+    /* the ring has no staging list, enqueued records are always visible */
+    if (ring_mode)
+        return;
     AZ(pthread_mutex_lock(&spmcq_lock));
     VSTAILQ_CONCAT(&spmcq_head, &enq_head);
     AZ(pthread_mutex_unlock(&spmcq_lock));
@@ -135,9 +577,9 @@ SPMCQ_Drain(void)
  * u: service rate
  * p: utilization
  *
- * to get an optimal M, we would need to measure l and u, so to
- * simplify, we just try to keep the number of workers proportional to
- * the queue length
+ * SPMCQ_NeedWorkers() computes M from the measured rates. This simpler
+ * test only keeps the number of workers proportional to the queue
+ * length:
  *
  * wake up another worker if queue is sufficiently full
  * Q_Len > working * qlen_goal / max_workers
@@ -157,3 +599,230 @@ SPMCQ_NeedWorker(int running)
     return spmcq_len() > spmcq_wrk_len_ratio(running - spmcq_datawaiter,
                                              running);
 }
+
+/*
+ * how many workers should we wake up after enqueuing a batch of n?
+ *
+ * With the arrival rate l and the service time 1/u measured as above,
+ * M = l / (u x RATE_UTIL) workers keep up with the load. So that a
+ * backlog is worked off, the queue length rule above also applies, by
+ * which Q_Len x max_workers / qlen_goal workers should be working; the
+ * larger number is taken, and at least one if all are waiting. Until
+ * service times have been measured, only the queue length counts.
+ *
+ * No more are woken than the waiting workers, and than needed to
+ * dequeue the batch in worker.batch sized parts.
+ */
+unsigned
+SPMCQ_NeedWorkers(int running, unsigned n)
+{
+    int waiting = __atomic_load_n(&spmcq_datawaiter, __ATOMIC_RELAXED);
+    int working = running - waiting;
+    unsigned want, need;
+    double l, s;
+
+    if (running == 0 || waiting <= 0 || n == 0)
+        return 0;
+    if (qlen_goal == 0)
+        want = running;
+    else {
+        want = spmcq_len() * (unsigned long) running / qlen_goal;
+        __atomic_load(&arrival_rate, &l, __ATOMIC_RELAXED);
+        __atomic_load(&svc_time, &s, __ATOMIC_RELAXED);
+        if (s > 0. && l * s / RATE_UTIL + 1. > want)
+            want = l * s / RATE_UTIL + 1.;
+    }
+    if (want < 1)
+        want = 1;
+    if (want <= working)
+        return 0;
+    need = want - working;
+    if (need > waiting)
+        need = waiting;
+    if (need > (n + config.worker_batch - 1) / config.worker_batch)
+        need = (n + config.worker_batch - 1) / config.worker_batch;
+    return need;
+}
+
+/* Workers report the time in seconds taken to send n records */
+void
+SPMCQ_Served(unsigned n, double t)
+{
+    __atomic_add_fetch(&served.n, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&served.ns, (unsigned long) (t * 1e9),
+                       __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * Each parked worker sleeps on the futex word in its own spmcq_waiter,
+ * so that a wake-up goes to the one worker chosen by SPMCQ_Wake(),
+ * rather than to whichever thread a shared condition variable
+ * releases. Other systems wait on a condition variable per waiter.
+ */
+
+static inline void
+spmcq_waiter_wait(struct spmcq_waiter *w)
+{
+#ifdef __linux__
+    AZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+    while (__atomic_load_n(&w->parked, __ATOMIC_ACQUIRE))
+        (void) syscall(SYS_futex, &w->parked, FUTEX_WAIT_PRIVATE, 1, NULL,
+                       NULL, 0);
+#else
+    while (w->parked)
+        AZ(pthread_cond_wait(&w->cond, &spmcq_datawaiter_lock));
+    AZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+#endif
+}
+
+/* called under spmcq_datawaiter_lock, after w is taken off its stack */
+static inline void
+spmcq_unpark(struct spmcq_waiter *w)
+{
+    /* read without the lock by producers and the monitor */
+    __atomic_sub_fetch(&spmcq_datawaiter, 1, __ATOMIC_RELAXED);
+    if (w->remote)
+        spmcq_remotewaiter--;
+    __atomic_store_n(&w->parked, 0, __ATOMIC_RELEASE);
+}
+
+static inline void
+spmcq_waiter_wake(struct spmcq_waiter *w)
+{
+    spmcq_unpark(w);
+#ifdef __linux__
+    (void) syscall(SYS_futex, &w->parked, FUTEX_WAKE_PRIVATE, 1, NULL, NULL,
+                   0);
+#else
+    AZ(pthread_cond_signal(&w->cond));
+#endif
+}
+
+void
+SPMCQ_Waiter_Init(struct spmcq_waiter *w, unsigned remote)
+{
+    w->parked = 0;
+    w->remote = remote;
+    w->queue = UINT_MAX;
+    w->next = NULL;
+#ifndef __linux__
+    AZ(pthread_cond_init(&w->cond, NULL));
+#endif
+}
+
+/* whether w would find records to dequeue, see SPMCQ_DeqBatchOwn() */
+static inline int
+spmcq_has_work(const struct spmcq_waiter *w)
+{
+    if (!ring_mode || nrings == 1 || w->queue >= nrings)
+        return spmcq_len() > 0;
+    return spmcq_ring_len(&rings[w->queue]) > 0
+        || spmcq_victim(config.worker_batch) != NULL;
+}
+
+/*
+ * Parks the calling worker until SPMCQ_Wake() chooses it, or records
+ * are routed to its own ring. Called with
+ * spmcq_datawaiter_lock held, which is released.
+ *
+ * The fences here and in SPMCQ_Wake() ensure that either the producer
+ * sees this worker waiting, or the worker sees the records enqueued
+ * before the producer looked, and does not park.
+ */
+void
+SPMCQ_Park(struct spmcq_waiter *w)
+{
+    struct spmcq_waiter **top = w->remote ? &remote_top : &local_top;
+
+    AZ(w->parked);
+    w->parked = 1;
+    w->next = *top;
+    *top = w;
+    __atomic_add_fetch(&spmcq_datawaiter, 1, __ATOMIC_RELAXED);
+    if (w->remote)
+        spmcq_remotewaiter++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (spmcq_has_work(w)) {
+        *top = w->next;
+        spmcq_unpark(w);
+        AZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+        return;
+    }
+    spmcq_waiter_wait(w);
+}
+
+/*
+ * Wakes up to n parked workers, preferring those on the reader's NUMA
+ * node, and returns the number woken.
+ *
+ * the first test is not synced, so we might enter the if body
+ * unnecessarily, and then find out under the lock
+ */
+unsigned
+SPMCQ_Wake(unsigned n)
+{
+    struct spmcq_waiter *w;
+    unsigned woken = 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (n == 0 || __atomic_load_n(&spmcq_datawaiter, __ATOMIC_RELAXED) == 0)
+        return 0;
+    AZ(pthread_mutex_lock(&spmcq_datawaiter_lock));
+    for (; woken < n; woken++) {
+        if ((w = local_top) != NULL)
+            local_top = w->next;
+        else if ((w = remote_top) != NULL)
+            remote_top = w->next;
+        else
+            break;
+        spmcq_waiter_wake(w);
+    }
+    AZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+    return woken;
+}
+
+/*
+ * Wakes the owner of ring r after records were routed to it, if it is
+ * parked. Called by the producer after publishing the records; pairs
+ * with the fence in SPMCQ_Park().
+ */
+static void
+spmcq_wake_owner(struct spmcq_ring *r)
+{
+    struct spmcq_waiter *w, **wp;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    w = __atomic_load_n(&r->owner, __ATOMIC_ACQUIRE);
+    if (w == NULL || !__atomic_load_n(&w->parked, __ATOMIC_RELAXED))
+        return;
+    AZ(pthread_mutex_lock(&spmcq_datawaiter_lock));
+    for (wp = w->remote ? &remote_top : &local_top; *wp != NULL;
+         wp = &(*wp)->next)
+        if (*wp == w) {
+            *wp = w->next;
+            spmcq_waiter_wake(w);
+            break;
+        }
+    AZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+}
+
+void
+SPMCQ_WakeAll(void)
+{
+    (void) SPMCQ_Wake(UINT_MAX);
+}
+
+void
+SPMCQ_Log(void)
+{
+    double l, s;
+
+    __atomic_load(&arrival_rate, &l, __ATOMIC_RELAXED);
+    __atomic_load(&svc_time, &s, __ATOMIC_RELAXED);
+    LOG_Log(LOG_INFO, "Queue: len=%u arrival_rate=%.1f service_time=%.09f "
+            "workers_needed=%.1f waiting=%d rings=%u steals=%lu",
+            spmcq_len(), l, s, l * s / RATE_UTIL, spmcq_datawaiter,
+            ring_mode ? nrings : 0, steals);
+}
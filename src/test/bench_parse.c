@@ -0,0 +1,162 @@
+/*-
+ * Copyright (c) 2026 UPLEX Nils Goroll Systemoptimierung
+ * Copyright (c) 2026 Otto Gmbh & Co KG
+ * All rights reserved
+ * Use only with permission
+ *
+ * Author: agent <agent@local>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Microbenchmark for Parse_Timestamp() and Parse_VCL_Log(), comparing the
+ * fixed-width SWAR path for Timestamp records with the general parser, and
+ * Parse_VCL_Log() with its previous implementation. parse.c is included,
+ * for access to the general parser.
+ *
+ * Usage: bench_parse [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../parse.c"
+
+#include "vtim.h"
+
+#define NRECS 1024
+
+static char ts[NRECS][sizeof("Resp: 4294967295.999999 0.000281 0.000082")];
+static int tslen[NRECS];
+static const char *vcl[] = {
+    "url=/index.html",
+    "http_Host=foo.bar.org",
+    "key 12345678",
+    "1253687608 url=%2Frdrtestapp%2F",
+    "ua=Mozilla/5.0 (X11; Linux x86_64)",
+    "1253687608 key foobarbazquux",
+};
+#define NVCL (sizeof(vcl) / sizeof(vcl[0]))
+
+/* Parse_VCL_Log() before the fast path */
+static int
+vcl_log_prev(const char * const ptr, const int len, const char **data,
+             int *datalen, vcl_log_t *type)
+{
+    const char *c = ptr;
+
+    *type = VCL_LOG_DATA;
+    if (isdigit(*c)) {
+        do {
+            c++;
+        } while (isdigit(*c));
+        if (*c == ' ' && (c - ptr + 1 < len))
+            c++;
+        else
+            c = ptr;
+    }
+    if (strncmp(c, "key ", 4) == 0) {
+        c += 4;
+        *type = VCL_LOG_KEY;
+    }
+    *data = c;
+    *datalen = ptr + len - *data;
+    return(0);
+}
+
+static volatile unsigned long sink;
+
+static double
+bench_ts(unsigned long n, int fixed)
+{
+    struct timeval t;
+    unsigned long sum = 0;
+    double start = VTIM_mono();
+
+    for (unsigned long i = 0; i < n; i++) {
+        const char *p = ts[i % NRECS] + (sizeof("Resp: ") - 1);
+        int len = tslen[i % NRECS];
+        if (!fixed || parse_timestamp_fixed(p, len - 6, &t) != 0)
+            parse_timestamp(p, len, &t);
+        sum += t.tv_sec + t.tv_usec;
+    }
+    sink = sum;
+    return VTIM_mono() - start;
+}
+
+static double
+bench_vcl(unsigned long n, int prev)
+{
+    const char *data;
+    int datalen;
+    vcl_log_t type;
+    unsigned long sum = 0;
+    double start = VTIM_mono();
+
+    for (unsigned long i = 0; i < n; i++) {
+        const char *p = vcl[i % NVCL];
+        if (prev)
+            vcl_log_prev(p, strlen(p), &data, &datalen, &type);
+        else
+            Parse_VCL_Log(p, strlen(p), &data, &datalen, &type);
+        sum += datalen + type;
+    }
+    sink = sum;
+    return VTIM_mono() - start;
+}
+
+static void
+report(const char *name, unsigned long n, double general, double fast)
+{
+    printf("%-14s general %6.2f ns  fast %6.2f ns  speedup %.2fx\n", name,
+           general * 1e9 / n, fast * 1e9 / n, general / fast);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long n = 10000000;
+
+    if (argc > 1)
+        n = strtoul(argv[1], NULL, 10);
+    if (n == 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    srand48(4711);
+    for (int i = 0; i < NRECS; i++)
+        tslen[i] = sprintf(ts[i], "Resp: %u.%06u 0.000281 0.000082",
+                           (unsigned) (1400000000 + lrand48() % 100000000),
+                           (unsigned) (lrand48() % 1000000));
+
+    /* warm up */
+    (void) bench_ts(n / 10, 0);
+    (void) bench_ts(n / 10, 1);
+
+    report("Timestamp", n, bench_ts(n, 0), bench_ts(n, 1));
+    report("VCL_Log", n, bench_vcl(n, 1), bench_vcl(n, 0));
+    return 0;
+}
@@ -41,10 +41,13 @@ function regress {
     # since these are written asynchronously.
 
     # the first sed removes the version/revision from the "initializing" line
-    # the second sed removes the user under which the child process runs
+    # the second sed removes the user under which the child process runs,
+    # the copy variant chosen for the CPU, and the addresses, backing and
+    # page sizes of the data tables
     # "Not running as root" filtered so that the test is independent of
-    # the user running it
-    CKSUM=$( grep -v 'Worker 1' $LOG |  sed -e 's/\(initializing\) \(.*\)/\1/' | sed -e 's/\(Running as\) \([a-zA-Z0-9]*\)$/\1/' -e 's/\(Reader: took\) [0-9]* \(free\)/\1 \2/' | grep -v 'Not running as root' | cksum)
+    # the user running it, the NUMA lines so that it is independent of the
+    # topology of the machine
+    CKSUM=$( grep -v 'Worker 1' $LOG |  sed -e 's/\(initializing\) \(.*\)/\1/' | sed -e 's/\(Running as\) \([a-zA-Z0-9]*\)$/\1/' -e 's/\(Reader: took\) [0-9]* \(free\)/\1 \2/' -e 's/\(Payload copy:\) .*/\1/' -e 's/\(Data table [a-z]* (segment [0-9]*): [0-9]* bytes\).*/\1/' | grep -v 'Not running as root' | grep -v 'NUMA' | cksum)
     if [ "$CKSUM" != "$2" ]; then
         echo "ERROR: Regression test incorrect reader log cksum: $CKSUM"
         exit 1
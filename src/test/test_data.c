@@ -65,7 +65,7 @@ static char
     MAN(entrytbl);
     MAN(chunktbl);
     MASSERT(!VSTAILQ_EMPTY(&freerechead));
-    MASSERT(!VSTAILQ_EMPTY(&freechunkhead));
+    MASSERT(!VSTAILQ_EMPTY(&freechunkhead[0]));
 
     chunks_per_rec = (DEF_MAX_RECLEN + DEF_CHUNK_SIZE - 1) / DEF_CHUNK_SIZE;
     nchunks = chunks_per_rec * DEF_MAX_RECORDS;
@@ -75,7 +75,6 @@ static char
 
     for (int i = 0; i < nchunks; i++) {
         MCHECK_OBJ_NOTNULL(&chunktbl[i], CHUNK_MAGIC);
-        MASSERT(!OCCUPIED(&chunktbl[i]));
         MAN(chunktbl[i].data);
     }
 
@@ -90,7 +89,7 @@ static char
         MAZ(entrytbl[i].curchunkidx);
     }
 
-    VSTAILQ_FOREACH(chunk, &freechunkhead, freelist) {
+    VSTAILQ_FOREACH(chunk, &freechunkhead[0], freelist) {
         MCHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
         free_chunk++;
     }
@@ -141,7 +140,7 @@ static const char
     MASSERT(nfree == nchunks);
     MASSERT(!VSTAILQ_EMPTY(&local_freechunk));
     MAZ(global_nfree_chunk);
-    MASSERT(VSTAILQ_EMPTY(&freechunkhead));
+    MASSERT(VSTAILQ_EMPTY(&freechunkhead[0]));
     VSTAILQ_FOREACH(chunk, &local_freechunk, freelist) {
         MCHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
         cfree++;
@@ -185,8 +184,8 @@ static const char
 
     MASSERT(VSTAILQ_EMPTY(&local_freechunk));
     MASSERT(global_nfree_chunk == nchunks);
-    MASSERT(!VSTAILQ_EMPTY(&freechunkhead));
-    VSTAILQ_FOREACH(chunk, &freechunkhead, freelist) {
+    MASSERT(!VSTAILQ_EMPTY(&freechunkhead[0]));
+    VSTAILQ_FOREACH(chunk, &freechunkhead[0], freelist) {
         MCHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
         cfree++;
     }
@@ -260,6 +259,7 @@ static const char
     for (int i = 0; i < CHUNKS_PER_REC; i++) {
         VSTAILQ_INSERT_TAIL(&entry.chunks, &c[i], chunklist);
         c[i].magic = CHUNK_MAGIC;
+        c[i].class = 0;
         c[i].data = (char *) malloc(config.chunk_size);
     }
 
@@ -273,15 +273,12 @@ static const char
     MAZ(entry.keylen);
     MAZ(entry.curchunk);
     MAZ(entry.curchunkidx);
-    MASSERT(EMPTY(entry.key));
     MASSERT(VSTAILQ_EMPTY(&entry.chunks));
     free(entry.key);
 
     MASSERT(!VSTAILQ_EMPTY(&local_freechunk));
     VSTAILQ_FOREACH(chunk, &local_freechunk, freelist) {
         MCHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
-        MASSERT(!OCCUPIED(chunk));
-        MAZ(chunk->data[0]);
         n++;
         free(chunk->data);
     }
@@ -290,6 +287,448 @@ static const char
     return NULL;
 }
 
+static const char
+*test_data_classes(void)
+{
+    unsigned perclass[MAX_CHUNK_CLASSES], nfree, n[MAX_CHUNK_CLASSES];
+    chunkhead_t local[MAX_CHUNK_CLASSES];
+    chunk_t *chunk;
+    dataentry *entry;
+
+    printf("... testing chunk size classes\n");
+
+    config.max_records = DEF_MAX_RECORDS;
+    config.max_reclen = DEF_MAX_RECLEN;
+    config.chunk_size = DEF_CHUNK_SIZE;
+    config.chunk_classes = 3;
+    config.chunk_classes_percent = 50;
+
+    MASSERT(DATA_Chunks(DEF_CHUNK_SIZE, NULL) == 1);
+    MASSERT(DATA_Chunks(DEF_CHUNK_SIZE + 1, NULL) == 2);
+    /* 256 + 512 + 1024 + 1024 */
+    MASSERT(DATA_Chunks(DEF_CHUNK_SIZE * 10, perclass) == 4);
+    MASSERT(perclass[0] == 1);
+    MASSERT(perclass[1] == 1);
+    MASSERT(perclass[2] == 2);
+    MAZ(perclass[3]);
+
+    /* all records have a class 0 chunk, half of them the larger ones */
+    MAZ(DATA_Init());
+    MASSERT(global_nfree_chunk == 2 * DEF_MAX_RECORDS);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++) {
+        VSTAILQ_INIT(&local[c]);
+        n[c] = 0;
+    }
+    nfree = DATA_Take_Freechunk(local);
+    MASSERT(nfree == 2 * DEF_MAX_RECORDS);
+    MAZ(global_nfree_chunk);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++) {
+        MASSERT(VSTAILQ_EMPTY(&freechunkhead[c]));
+        VSTAILQ_FOREACH(chunk, &local[c], freelist) {
+            MCHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
+            n[c]++;
+        }
+    }
+    MASSERT(n[0] == DEF_MAX_RECORDS);
+    MASSERT(n[1] == DEF_MAX_RECORDS / 2);
+    MASSERT(n[2] == DEF_MAX_RECORDS / 2);
+    MAZ(n[3]);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+        VSTAILQ_FOREACH(chunk, &local[c], freelist)
+            MASSERT(chunk->class == c);
+
+    /* chunks of each class are laid out contiguously */
+    chunk = VSTAILQ_FIRST(&local[1]);
+    MASSERT(CHUNK_LEN(chunk) == 2 * DEF_CHUNK_SIZE);
+    MASSERT(VSTAILQ_NEXT(chunk, freelist)->data
+            == chunk->data + 2 * DEF_CHUNK_SIZE);
+
+    /*
+     * a record with four chunks returns them to their classes, also if
+     * the second one fell back to class 0
+     */
+    entry = &entrytbl[0];
+    for (int i = 0; i < 4; i++) {
+        int c = i == 1 ? 0 : CHUNK_CLASS(i);
+
+        chunk = VSTAILQ_FIRST(&local[c]);
+        VSTAILQ_REMOVE_HEAD(&local[c], freelist);
+        VSTAILQ_INSERT_TAIL(&entry->chunks, chunk, chunklist);
+    }
+    entry->nchunks = 4;
+    MASSERT(DATA_Reset(entry, local) == 4);
+    MAZ(entry->nchunks);
+    DATA_Return_Freechunk(local, nfree);
+    MASSERT(global_nfree_chunk == nfree);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++) {
+        MASSERT(VSTAILQ_EMPTY(&local[c]));
+        n[c] = 0;
+        VSTAILQ_FOREACH(chunk, &freechunkhead[c], freelist)
+            n[c]++;
+    }
+    MASSERT(n[0] == DEF_MAX_RECORDS);
+    MASSERT(n[1] == DEF_MAX_RECORDS / 2);
+    MASSERT(n[2] == DEF_MAX_RECORDS / 2);
+
+    config.chunk_classes = 1;
+    config.chunk_classes_percent = DEF_CHUNK_CLASSES_PERCENT;
+    return NULL;
+}
+
+static const char
+*test_data_ring(void)
+{
+    dataentry *e[3];
+    char *p, *start;
+    unsigned nfree_chunks;
+
+    printf("... testing ring storage\n");
+
+    VSTAILQ_INIT(&local_freechunk);
+    config.max_records = DEF_MAX_RECORDS;
+    config.max_reclen = DEF_MAX_RECLEN;
+    config.ring_size = DEF_MAX_RECLEN - 1;
+    MASSERT(DATA_Init() == EINVAL);
+
+    config.ring_size = 2 * DEF_MAX_RECLEN + 512;
+    MAZ(DATA_Init());
+    MAZ(global_nfree_chunk);
+    MAZ(global_ring_used);
+    for (int i = 0; i < 3; i++) {
+        e[i] = &entrytbl[i];
+        MCHECK_OBJ_NOTNULL(e[i], DATA_MAGIC);
+        MAZ(e[i]->data);
+    }
+
+    start = DATA_Ring_Reserve();
+    MAN(start);
+    e[0]->data = start;
+    e[0]->end = DEF_MAX_RECLEN;
+    DATA_Ring_Commit(e[0]);
+    MASSERT(global_ring_used == DEF_MAX_RECLEN);
+
+    p = DATA_Ring_Reserve();
+    MASSERT(p == start + DEF_MAX_RECLEN);
+    e[1]->data = p;
+    e[1]->end = 1000;
+    DATA_Ring_Commit(e[1]);
+    MASSERT(global_ring_used == DEF_MAX_RECLEN + 1000);
+
+    /* less than max.reclen left at either end */
+    MAZ(DATA_Ring_Reserve());
+
+    /* release the first record, the next one wraps around */
+    nfree_chunks = DATA_Reset(e[0], &local_freechunk);
+    MAZ(nfree_chunks);
+    MAZ(e[0]->data);
+    p = DATA_Ring_Reserve();
+    MASSERT(p == start);
+    e[2]->data = p;
+    e[2]->end = 10;
+    DATA_Ring_Commit(e[2]);
+    MASSERT(global_ring_used == 1000 + 536 + 10);
+
+    /* space is reclaimed in FIFO order */
+    DATA_Reset(e[2], &local_freechunk);
+    MAZ(DATA_Ring_Reserve());
+    DATA_Reset(e[1], &local_freechunk);
+    p = DATA_Ring_Reserve();
+    MASSERT(p == start);
+    MAZ(global_ring_used);
+    MASSERT(VSTAILQ_EMPTY(&local_freechunk));
+
+    config.ring_size = 0;
+    return NULL;
+}
+
+static const char
+*test_data_hugepages(void)
+{
+    unsigned nfree;
+
+    printf("... testing hugepage-backed, prefaulted data tables\n");
+
+    config.data_hugepages = 1;
+    config.data_prefault = 1;
+    MAZ(DATA_Init());
+    MAZ((uintptr_t) entrytbl & (CACHELINE_SIZE - 1));
+    MASSERT(global_nfree_rec == config.max_records);
+    for (int i = 0; i < config.max_records; i++) {
+        MCHECK_OBJ_NOTNULL(&entrytbl[i], DATA_MAGIC);
+        MAZ(OCCUPIED(&entrytbl[i]));
+        MAZ(*entrytbl[i].key);
+    }
+    nfree = 0;
+    for (int i = 0; i < global_nfree_chunk; i++) {
+        MCHECK_OBJ_NOTNULL(&chunktbl[i], CHUNK_MAGIC);
+        MAZ(*chunktbl[i].data);
+        nfree++;
+    }
+    MASSERT(nfree == config.max_records
+            * DATA_Chunks(config.max_reclen, NULL));
+
+    config.data_hugepages = 0;
+    config.data_prefault = 0;
+    return NULL;
+}
+
+static const char
+*test_data_segments(void)
+{
+    struct rechead_s recs;
+    chunkhead_t chunks[MAX_CHUNK_CLASSES];
+    unsigned nrec, nchunk, chunks_per_rec;
+    dataentry *entry;
+
+    printf("... testing growth and shrinking of the data table\n");
+
+    MAZ(LOG_Open("test_data"));
+    config.max_records = 16;
+    config.max_reclen = DEF_MAX_RECLEN;
+    config.chunk_size = DEF_CHUNK_SIZE;
+    chunks_per_rec = DATA_Chunks(DEF_MAX_RECLEN, NULL);
+
+    config.max_records_limit = 16 * (MAX_DATA_SEGMENTS + 1);
+    MASSERT(DATA_Init() == EINVAL);
+    config.max_records_limit = 40;
+    config.ring_size = DEF_MAX_RECLEN;
+    MASSERT(DATA_Init() == EINVAL);
+    config.ring_size = 0;
+
+    MAZ(DATA_Init());
+    MASSERT(DATA_SEGMENTS == 3);
+    MASSERT(global_nsegments == 1);
+    MASSERT(global_nrec == 16);
+    MASSERT(global_nchunk == 16 * chunks_per_rec);
+
+    VSTAILQ_INIT(&recs);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+        VSTAILQ_INIT(&chunks[c]);
+    nrec = DATA_Take_Freerec(&recs);
+    nchunk = DATA_Take_Freechunk(chunks);
+    MASSERT(nrec == 16);
+    MAZ(DATA_Take_Freerec(&recs));
+
+    /* grow to the limit */
+    MAZ(DATA_Grow());
+    MASSERT(global_nsegments == 2);
+    MASSERT(global_nfree_rec == 16);
+    nrec += DATA_Take_Freerec(&recs);
+    nchunk += DATA_Take_Freechunk(chunks);
+    MAZ(DATA_Grow());
+    nrec += DATA_Take_Freerec(&recs);
+    nchunk += DATA_Take_Freechunk(chunks);
+    MASSERT(DATA_Grow() == ENOSPC);
+    MASSERT(global_nsegments == 3);
+    MASSERT(global_nrec == 48);
+    MASSERT(nrec == 48);
+    MASSERT(nchunk == 48 * chunks_per_rec);
+    VSTAILQ_FOREACH(entry, &recs, freelist)
+        MCHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+
+    /* nothing happens without a request */
+    DATA_Drain(&recs, &nrec, chunks, &nchunk);
+    MASSERT(nrec == 48);
+
+    /* a record held elsewhere keeps the segment from being removed */
+    entry = VSTAILQ_FIRST(&recs);
+    VSTAILQ_REMOVE_HEAD(&recs, freelist);
+    nrec--;
+    DATA_Shrink();
+    DATA_Drain(&recs, &nrec, chunks, &nchunk);
+    MASSERT(global_nsegments == 3);
+    MASSERT(nrec == 32);
+    MASSERT(nchunk == 32 * chunks_per_rec);
+
+    /* growing while draining returns the parked records and chunks */
+    MAZ(DATA_Grow());
+    MASSERT(global_nsegments == 3);
+    MASSERT(global_nfree_rec == 15);
+    nrec += DATA_Take_Freerec(&recs);
+    nchunk += DATA_Take_Freechunk(chunks);
+    MASSERT(nrec == 47);
+    MASSERT(nchunk == 48 * chunks_per_rec);
+
+    /* the segment is removed once all of its records are parked */
+    VSTAILQ_INSERT_HEAD(&recs, entry, freelist);
+    nrec++;
+    DATA_Shrink();
+    DATA_Drain(&recs, &nrec, chunks, &nchunk);
+    MASSERT(global_nsegments == 2);
+    MASSERT(global_nrec == 32);
+    MASSERT(global_nchunk == 32 * chunks_per_rec);
+    MASSERT(nrec == 32);
+    MASSERT(nchunk == 32 * chunks_per_rec);
+    nrec = 0;
+    VSTAILQ_FOREACH(entry, &recs, freelist) {
+        MCHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+        nrec++;
+    }
+    MASSERT(nrec == 32);
+
+    /* and may be added again */
+    MAZ(DATA_Grow());
+    MASSERT(global_nsegments == 3);
+    MASSERT(global_nfree_rec == 16);
+
+    config.max_records_limit = 0;
+    config.max_records = DEF_MAX_RECORDS;
+    return NULL;
+}
+
+static const char
+*test_data_numa(void)
+{
+    struct rechead_s recs;
+    chunkhead_t chunks[MAX_CHUNK_CLASSES];
+    unsigned nrec, half;
+    dataentry *entry;
+    chunk_t *chunk;
+
+    printf("... testing NUMA pools\n");
+
+    /* simulate two nodes */
+    numa_nodes = 2;
+    numa_self = 0;
+    MAZ(DATA_Init());
+    half = config.max_records / 2;
+    for (int i = 0; i < config.max_records; i++)
+        MASSERT(entrytbl[i].node == (i < half ? 0 : 1));
+    for (int i = 0; i < global_nfree_chunk; i++)
+        MASSERT(chunktbl[i].node < 2);
+
+    /* the local pool is taken first */
+    VSTAILQ_INIT(&recs);
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+        VSTAILQ_INIT(&chunks[c]);
+    nrec = DATA_Take_Freerec(&recs);
+    MASSERT(nrec == half);
+    VSTAILQ_FOREACH(entry, &recs, freelist)
+        MAZ(entry->node);
+    MAN(DATA_Take_Freechunk(chunks));
+    VSTAILQ_FOREACH(chunk, &chunks[0], freelist)
+        MAZ(chunk->node);
+
+    /* then the remote pool */
+    nrec += DATA_Take_Freerec(&recs);
+    MASSERT(nrec == config.max_records);
+    MAZ(DATA_Take_Freerec(&recs));
+
+    /* records return to the pools they came from */
+    DATA_Return_Freerec(&recs, nrec);
+    MASSERT(VSTAILQ_EMPTY(&recs));
+    MASSERT(global_nfree_rec == config.max_records);
+    numa_self = 1;
+    nrec = DATA_Take_Freerec(&recs);
+    MASSERT(nrec == config.max_records - half);
+    VSTAILQ_FOREACH(entry, &recs, freelist)
+        MASSERT(entry->node == 1);
+
+    /* in ring mode, all records are in the home pool */
+    config.ring_size = 2 * DEF_MAX_RECLEN;
+    numa_self = 0;
+    numa_home = 1;
+    MAZ(DATA_Init());
+    for (int i = 0; i < config.max_records; i++)
+        MASSERT(entrytbl[i].node == 1);
+    MASSERT(DATA_Take_Freerec(&recs) == config.max_records);
+    config.ring_size = 0;
+
+    numa_nodes = 1;
+    numa_self = numa_home = 0;
+    return NULL;
+}
+
+static const char
+*test_data_cpulist(void)
+{
+    cpu_set_t set;
+
+    printf("... testing cpulist parsing\n");
+
+    MAZ(NUMA_Cpulist("0-3,8-11\n", &set));
+    MASSERT(CPU_COUNT(&set) == 8);
+    for (int cpu = 0; cpu < 12; cpu++)
+        MASSERT(!!CPU_ISSET(cpu, &set) == (cpu < 4 || cpu >= 8));
+
+    MAZ(NUMA_Cpulist("5", &set));
+    MASSERT(CPU_COUNT(&set) == 1);
+    MASSERT(CPU_ISSET(5, &set));
+
+    MAZ(NUMA_Cpulist("0,2,4-4", &set));
+    MASSERT(CPU_COUNT(&set) == 3);
+    MASSERT(CPU_ISSET(0, &set) && CPU_ISSET(2, &set) && CPU_ISSET(4, &set));
+
+    /* empty lists, as for memory-only nodes */
+    MAZ(NUMA_Cpulist("\n", &set));
+    MAZ(CPU_COUNT(&set));
+    MAZ(NUMA_Cpulist("", &set));
+    MAZ(CPU_COUNT(&set));
+
+    MASSERT(NUMA_Cpulist("x", &set) == EINVAL);
+    MASSERT(NUMA_Cpulist("-1", &set) == EINVAL);
+    MASSERT(NUMA_Cpulist("3-1", &set) == EINVAL);
+    MASSERT(NUMA_Cpulist("0-", &set) == EINVAL);
+    MASSERT(NUMA_Cpulist("0,,1", &set) == EINVAL);
+
+    return NULL;
+}
+
+static const char
+*test_data_format(void)
+{
+    dataentry entry;
+    chunk_t chunk[2];
+    struct datahdr hdr = { 4711, 1430176881, 123 };
+    const char *body = "&abcdefghijklmnopqrstuvwxyabcdefghijklmnopqrstuvwx",
+        *expected = "XID=4711&abcdefghijklmnopqrstuvwxyabcdefghijklmnopqrstuvwx"
+        "&req_endt=1430176881.000123";
+    char result[2 * MIN_CHUNK_SIZE];
+    unsigned len;
+
+    printf("... testing record formatting\n");
+
+    config.chunk_size = MIN_CHUNK_SIZE;
+    config.chunk_classes = 1;
+    config.ring_size = 0;
+    memset(&entry, 0, sizeof(entry));
+    entry.magic = DATA_MAGIC;
+    entry.occupied = 1;
+    VSTAILQ_INIT(&entry.chunks);
+    for (int i = 0; i < 2; i++) {
+        chunk[i].magic = CHUNK_MAGIC;
+        chunk[i].class = 0;
+        chunk[i].data = calloc(1, MIN_CHUNK_SIZE);
+        MAN(chunk[i].data);
+        VSTAILQ_INSERT_TAIL(&entry.chunks, &chunk[i], chunklist);
+    }
+
+    MASSERT(DATA_Xidlen(0) == strlen("XID=0"));
+    MASSERT(DATA_Xidlen(4711) == strlen("XID=4711"));
+    MASSERT(DATA_Xidlen(UINT64_MAX) == DATA_HDR_LEN);
+
+    /* the binary header and request end time are split across the chunks */
+    memcpy(chunk[0].data + DATA_Xidlen(4711), body, strlen(body));
+    entry.end = DATA_Xidlen(4711) + strlen(body) + DATA_TRL_LEN;
+    MASSERT(entry.end - DATA_TRL_LEN + sizeof(hdr) > MIN_CHUNK_SIZE);
+    DATA_Header(&entry, &hdr);
+    MASSERT(!DATA_FORMATTED(&entry));
+
+    DATA_Format(&entry);
+    MASSERT(DATA_FORMATTED(&entry));
+    len = DATA_LEN(&entry);
+    MASSERT(len == strlen(expected));
+    memcpy(result, chunk[0].data, MIN_CHUNK_SIZE);
+    memcpy(result + MIN_CHUNK_SIZE, chunk[1].data, MIN_CHUNK_SIZE);
+    VMASSERT(memcmp(result, expected, len) == 0,
+             "formatted data=[%.*s]", len, result);
+
+    for (int i = 0; i < 2; i++)
+        free(chunk[i].data);
+    config.chunk_size = DEF_CHUNK_SIZE;
+    return NULL;
+}
+
 static const char
 *all_tests(void)
 {
@@ -300,6 +739,13 @@ static const char
     mu_run_test(test_data_return_chunk);
     mu_run_test(test_data_prepend);
     mu_run_test(test_data_clear);
+    mu_run_test(test_data_classes);
+    mu_run_test(test_data_ring);
+    mu_run_test(test_data_hugepages);
+    mu_run_test(test_data_segments);
+    mu_run_test(test_data_numa);
+    mu_run_test(test_data_cpulist);
+    mu_run_test(test_data_format);
 
     return NULL;
 }
@@ -31,10 +31,12 @@
 
 #include <string.h>
 #include <dlfcn.h>
+#include <sys/uio.h>
 
 #include "minunit.h"
 
 #include "../trackrdrd.h"
+#include "mq.h"
 #include "vdef.h"
 #include "vas.h"
 
@@ -70,8 +72,10 @@ init(void)
         fprintf(stderr, "error loading mq method %s: %s", #intfm, err); \
         exit(EXIT_FAILURE);                                             \
     }
+#define OPTMETHOD(instm, intfm) METHOD(instm, intfm)
 #include "../methods.h"
 #undef METHOD
+#undef OPTMETHOD
 }
 
 /* Called from worker.c, but we don't want to pull in all of monitor.c's
@@ -84,6 +88,11 @@ MON_StatsUpdate(stats_update_t update, unsigned nchunks, unsigned nbytes)
     (void) nbytes;
 }
 
+void
+MON_StatsRegister(void)
+{
+}
+
 /* Called from worker.c, but we don't want to pull in all of child.c's
    dependecies. */
 int
@@ -191,6 +200,87 @@ static const char
     return NULL;
 }
 
+static const char
+*test_send_batch(void)
+{
+    const char *err = NULL;
+    int ret, status[3];
+    struct mq_msg msgs[3] = {
+        { "foo", 3, "key", 3 },
+        { "", 0, "key", 3 },
+        { "bar baz quux", 12, "key", 3 },
+    };
+
+    printf("... testing batch message send\n");
+
+    MASSERT0(worker != NULL, "MQ_SendBatch: worker is NULL before call");
+    ret = mqf.send_batch(worker, msgs, 3, status, &err);
+    VMASSERT(ret == 0, "MQ_SendBatch: %s", err);
+    for (int i = 0; i < 3; i++)
+        VMASSERT(status[i] == 0, "MQ_SendBatch: status[%d] = %d", i,
+                 status[i]);
+
+    return NULL;
+}
+
+static const char
+*test_sendv(void)
+{
+    const char *err = NULL;
+    int ret;
+    char foo[] = "foo ", bar[] = "bar ", baz[] = "baz quux";
+    struct iovec iov[3] = {
+        { foo, 4 },
+        { bar, 4 },
+        { baz, 8 },
+    };
+
+    printf("... testing scatter/gather message send\n");
+
+    MASSERT0(worker != NULL, "MQ_SendV: worker is NULL before call");
+    ret = mqf.sendv(worker, iov, 3, "key", 3, &err);
+    VMASSERT(ret == 0, "MQ_SendV: %s", err);
+
+    return NULL;
+}
+
+static void
+release(void *ref, int status)
+{
+    *((int *) ref) = status + 1;
+}
+
+static const char
+*test_send_ref(void)
+{
+    const char *err = NULL;
+    int ret, released = 0;
+
+    printf("... testing message send by reference\n");
+
+    MASSERT0(worker != NULL, "MQ_SendRef: worker is NULL before call");
+    ret = mqf.send_ref(worker, "foo bar baz quux", 16, "key", 3, release,
+                       &released, &err);
+    VMASSERT(ret == 0, "MQ_SendRef: %s", err);
+    VMASSERT(released == 1, "MQ_SendRef: release status %d", released - 1);
+
+    return NULL;
+}
+
+static const char
+*test_poll(void)
+{
+    const char *err;
+
+    printf("... testing MQ poll\n");
+
+    MASSERT0(worker != NULL, "MQ_Poll: worker is NULL before call");
+    err = mqf.poll(worker, 0);
+    VMASSERT(err == NULL, "MQ_Poll: %s", err);
+
+    return NULL;
+}
+
 static const char
 *test_reconnect(void)
 {
@@ -253,6 +343,10 @@ static const char
     mu_run_test(test_version);
     mu_run_test(test_clientID);
     mu_run_test(test_send);
+    mu_run_test(test_send_batch);
+    mu_run_test(test_sendv);
+    mu_run_test(test_send_ref);
+    mu_run_test(test_poll);
     mu_run_test(test_reconnect);
     mu_run_test(test_worker_shutdown);
     mu_run_test(test_global_shutdown);
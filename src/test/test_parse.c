@@ -194,6 +194,17 @@ static char
     VMASSERT(strncmp(data, VCLLOG_TRAIL_SPACE, 5) == 0,
              "VCL_Log trailing space: returned data=[%.*s]", len, data);
 
+    /* "key" without a blank, and "key " beyond len */
+    err = Parse_VCL_Log(VCLKEY, 3, &data, &len, &type);
+    VMASSERT(err == 0, "VCL_Log key: %s", strerror(err));
+    MASSERT(len == 3);
+    MASSERT(type == VCL_LOG_DATA);
+
+    err = Parse_VCL_Log("keys", 4, &data, &len, &type);
+    VMASSERT(err == 0, "VCL_Log keys: %s", strerror(err));
+    MASSERT(len == 4);
+    MASSERT(type == VCL_LOG_DATA);
+
     return NULL;
 }
 
@@ -217,6 +228,34 @@ static char
     MASSERT(tv.tv_sec == 1430176881);
     MASSERT(tv.tv_usec == 1);
 
+    /* other widths than 10 and 6 digits take the general path */
+    #define TS_SHORT "Resp: 143017688.5 0.000281 0.000082"
+    err = Parse_Timestamp(TS_SHORT, strlen(TS_SHORT), &tv);
+    VMASSERT(err == 0, "Parse_Timestamp %s: %s", TS_SHORT, strerror(err));
+    MASSERT(tv.tv_sec == 143017688);
+    MASSERT(tv.tv_usec == 5);
+
+    #define TS_MAX "Resp: 4294967295.999999 0.000281 0.000082"
+    err = Parse_Timestamp(TS_MAX, strlen(TS_MAX), &tv);
+    VMASSERT(err == 0, "Parse_Timestamp %s: %s", TS_MAX, strerror(err));
+    MASSERT(tv.tv_sec == 4294967295);
+    MASSERT(tv.tv_usec == 999999);
+
+    /* the fixed-width fast path against printf */
+    srand48(time(NULL));
+    for (int i = 0; i < 100000; i++) {
+        char ts[sizeof(TS)];
+        unsigned sec = 1000000000 + lrand48() % 3294967296U,
+            usec = lrand48() % 1000000;
+
+        sprintf(ts, "Resp: %u.%06u 0.000281 0.000082", sec, usec);
+        err = Parse_Timestamp(ts, strlen(ts), &tv);
+        VMASSERT(err == 0, "Parse_Timestamp %s: %s", ts, strerror(err));
+        VMASSERT(tv.tv_sec == sec && tv.tv_usec == usec,
+                 "Parse_Timestamp %s: %lu.%06lu", ts,
+                 (unsigned long) tv.tv_sec, (unsigned long) tv.tv_usec);
+    }
+
     return NULL;
 }
 
@@ -34,9 +34,13 @@
 #include <errno.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <sched.h>
 
 #include "minunit.h"
 
+#include "vdef.h"
+#include "vas.h"
+
 #include "../trackrdrd.h"
 
 #define DEBUG 0
@@ -44,8 +48,10 @@
     do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while(0)
 
 #define NCON 10
+#define BATCH 7
 
 #define TABLE_SIZE (DEF_MAX_RECORDS)
+#define NRINGS 4
 
 int run;
 
@@ -66,6 +72,7 @@ int tests_run = 0;
 static char errmsg[BUFSIZ];
 
 static dataentry entries[TABLE_SIZE];
+static char keys[TABLE_SIZE][sizeof("ffffffff")];
 static prod_con_data_t proddata;
 static prod_con_data_t condata[NCON];
 
@@ -82,11 +89,8 @@ static void
     for (int i = 0; i < config.max_records; i++) {
         debug_print("Producer: enqueue %d\n", ++enqs);
         SPMCQ_Enq(&entries[i]);
-        debug_print("%s\n", "Producer: broadcast");
-        if (pthread_cond_broadcast(&spmcq_datawaiter_cond) != 0) {
-            proddata.fail = PRODUCER_BCAST;
-            pthread_exit(&proddata);
-        }
+        debug_print("%s\n", "Producer: wake");
+        (void) SPMCQ_Wake(1);
         proddata.sum += (uintptr_t) &entries[i].chunks;
     }
     debug_print("%s\n", "Producer: exit");
@@ -107,32 +111,47 @@ static void
     pcdata->sum = 0;
     pcdata->fail = SUCCESS;
     dataentry *entry;
+    struct spmcq_waiter waiter;
+
+    /* the upper half wait as if on another NUMA node */
+    SPMCQ_Waiter_Init(&waiter, id > NCON / 2);
 
     while (run) {
         /* run may be stale at this point */
         debug_print("Consumer %d: attempt dequeue\n", id);
-        entry = SPMCQ_Deq();
+        /* even-numbered consumers dequeue in batches */
+        if (id % 2 == 0) {
+            dataentry *batch[BATCH];
+            unsigned n = SPMCQ_DeqBatch(batch, BATCH);
+            for (unsigned i = 0; i < n; i++) {
+                debug_print("Consumer %d: dequeue %d\n", id, ++deqs);
+                pcdata->sum += (uintptr_t) &batch[i]->chunks;
+            }
+            entry = n == 0 ? NULL : batch[0];
+        }
+        else
+            entry = SPMCQ_Deq();
         if (entry == NULL) {
-            /* grab the CV lock, which also constitutes an implicit memory
-               barrier */
+            /* grab the waiter lock, which also constitutes an implicit
+               memory barrier */
             debug_print("Consumer %d: mutex\n", id);
             if (pthread_mutex_lock(&spmcq_datawaiter_lock) != 0)
                 consumer_exit(pcdata, CONSUMER_MUTEX);
             /* run is guaranteed to be fresh here */
             if (run) {
-                debug_print("Consumer %d: wait, run = %d\n", id, run);
-                if (pthread_cond_wait(&spmcq_datawaiter_cond,
-                        &spmcq_datawaiter_lock) != 0)
-                    consumer_exit(pcdata, CONSUMER_WAIT);
+                debug_print("Consumer %d: park, run = %d\n", id, run);
+                SPMCQ_Park(&waiter);
+            }
+            else {
+                debug_print("Consumer %d: unlock\n", id);
+                if (pthread_mutex_unlock(&spmcq_datawaiter_lock) != 0)
+                    consumer_exit(pcdata, CONSUMER_MUTEX);
             }
-            debug_print("Consumer %d: unlock\n", id);
-            if (pthread_mutex_unlock(&spmcq_datawaiter_lock) != 0)
-                consumer_exit(pcdata, CONSUMER_MUTEX);
             if (! run) {
                 debug_print("Consumer %d: quit signaled, run = %d\n", id, run);
                 break;
             }
-        } else {
+        } else if (id % 2 != 0) {
             /* entry != NULL */
             debug_print("Consumer %d: dequeue %d\n", id, ++deqs);
             pcdata->sum += (uintptr_t) &entry->chunks;
@@ -155,15 +174,6 @@ static char
 
     printf("... testing SPMCQ initialization\n");
 
-    if (pthread_mutex_init(&spmcq_datawaiter_lock, NULL) != 0) {
-        sprintf(errmsg, "mutex_init failed: %s", strerror(errno));
-        return(errmsg);
-    }
-    if (pthread_cond_init(&spmcq_datawaiter_cond, NULL) != 0) {
-        sprintf(errmsg, "cond_init failed: %s", strerror(errno));
-        return(errmsg);
-    }
-    
     config.max_records = DEF_MAX_RECORDS;
     err = SPMCQ_Init();
     sprintf(errmsg, "SPMCQ_Init: %s", strerror(err));
@@ -188,6 +198,154 @@ static const char
     return NULL;
 }
 
+static const char
+*test_spmcq_fifo(void)
+{
+    dataentry *entry;
+
+    printf("... testing SPMCQ FIFO order and queue length\n");
+
+    /* qlen.goal 0: another worker is needed iff the queue is not empty */
+    MAZ(SPMCQ_NeedWorker(1));
+    /* more than the table size, so that the ring wraps around */
+    for (int n = 0; n < 3; n++) {
+        for (int i = 0; i < TABLE_SIZE; i++)
+            SPMCQ_Enq(&entries[i]);
+        SPMCQ_Drain();
+        MAN(SPMCQ_NeedWorker(1));
+        for (int i = 0; i < TABLE_SIZE; i++) {
+            entry = SPMCQ_Deq();
+            VMASSERT(entry == &entries[i],
+                     "SPMCQ_Deq: expected entry %d, got %p", i, entry);
+        }
+        MASSERT(SPMCQ_Deq() == NULL);
+        MAZ(SPMCQ_NeedWorker(1));
+    }
+
+    return NULL;
+}
+
+static const char
+*test_spmcq_deqbatch(void)
+{
+    dataentry *batch[BATCH];
+    unsigned n, total = 0;
+
+    printf("... testing SPMCQ batch dequeue\n");
+
+    MAZ(SPMCQ_DeqBatch(batch, BATCH));
+    for (int i = 0; i < TABLE_SIZE; i++)
+        SPMCQ_Enq(&entries[i]);
+    SPMCQ_Drain();
+    while ((n = SPMCQ_DeqBatch(batch, BATCH)) > 0) {
+        MASSERT(n <= BATCH);
+        for (unsigned i = 0; i < n; i++)
+            VMASSERT(batch[i] == &entries[total + i],
+                     "SPMCQ_DeqBatch: expected entry %u, got %p", total + i,
+                     batch[i]);
+        total += n;
+    }
+    VMASSERT(total == TABLE_SIZE, "SPMCQ_DeqBatch: %u of %d entries dequeued",
+             total, TABLE_SIZE);
+    MAZ(SPMCQ_NeedWorker(1));
+
+    return NULL;
+}
+
+static const char
+*test_spmcq_enqbatch(void)
+{
+    struct rechead_s list = VSTAILQ_HEAD_INITIALIZER(list);
+    dataentry *entry;
+    unsigned total = 0;
+
+    printf("... testing SPMCQ batch enqueue\n");
+
+    SPMCQ_EnqBatch(&list, 0);
+    MASSERT(SPMCQ_Deq() == NULL);
+    /* batches of varying sizes, so that the ring wraps around */
+    for (int n = 1; total < 3 * TABLE_SIZE; n = n * 2 + 1) {
+        unsigned first = total;
+
+        if (n > TABLE_SIZE)
+            n = TABLE_SIZE;
+        for (int i = 0; i < n; i++, total++)
+            VSTAILQ_INSERT_TAIL(&list, &entries[total % TABLE_SIZE], spmcq);
+        SPMCQ_EnqBatch(&list, n);
+        MASSERT(VSTAILQ_EMPTY(&list));
+        SPMCQ_Drain();
+        for (unsigned i = first; i < total; i++) {
+            entry = SPMCQ_Deq();
+            VMASSERT(entry == &entries[i % TABLE_SIZE],
+                     "SPMCQ_Deq: expected entry %u, got %p", i % TABLE_SIZE,
+                     entry);
+        }
+        MASSERT(SPMCQ_Deq() == NULL);
+    }
+
+    /* qlen.goal 0: wake up all waiting workers, one per worker.batch */
+    config.worker_batch = BATCH;
+    MAZ(SPMCQ_NeedWorkers(4, 100));
+    spmcq_datawaiter = 3;
+    MAZ(SPMCQ_NeedWorkers(0, 100));
+    MAZ(SPMCQ_NeedWorkers(4, 0));
+    MASSERT(SPMCQ_NeedWorkers(4, 100) == 3);
+    MASSERT(SPMCQ_NeedWorkers(4, BATCH + 1) == 2);
+    MASSERT(SPMCQ_NeedWorkers(4, 1) == 1);
+    spmcq_datawaiter = 0;
+
+    return NULL;
+}
+
+static void
+*parker(void *arg)
+{
+    struct spmcq_waiter *w = arg;
+
+    AZ(pthread_mutex_lock(&spmcq_datawaiter_lock));
+    SPMCQ_Park(w);
+    return NULL;
+}
+
+static const char
+*test_spmcq_park(void)
+{
+    struct spmcq_waiter w[2];
+    pthread_t thr[2];
+    dataentry entry;
+
+    printf("... testing SPMCQ parking of consumers\n");
+
+    MAZ(SPMCQ_Wake(1));
+
+    /* does not park while the queue is not empty */
+    SPMCQ_Waiter_Init(&w[0], 0);
+    SPMCQ_Enq(&entry);
+    SPMCQ_Drain();
+    MAZ(pthread_mutex_lock(&spmcq_datawaiter_lock));
+    SPMCQ_Park(&w[0]);
+    MAZ(spmcq_datawaiter);
+    MAZ(w[0].parked);
+    MASSERT(SPMCQ_Deq() == &entry);
+
+    /* a remote waiter is only woken after the local one */
+    SPMCQ_Waiter_Init(&w[1], 1);
+    for (int i = 0; i < 2; i++)
+        MAZ(pthread_create(&thr[i], NULL, parker, &w[i]));
+    while (__atomic_load_n(&spmcq_datawaiter, __ATOMIC_ACQUIRE) < 2)
+        sched_yield();
+    MASSERT(SPMCQ_Wake(1) == 1);
+    MAZ(pthread_join(thr[0], NULL));
+    MASSERT(__atomic_load_n(&w[1].parked, __ATOMIC_ACQUIRE) == 1);
+    MASSERT(spmcq_remotewaiter == 1);
+    MASSERT(SPMCQ_Wake(2) == 1);
+    MAZ(pthread_join(thr[1], NULL));
+    MAZ(spmcq_datawaiter);
+    MAZ(spmcq_remotewaiter);
+
+    return NULL;
+}
+
 static const char
 *test_spmcq_twocon(void)
 {
@@ -222,8 +380,8 @@ static const char
     MAZ(pthread_mutex_lock(&spmcq_datawaiter_lock));
     SPMCQ_Drain();
     run = 0;
-    MAZ(pthread_cond_broadcast(&spmcq_datawaiter_cond));
     MAZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+    SPMCQ_WakeAll();
     
     err = pthread_join(con1, (void **) &con1_data);
     sprintf(errmsg, "Failed to join consumer 1: %s", strerror(err));
@@ -303,8 +461,8 @@ static const char
     MAZ(pthread_mutex_lock(&spmcq_datawaiter_lock));
     SPMCQ_Drain();
     run = 0;
-    MAZ(pthread_cond_broadcast(&spmcq_datawaiter_cond));
     MAZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+    SPMCQ_WakeAll();
 
     for (int i = 0; i < NCON; i++) {
         err = pthread_join(con[i], (void **) &con_data[i]);
@@ -344,11 +502,166 @@ static const char
     return NULL;
 }
 
+static char
+*test_spmcq_ring_init(void)
+{
+    int err;
+
+    printf("... testing SPMCQ initialization with the lock-free ring\n");
+
+    config.queue_ring = 1;
+    err = SPMCQ_Init();
+    sprintf(errmsg, "SPMCQ_Init: %s", strerror(err));
+    mu_assert(errmsg, err == 0);
+
+    return NULL;
+}
+
+static char
+*test_spmcq_affinity_init(void)
+{
+    int err;
+
+    printf("... testing SPMCQ initialization with one ring per worker\n");
+
+    config.queue_ring = 0;
+    config.queue_affinity = 1;
+    config.nworkers = NRINGS;
+    err = SPMCQ_Init();
+    sprintf(errmsg, "SPMCQ_Init: %s", strerror(err));
+    mu_assert(errmsg, err == 0);
+
+    return NULL;
+}
+
+/* enqueue entries[first..first+n) with hex keys k, k+step, ... */
+static void
+enq_keyed(int first, int n, int k, int step)
+{
+    struct rechead_s list = VSTAILQ_HEAD_INITIALIZER(list);
+
+    for (int i = first; i < first + n; i++, k += step) {
+        entries[i].keylen = sprintf(keys[i], "%x", k);
+        entries[i].key = keys[i];
+        VSTAILQ_INSERT_TAIL(&list, &entries[i], spmcq);
+    }
+    SPMCQ_EnqBatch(&list, n);
+}
+
+static const char
+*test_spmcq_affinity(void)
+{
+    struct spmcq_waiter w[NRINGS];
+    dataentry *batch[BATCH];
+    pthread_t thr;
+
+    printf("... testing SPMCQ routing by key and work stealing\n");
+
+    config.worker_batch = BATCH;
+    for (int q = 0; q < NRINGS; q++) {
+        SPMCQ_Waiter_Init(&w[q], 0);
+        SPMCQ_Own(q, &w[q]);
+        MASSERT(w[q].queue == q);
+    }
+
+    /* hex keys are routed by their value, in order within a ring */
+    enq_keyed(0, 2 * NRINGS, 0, 1);
+    for (int q = 0; q < NRINGS; q++) {
+        MASSERT(SPMCQ_DeqBatchOwn(q, batch, BATCH) == 2);
+        MASSERT(batch[0] == &entries[q]);
+        MASSERT(batch[1] == &entries[q + NRINGS]);
+    }
+    MAZ(SPMCQ_DeqBatch(batch, BATCH));
+
+    /*
+     * longer keys are routed by their first 8 hex digits, to the ring
+     * for the partition that the Kafka plugin chooses
+     */
+    for (int i = 0; i < 2; i++) {
+        static char longkeys[][sizeof("ffffffff-ffffffff")] =
+            { "5ff1b68d0123abcd", "7c735b38-not-hex" };
+        char keystr[sizeof("ffffffff")];
+        unsigned partition, q;
+
+        strncpy(keystr, longkeys[i], 8);
+        keystr[8] = '\0';
+        partition = strtoul(keystr, NULL, 16) % (2 * NRINGS);
+        q = partition % NRINGS;
+        entries[0].key = longkeys[i];
+        entries[0].keylen = strlen(longkeys[i]);
+        SPMCQ_Enq(&entries[0]);
+        MASSERT(SPMCQ_DeqBatchOwn(q, batch, BATCH) == 1);
+        MASSERT(batch[0] == &entries[0]);
+    }
+
+    /* other keys are hashed, and keyless records take turns */
+    entries[0].key = keys[0];
+    entries[0].keylen = sprintf(keys[0], "foo");
+    SPMCQ_Enq(&entries[0]);
+    MASSERT(SPMCQ_Deq() == &entries[0]);
+    for (int i = 0; i < NRINGS; i++) {
+        entries[i].keylen = 0;
+        SPMCQ_Enq(&entries[i]);
+    }
+    for (int q = 0; q < NRINGS; q++)
+        MASSERT(SPMCQ_DeqBatchOwn(q, batch, BATCH) == 1);
+
+    /* a worker with an empty ring steals from the head of the longest */
+    enq_keyed(0, BATCH, 1, NRINGS);
+    enq_keyed(BATCH, BATCH - 1, 2, NRINGS);
+    MASSERT(SPMCQ_DeqBatchOwn(0, batch, BATCH) == BATCH);
+    for (int i = 0; i < BATCH; i++)
+        MASSERT(batch[i] == &entries[i]);
+    /* ... but not fewer than worker.batch records */
+    MAZ(SPMCQ_DeqBatchOwn(0, batch, BATCH));
+    MASSERT(SPMCQ_DeqBatchOwn(2, batch, BATCH) == BATCH - 1);
+
+    /* records in the ring of an abandoned worker are taken by others */
+    SPMCQ_Own(3, NULL);
+    enq_keyed(0, 1, 3, 1);
+    MASSERT(SPMCQ_DeqBatchOwn(0, batch, BATCH) == 1);
+    MASSERT(batch[0] == &entries[0]);
+
+    /* the owner of a ring is woken when records are routed to it */
+    SPMCQ_Own(3, &w[3]);
+    MAZ(pthread_create(&thr, NULL, parker, &w[3]));
+    while (__atomic_load_n(&w[3].parked, __ATOMIC_ACQUIRE) == 0)
+        sched_yield();
+    enq_keyed(0, 1, 3, 1);
+    MAZ(pthread_join(thr, NULL));
+    MAZ(spmcq_datawaiter);
+    MASSERT(SPMCQ_DeqBatchOwn(3, batch, BATCH) == 1);
+
+    for (int q = 0; q < NRINGS; q++)
+        SPMCQ_Own(q, NULL);
+    MAZ(SPMCQ_DeqBatch(batch, BATCH));
+
+    return NULL;
+}
+
 static const char
 *all_tests(void)
 {
     mu_run_test(test_spmcq_init);
     mu_run_test(test_spmcq_enq_deq);
+    mu_run_test(test_spmcq_fifo);
+    mu_run_test(test_spmcq_deqbatch);
+    mu_run_test(test_spmcq_enqbatch);
+    mu_run_test(test_spmcq_park);
+    mu_run_test(test_spmcq_twocon);
+    mu_run_test(test_spmcq_manycon);
+
+    mu_run_test(test_spmcq_ring_init);
+    mu_run_test(test_spmcq_enq_deq);
+    mu_run_test(test_spmcq_fifo);
+    mu_run_test(test_spmcq_deqbatch);
+    mu_run_test(test_spmcq_enqbatch);
+    mu_run_test(test_spmcq_park);
+    mu_run_test(test_spmcq_twocon);
+    mu_run_test(test_spmcq_manycon);
+
+    mu_run_test(test_spmcq_affinity_init);
+    mu_run_test(test_spmcq_affinity);
     mu_run_test(test_spmcq_twocon);
     mu_run_test(test_spmcq_manycon);
     return NULL;
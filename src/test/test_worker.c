@@ -56,6 +56,8 @@
 
 int tests_run = 0;
 static void *mqh;
+static struct rechead_s freerec = VSTAILQ_HEAD_INITIALIZER(freerec);
+static chunkhead_t freechunk[MAX_CHUNK_CLASSES];
 
 /* Called from worker.c, but we don't want to pull in all of monitor.c's
    dependecies. */
@@ -67,6 +69,11 @@ MON_StatsUpdate(stats_update_t update, unsigned nchunks, unsigned nbytes)
     (void) nbytes;
 }
 
+void
+MON_StatsRegister(void)
+{
+}
+
 /* Called from worker.c, but we don't want to pull in all of child.c's
    dependecies. */
 int
@@ -93,8 +100,10 @@ init(void)
         fprintf(stderr, "error loading mq method %s: %s", #intfm, err); \
         exit(EXIT_FAILURE);                                             \
     }
+#define OPTMETHOD(instm, intfm) METHOD(instm, intfm)
 #include "../methods.h"
 #undef METHOD
+#undef OPTMETHOD
 }
 
 static void
@@ -154,17 +163,27 @@ static const char
     VMASSERT(wrk_running == NWORKERS,
              "%d of %d worker threads running", wrk_running, NWORKERS);
 
+    /* take the records and chunks from the freelists, as the reader does */
+    for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+        VSTAILQ_INIT(&freechunk[c]);
+    MASSERT(DATA_Take_Freerec(&freerec) == config.max_records);
+    MAN(DATA_Take_Freechunk(freechunk));
+
     for (int i = 0; i < config.max_records; i++) {
         entry = &entrytbl[i];
         MCHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
         chunk = &chunktbl[i];
         MCHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
 
-        chunk->data = (char *) malloc(sizeof("foo=bar&baz=quux&record=9999"));
-        sprintf(chunk->data, "foo=bar&baz=quux&record=%d", i+1);
-        chunk->occupied = 1;
+        /* as submitted by the reader, see DATA_Format() */
+        struct datahdr hdr = { i + 1, 1430176881, 682097 };
+        chunk->data = (char *) calloc(1, config.chunk_size);
+        entry->end = DATA_Xidlen(hdr.xid);
+        entry->end += sprintf(chunk->data + entry->end,
+                              "&foo=bar&baz=quux&record=%d", i+1);
+        entry->end += DATA_TRL_LEN;
         VSTAILQ_INSERT_TAIL(&entry->chunks, chunk, chunklist);
-        entry->end = strlen(chunk->data);
+        DATA_Header(entry, &hdr);
         entry->occupied = 1;
         SPMCQ_Enq(entry);
     }
@@ -185,7 +204,6 @@ static const char
         MASSERT(!OCCUPIED(entry));
         MAZ(entry->end);
         MAZ(entry->keylen);
-        MAZ(*entry->key);
         MAZ(entry->curchunk);
         MAZ(entry->curchunkidx);
         MASSERT(VSTAILQ_EMPTY(&entry->chunks));
@@ -63,13 +63,21 @@
 #include "vpf.h"
 #include "vtim.h"
 
-static volatile sig_atomic_t term = 0, reload = 0;
+static volatile sig_atomic_t term = 0, reload = 0, stats = 0;
 
-static struct sigaction terminate_action, restart_action;
+static struct sigaction terminate_action, restart_action, stats_action;
 
 static const char *version = PACKAGE_STRING " revision " VCS_Version
     " branch " VCS_Branch;
 
+/*
+ * One child process per shard, see CHILD_Main(). A pid of 0 means that
+ * no child is running for the shard.
+ */
+static pid_t child_pid[MAX_SHARDS];
+static unsigned restarts[MAX_SHARDS];
+static unsigned nshards = 1;
+
 /*--------------------------------------------------------------------*/
 
 static void
@@ -88,19 +96,27 @@ term_s(int sig)
     term = 1;
 }
 
+static void
+stats_s(int sig)
+{
+    (void) sig;
+    stats = 1;
+}
+
 /*--------------------------------------------------------------------*/
 
 /* Handle for the PID file */
 struct vpf_fh *pfh = NULL;
 
 static void
-parent_shutdown(int status, pid_t child_pid)
+parent_shutdown(int status)
 {
-    if (child_pid && kill(child_pid, SIGTERM) != 0) {
-        LOG_Log(LOG_ERR, "Cannot kill child process %d: %s", child_pid,
-            strerror(errno));
-        status = EXIT_FAILURE;
-    }
+    for (unsigned i = 0; i < nshards; i++)
+        if (child_pid[i] && kill(child_pid[i], SIGTERM) != 0) {
+            LOG_Log(LOG_ERR, "Cannot kill child process %d: %s", child_pid[i],
+                    strerror(errno));
+            status = EXIT_FAILURE;
+        }
 
     /* Remove PID file if necessary */
     if (pfh != NULL)
@@ -111,36 +127,41 @@ parent_shutdown(int status, pid_t child_pid)
     exit(status);
 }
 
-static pid_t
-child_restart(pid_t child_pid, int readconfig)
+static void
+child_restart(unsigned shard, int readconfig)
 {
     int errnum;
+    pid_t pid = child_pid[shard];
     
     if (readconfig) {
-        LOG_Log(LOG_NOTICE, "Sending TERM signal to worker process %d",
-                child_pid);
-        if ((errnum = kill(child_pid, SIGTERM)) != 0) {
+        LOG_Log(LOG_NOTICE, "Sending TERM signal to worker process %d", pid);
+        if ((errnum = kill(pid, SIGTERM)) != 0) {
             LOG_Log(LOG_ALERT, "Signal TERM delivery to process %d failed: %s",
-                    strerror(errnum));
-            parent_shutdown(EXIT_FAILURE, 0);
+                    pid, strerror(errnum));
+            child_pid[shard] = 0;
+            parent_shutdown(EXIT_FAILURE);
         }
     }
-    LOG_Log0(LOG_NOTICE, "Restarting child process");
-    child_pid = fork();
-    if (child_pid == -1) {
+    if (nshards > 1)
+        LOG_Log(LOG_NOTICE, "Restarting child process for shard %u", shard);
+    else
+        LOG_Log0(LOG_NOTICE, "Restarting child process");
+    pid = fork();
+    if (pid == -1) {
         LOG_Log(LOG_ALERT, "Cannot fork: %s", strerror(errno));
-        parent_shutdown(EXIT_FAILURE, child_pid);
+        parent_shutdown(EXIT_FAILURE);
     }
-    else if (child_pid == 0)
-        CHILD_Main(readconfig);
+    else if (pid == 0)
+        CHILD_Main(readconfig, shard);
 
-    return child_pid;
+    child_pid[shard] = pid;
 }   
 
 static void
-parent_main(pid_t child_pid)
+parent_main(void)
 {
-    int restarts = 0, status;
+    int status;
+    unsigned shard;
     pid_t wpid;
 
     LOG_Log0(LOG_NOTICE, "Management process starting");
@@ -153,24 +174,40 @@ parent_main(pid_t child_pid)
     AZ(sigemptyset(&terminate_action.sa_mask));
     terminate_action.sa_flags &= ~SA_RESTART;
 
+    stats_action.sa_handler = stats_s;
+    AZ(sigemptyset(&stats_action.sa_mask));
+    stats_action.sa_flags &= ~SA_RESTART;
+
     /* install signal handlers */
 #define PARENT(SIG,disp) SIGDISP(SIG,disp)
 #define CHILD(SIG,disp) ((void) 0)
 #include "signals.h"
 #undef PARENT
 #undef CHILD
+
+    /* log the stats summed over the shards at the monitor interval */
+    if (nshards > 1 && config.monitor_interval > 0)
+        alarm(config.monitor_interval);
     
     while (!term) {
+        if (stats) {
+            MON_ShardsLog(nshards);
+            stats = 0;
+            alarm(config.monitor_interval);
+        }
         wpid = wait(&status);
         if (wpid == -1) {
             if (errno == EINTR) {
                 if (term)
-                    parent_shutdown(EXIT_SUCCESS, child_pid);
+                    parent_shutdown(EXIT_SUCCESS);
                 else if (reload) {
-                    child_pid = child_restart(child_pid, reload);
+                    for (shard = 0; shard < nshards; shard++)
+                        child_restart(shard, reload);
                     reload = 0;
                     continue;
                 }
+                else if (stats)
+                    continue;
                 else {
                     LOG_Log0(LOG_WARNING,
                         "Interrupted while waiting for worker process, "
@@ -180,7 +217,7 @@ parent_main(pid_t child_pid)
             }
             LOG_Log(LOG_ALERT, "Cannot wait for worker processes: %s",
                     strerror(errno));
-            parent_shutdown(EXIT_FAILURE, child_pid);
+            parent_shutdown(EXIT_FAILURE);
         }
         AZ(WIFSTOPPED(status));
         AZ(WIFCONTINUED(status));
@@ -192,12 +229,16 @@ parent_main(pid_t child_pid)
                     "Worker process %d exited due to signal %d (%s)",
                     wpid, WTERMSIG(status), strsignal(WTERMSIG(status)));
 
-        if (wpid != child_pid)
+        for (shard = 0; shard < nshards; shard++)
+            if (wpid == child_pid[shard])
+                break;
+        if (shard == nshards)
             continue;
+        child_pid[shard] = 0;
         
-        if (config.restarts && restarts > config.restarts) {
-            LOG_Log(LOG_ALERT, "Too many restarts: %d", restarts);
-            parent_shutdown(EXIT_FAILURE, 0);
+        if (config.restarts && restarts[shard] > config.restarts) {
+            LOG_Log(LOG_ALERT, "Too many restarts: %u", restarts[shard]);
+            parent_shutdown(EXIT_FAILURE);
         }
         
         if (config.restart_pause > 0) {
@@ -205,9 +246,11 @@ parent_main(pid_t child_pid)
                     config.restart_pause);
             VTIM_sleep(config.restart_pause);
         }
-        child_pid = child_restart(child_pid, 0);
-        restarts++;
+        child_restart(shard, 0);
+        restarts[shard]++;
     }
+    /* terminated while not waiting */
+    parent_shutdown(EXIT_SUCCESS);
 }
 
 static void
@@ -224,7 +267,6 @@ main(int argc, char * const *argv)
     const char *P_arg = NULL, *l_arg = NULL, *n_arg = NULL, *f_arg = NULL,
         *y_arg = NULL, *c_arg = NULL, *u_arg = NULL, *L_arg = NULL,
         *T_arg = NULL;
-    pid_t child_pid;
 
     CONF_Init();
     if ((err = CONF_ReadDefault()) != 0) {
@@ -365,25 +407,45 @@ main(int argc, char * const *argv)
 
     HNDL_Init(argv[0]);
 
+    nshards = config.shards;
+    if (D_flag && nshards > 1) {
+        LOG_Log(LOG_WARNING, "Ignoring shards = %u when running as single "
+                "process", nshards);
+        nshards = config.shards = 1;
+    }
+    if (nshards > 1 && (err = MON_ShardsInit(nshards)) != 0) {
+        LOG_Log(LOG_ERR, "Cannot share stats for %u shards (%s), running "
+                "one worker process", nshards, strerror(err));
+        nshards = config.shards = 1;
+    }
+
     if (!D_flag) {
-        child_pid = fork();
-        switch(child_pid) {
-        case -1:
-            LOG_Log(LOG_ERR,
-                "Cannot fork (%s), running as single process",
-                strerror(errno));
-            CHILD_Main(0);
-            break;
-        case 0:
-            CHILD_Main(0);
-            break;
-        default:
-            parent_main(child_pid);
-            break;
+        for (unsigned shard = 0; shard < nshards; shard++) {
+            child_pid[shard] = fork();
+            switch(child_pid[shard]) {
+            case -1:
+                if (shard > 0) {
+                    LOG_Log(LOG_ALERT, "Cannot fork: %s", strerror(errno));
+                    child_pid[shard] = 0;
+                    parent_shutdown(EXIT_FAILURE);
+                }
+                LOG_Log(LOG_ERR,
+                    "Cannot fork (%s), running as single process",
+                    strerror(errno));
+                config.shards = 1;
+                CHILD_Main(0, 0);
+                break;
+            case 0:
+                CHILD_Main(0, shard);
+                break;
+            default:
+                break;
+            }
         }
+        parent_main();
     }
     else {
         LOG_Log0(LOG_NOTICE, "Running as single process");
-        CHILD_Main(0);
+        CHILD_Main(0, 0);
     }
 }
@@ -42,12 +42,35 @@
 #include "vapi/vsl.h"
 #include "vqueue.h"
 
+/* to pad and align data shared between threads */
+#define CACHELINE_SIZE 64
+
+/* hint to the CPU in busy-wait loops */
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX() do {} while (0)
+#endif
+
 /* message queue methods, typedefs match the interface in mq.h */
 typedef const char *global_init_f(unsigned nworkers, const char *config_fname);
 typedef const char *init_connections_f(void);
 typedef const char *worker_init_f(void **priv, int wrk_num);
 typedef int send_f(void *priv, const char *data, unsigned len,
                     const char *key, unsigned keylen, const char **error);
+struct mq_msg;
+typedef int send_batch_f(void *priv, const struct mq_msg *msgs, unsigned n,
+                         int *status, const char **error);
+struct iovec;
+typedef int sendv_f(void *priv, const struct iovec *iov, int iovcnt,
+                    const char *key, unsigned keylen, const char **error);
+typedef void release_f(void *ref, int status);
+typedef int send_ref_f(void *priv, const char *data, unsigned len,
+                       const char *key, unsigned keylen,
+                       release_f *release, void *ref, const char **error);
+typedef const char *poll_f(void *priv, unsigned timeout);
 typedef const char *version_f(void *priv, char *version, size_t len);
 typedef const char *client_id_f(void *priv, char *clientID, size_t len);
 typedef const char *reconnect_f(void **priv);
@@ -64,6 +87,10 @@ struct mqf {
     reconnect_f		*reconnect;
     worker_shutdown_f	*worker_shutdown;
     global_shutdown_f	*global_shutdown;
+    send_batch_f	*send_batch;	/* optional */
+    sendv_f		*sendv;		/* optional */
+    send_ref_f		*send_ref;	/* optional */
+    poll_f		*poll;		/* optional */
 };
 
 extern struct mqf mqf;
@@ -91,6 +118,38 @@ void HNDL_Abort(int sig);
 
 void PRIV_Sandbox(void);
 
+/* numa.c */
+
+#define MAX_NUMA_NODES 8
+
+/* number of nodes in use, 1 unless numa is set on a multi-node system */
+extern unsigned numa_nodes;
+/* node to which the calling thread is bound */
+extern __thread unsigned numa_self;
+/* node of the reader thread, on which records are preferably written */
+extern unsigned numa_home;
+
+int NUMA_Init(void);
+unsigned NUMA_Node(void);
+int NUMA_Bind_Thread(unsigned node);
+void NUMA_Bind_Mem(void *p, size_t len, unsigned node);
+void NUMA_Log(void);
+#ifdef CPU_SETSIZE
+int NUMA_Cpulist(const char *list, cpu_set_t *set);
+#endif
+
+/* affinity.c */
+
+typedef enum {
+    AFF_WORKER,
+    AFF_MONITOR,
+} aff_thread_t;
+
+int AFF_Init(void);
+int AFF_Reader(void);
+void AFF_Attr(pthread_attr_t *attr, aff_thread_t thread);
+int AFF_Thread(void);
+
 /* worker.c */
 
 /* stats */
@@ -115,61 +174,194 @@ void WRK_Shutdown(void);
 
 #define OCCUPIED(e) ((e)->occupied == 1)
 
-extern unsigned global_nfree_rec, global_nfree_chunk;
+extern unsigned global_nfree_rec, global_nfree_chunk, global_ring_used;
+/* current size of the segmented tables */
+extern unsigned global_nsegments, global_nrec, global_nchunk;
 
+/*
+ * The data tables grow in segments of max.records records, up to
+ * max.records.limit rounded up to a whole segment.
+ */
+#define DATA_SEGMENTS                                                   \
+    (config.max_records_limit > config.max_records                      \
+     ? (config.max_records_limit + config.max_records - 1)              \
+       / config.max_records : 1)
+#define MAX_RECORDS (DATA_SEGMENTS * config.max_records)
+
+/*
+ * A chunk is either on a freelist or in the chunk list of a record, so
+ * the two list links share storage. Whether it is in use follows from
+ * the list it is on, so a chunk has no occupied flag.
+ */
 typedef struct chunk_t {
     unsigned magic;
 #define CHUNK_MAGIC 0x224a86ed
+    unsigned char node;		/* NUMA pool */
+    unsigned char class;	/* size class */
     char *data;
-    VSTAILQ_ENTRY(chunk_t) freelist;
-    VSTAILQ_ENTRY(chunk_t) chunklist;
-    unsigned char occupied;
+    union {
+        VSTAILQ_ENTRY(chunk_t) freelist;
+        VSTAILQ_ENTRY(chunk_t) chunklist;
+    };
 } chunk_t;
 
 typedef VSTAILQ_HEAD(chunkhead_s, chunk_t) chunkhead_t;
 
+/*
+ * Chunk size classes: the n-th chunk of a record (counting from 0) is
+ * taken from class CHUNK_CLASS(n), or from a smaller class if that class
+ * is exhausted, and chunks in class c are chunk.size << c bytes long.
+ * CHUNK_SIZE(n) is the size of the n-th chunk when no class is
+ * exhausted, CHUNK_LEN(c) the size of chunk c. A record may take up to
+ * CHUNK_MAX chunks, when all of them are from class 0.
+ */
+#define CHUNK_NCLASSES (config.chunk_classes > 1 ? config.chunk_classes : 1)
+#define CHUNK_CLASS(n) ((n) < CHUNK_NCLASSES ? (n) : CHUNK_NCLASSES - 1)
+#define CHUNK_SIZE(n) (config.chunk_size << CHUNK_CLASS(n))
+#define CHUNK_LEN(c) (config.chunk_size << (c)->class)
+#define CHUNK_MAX \
+    ((config.max_reclen + config.chunk_size - 1) / config.chunk_size)
+
+/*
+ * Data entries are laid out to fill exactly one cache line, with the
+ * fields used by the reader while appending and by workers while sending
+ * at the front. The record is either on a freelist or in the queue, and
+ * has either chunks or contiguous data in the ring, so the respective
+ * fields share storage.
+ */
 struct dataentry_s {
     unsigned 			magic;
 #define DATA_MAGIC 0xb41cb1e1
-    chunkhead_t			chunks;
-    VSTAILQ_ENTRY(dataentry_s)	freelist;
-    VSTAILQ_ENTRY(dataentry_s)	spmcq;
-    char			*key;
-    chunk_t			*curchunk;
-    unsigned			curchunkidx;
-    unsigned			keylen;
     unsigned			end;	/* End of string index in data */
+    union {
+        unsigned		curchunkidx;	/* reader, while appending */
+        unsigned		formatted;	/* once submitted, see below */
+    };
+    unsigned			keylen;
+    unsigned			ringslot;
+    unsigned short		nchunks;
+#define MAX_CHUNKS_PER_REC USHRT_MAX
     unsigned char		occupied;
-};
+    unsigned char		node;	/* NUMA pool */
+    chunkhead_t			chunks;
+    union {
+        chunk_t			*curchunk;
+        char			*data;	/* contiguous data with ring.size */
+    };
+    union {
+        VSTAILQ_ENTRY(dataentry_s)	freelist;
+        VSTAILQ_ENTRY(dataentry_s)	spmcq;
+        void				*sender; /* while sent by reference */
+    };
+    char			*key;
+} __attribute__((aligned(CACHELINE_SIZE)));
 typedef struct dataentry_s dataentry;
 
+/*
+ * The reader leaves the formatting of a record to the worker that sends
+ * it. A record begins with DATA_Xidlen(vxid) bytes for "XID=<vxid>", and
+ * DATA_TRL_LEN bytes are reserved after the data for
+ * "&req_endt=<sec>.<usec>", so that a record takes no more space than
+ * its wire format. Until the worker renders both with DATA_Format(), the
+ * reserved space at the end holds a struct datahdr.
+ */
+#define REQEND_T_VAR "req_endt"
+#define DATA_HDR_LEN (sizeof("XID=18446744073709551615") - 1)
+#define DATA_TRL_LEN (sizeof("&" REQEND_T_VAR "=4294967295.999999") - 1)
+#define DATA_LEN(e) ((e)->end)
+#define DATA_FORMATTED(e) ((e)->formatted)
+
+struct datahdr {
+    uint64_t	xid;
+    uint32_t	sec;
+    uint32_t	usec;
+};
+
 VSTAILQ_HEAD(rechead_s, dataentry_s);
 
 int DATA_Init(void);
+unsigned DATA_Chunks(unsigned len, unsigned *perclass);
+/* chunk freelists are passed as arrays with one head per size class */
 unsigned DATA_Reset(dataentry *entry, chunkhead_t * const freechunk);
 unsigned DATA_Take_Freerec(struct rechead_s *dst);
 void DATA_Return_Freerec(struct rechead_s *returned, unsigned nreturned);
 unsigned DATA_Take_Freechunk(struct chunkhead_s *dst);
 void DATA_Return_Freechunk(struct chunkhead_s *returned, unsigned nreturned);
+char *DATA_Ring_Reserve(void);
+void DATA_Ring_Commit(dataentry *entry);
+unsigned DATA_Xidlen(uint64_t xid);
+void DATA_Header(dataentry *entry, const struct datahdr *hdr);
+void DATA_Format(dataentry *entry);
+int DATA_Grow(void);
+void DATA_Shrink(void);
+int DATA_Draining(void);
+void DATA_Drain(struct rechead_s *freerec, unsigned *nfree_rec,
+                chunkhead_t *freechunk, unsigned *nfree_chunk);
 void DATA_Dump(void);
+void DATA_Log(void);
 
 /* spmcq.c */
 
 int SPMCQ_Init(void);
 void SPMCQ_Enq(dataentry *ptr);
+void SPMCQ_EnqBatch(struct rechead_s *list, unsigned n);
 dataentry *SPMCQ_Deq(void);
+/**
+ * Dequeues up to max records in one operation.
+ *
+ * @returns the number of records written to out, 0 if the queue is empty
+ */
+unsigned SPMCQ_DeqBatch(dataentry **out, unsigned max);
+unsigned SPMCQ_DeqBatchOwn(unsigned q, dataentry **out, unsigned max);
 void SPMCQ_Drain(void);
 unsigned SPMCQ_NeedWorker(int running);
+unsigned SPMCQ_NeedWorkers(int running, unsigned n);
+void SPMCQ_Served(unsigned n, double t);
+void SPMCQ_Log(void);
+
+/* A consumer waiting for data when the spmc queue is empty */
+struct spmcq_waiter {
+    uint32_t		parked;		/* futex word */
+    unsigned		remote;		/* not on the reader's NUMA node */
+    unsigned		queue;		/* own ring with queue.affinity */
+    struct spmcq_waiter	*next;
+#ifndef __linux__
+    pthread_cond_t	cond;
+#endif
+};
+
+void SPMCQ_Waiter_Init(struct spmcq_waiter *w, unsigned remote);
+void SPMCQ_Own(unsigned q, struct spmcq_waiter *w);
+/* Call with spmcq_datawaiter_lock held, which is released */
+void SPMCQ_Park(struct spmcq_waiter *w);
+/* Producer wakes up parked consumers after enqueue */
+unsigned SPMCQ_Wake(unsigned n);
+void SPMCQ_WakeAll(void);
 
-/* Consumers wait for this condition when the spmc queue is empty.
-   Producer signals this condition after enqueue. */
-extern pthread_cond_t  spmcq_datawaiter_cond;
 extern pthread_mutex_t spmcq_datawaiter_lock;
 extern int	       spmcq_datawaiter;
+/* Workers on other NUMA nodes than the reader are only woken up if no
+   worker on the reader's node is waiting. spmcq_datawaiter includes the
+   remote waiters. */
+extern int	       spmcq_remotewaiter;
+
+/* copy.c */
+
+/*
+ * Copies up to len bytes from src to dst, stopping before the first null
+ * byte, and returns the number of bytes copied.
+ */
+typedef size_t copy_nul_f(char *dst, const char *src, size_t len);
+
+extern copy_nul_f *COPY_Nul;
+
+void COPY_Init(void);
+const char *COPY_Name(void);
+copy_nul_f *COPY_Impl(unsigned i, const char **name);
 
 /* child.c */
 void RDR_Stats(void);
-void CHILD_Main(int readconfig);
+void CHILD_Main(int readconfig, unsigned shard);
 int RDR_Exhausted(void);
 
 /* config.c */
@@ -200,6 +392,8 @@ struct config {
 
     unsigned	max_records;	/* max number of buffered records */
 #define DEF_MAX_RECORDS 1024
+    unsigned	max_records_limit;	/* ceiling for growth, if > max_records */
+#define MAX_DATA_SEGMENTS 16
     
     unsigned	max_reclen;  	/* size of char data buffer */
 #define DEF_MAX_RECLEN 1024
@@ -219,14 +413,45 @@ struct config {
     unsigned	qlen_goal;
 #define DEF_QLEN_GOAL 512
 
+    /* use the lock-free ring buffer for the queue */
+    unsigned	queue_ring;
+    /* one ring per worker, records routed by shard key */
+    unsigned	queue_affinity;
+
+    /* send records in place with MQ_SendRef(), if the plugin has it */
+    unsigned	mq_zerocopy;
+
     unsigned	nworkers;
     size_t	worker_stack;
+    unsigned	worker_batch;	/* max records dequeued at once */
+#define DEF_WORKER_BATCH 16
+    unsigned	parse_threads;	/* 0: records are parsed by the reader */
+#define MAX_PARSE_THREADS 32
+    unsigned	shards;		/* child processes reading the log */
+#define MAX_SHARDS 64
     unsigned	restarts;
     unsigned	restart_pause;
     unsigned	thread_restarts;
     unsigned	chunk_size;
 #define DEF_CHUNK_SIZE 256
 #define MIN_CHUNK_SIZE 64
+    unsigned	chunk_classes;
+#define MAX_CHUNK_CLASSES 4
+    unsigned	chunk_classes_percent;	/* records with larger classes */
+#define DEF_CHUNK_CLASSES_PERCENT 25
+    unsigned	ring_size;	/* record storage in a byte ring, if > 0 */
+    unsigned	data_hugepages;
+    unsigned	data_prefault;
+    unsigned	data_mlock;
+    unsigned	numa;		/* NUMA-aware pools and placement */
+
+    /* CPU lists as in cpuset(7), empty for no restriction */
+#define CPULIST_MAX 256
+    char	reader_cpus[CPULIST_MAX];
+    char	worker_cpus[CPULIST_MAX];
+    char	monitor_cpus[CPULIST_MAX];
+    unsigned	reader_priority;	/* SCHED_FIFO priority, 0 for none */
+    int		reader_nice;
 
     unsigned	tx_limit;
 };
@@ -280,14 +505,51 @@ typedef enum {
     STATS_OCCUPANCY,
     /* Worker thread restarted */
     STATS_RESTART,
+    /* Worker took a record from a NUMA pool on another node */
+    STATS_XNODE,
 } stats_update_t;
 
 void *MON_StatusThread(void *arg);
 void MON_Output(void);
 void MON_StatusShutdown(pthread_t monitor);
 void MON_StatsInit(void);
+void MON_StatsRegister(void);
 void MON_StatsUpdate(stats_update_t update, unsigned nchunks, unsigned nbytes);
 
+/*
+ * With more than one shard, each child process publishes a summary of its
+ * stats at every monitor interval in its slot of shard_stats, which is
+ * shared with the management process, and which the management process
+ * sums up in MON_ShardsLog().
+ */
+struct shard_stats {
+    unsigned long	seen;
+    unsigned long	submitted;
+    unsigned long	skipped;	/* transactions of other shards */
+    unsigned long	no_data;
+    unsigned long	no_free_rec;
+    unsigned long	overrun;
+    unsigned long	sent;
+    unsigned long	failed;
+    unsigned long	bytes;
+    unsigned long	reconnects;
+    unsigned long	restarts;
+    unsigned		occ_rec;
+    unsigned		lag_seg;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+extern struct shard_stats *shard_stats;	/* NULL with one shard */
+extern unsigned shard_self;
+
+#define SHARD_SET(fld, v) do {                                          \
+        if (shard_stats != NULL)                                        \
+            __atomic_store_n(&shard_stats[shard_self].fld, (v),         \
+                             __ATOMIC_RELAXED);                         \
+    } while (0)
+
+int MON_ShardsInit(unsigned n);
+void MON_ShardsLog(unsigned n);
+
 /* parse.c */
 
 /* Whether a VCL_Log entry contains a data payload or a shard key */
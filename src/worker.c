@@ -30,21 +30,54 @@
  *
  */
 
+#include "config.h"
+
 #include <pthread.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include "trackrdrd.h"
 #include "vdef.h"
 #include "vas.h"
 #include "miniobj.h"
 #include "vsb.h"
+#include "vtim.h"
+#include "mq.h"
 
 #define VERSION_LEN 80
 #define CLIENT_ID_LEN 80
 
+/*
+ * Target interval in seconds between returns of a worker's freelists,
+ * and the weight of the latest sample in the moving average of the
+ * worker's rate of freed records.
+ */
+#define RETURN_INTERVAL 0.01
+#define RETURN_RATE_WEIGHT 0.25
+
+/*
+ * How long (in ms) MQ_Poll() may wait for releases, in place of parking,
+ * while records sent by reference are outstanding.
+ */
+#define POLL_TIMEOUT 10
+
+/*
+ * The reader stops copying a payload at a null byte (see COPY_Nul()), so
+ * records never contain them. Builds configured with --enable-data-checks
+ * assert this before sending.
+ */
+#ifdef DATA_CHECKS
+#define WRK_CHECK_DATA(data, len) AZ(memchr((data), '\0', (len)))
+#else
+#define WRK_CHECK_DATA(data, len) ((void) 0)
+#endif
+
+/* sends and bytes may also be counted on release by the MQ plugin */
+#define WRK_ADD(c, n) ((void) __atomic_add_fetch(&(c), (n), __ATOMIC_RELAXED))
+
 static int running = 0, exited = 0;
 
 typedef enum {
@@ -72,16 +105,43 @@ struct worker_data_s {
     unsigned magic;
 #define WORKER_DATA_MAGIC 0xd8eef137
     unsigned id;
+    unsigned node;    /* NUMA node */
     unsigned status;  /* exit status */
     wrk_state_e state;
-    struct vsb *sb;
+
+    /* records taken from the queue, deq[nextdeq] is sent next */
+    dataentry		**deq;
+    unsigned		ndeq;
+    unsigned		nextdeq;
+
+    /* one record buffer per batch slot, and arguments for MQ_SendBatch */
+    struct vsb		*sb;
+    char		*recbuf;
+    struct mq_msg	*msgs;
+    int			*mqstatus;
+
+    /* scatter/gather list for MQ_SendV(), one entry per chunk */
+    struct iovec	*iov;
+    unsigned		niov;
 
     /* per-worker freelists */
     struct rechead_s	freerec;
     unsigned		nfree_rec;
-    chunkhead_t		freechunk;
+    chunkhead_t		freechunk[MAX_CHUNK_CLASSES];
     unsigned		nfree_chunk;
 
+    /* parked here while the queue is empty */
+    struct spmcq_waiter	waiter;
+
+    /* records sent by MQ_SendRef() and not yet released */
+    unsigned		refs;
+
+    /* adaptive thresholds for returning the freelists */
+    unsigned		rec_thresh;
+    unsigned		chunk_thresh;
+    double		return_rate;
+    double		return_t;
+
     /* stats */
     unsigned long deqs;
     unsigned long waits;
@@ -91,6 +151,7 @@ struct worker_data_s {
     unsigned long recoverables;
     unsigned long reconnects;
     unsigned long restarts;
+    unsigned long xnode;	/* records from pools on other nodes */
 };
 
 typedef struct worker_data_s worker_data_t;
@@ -104,7 +165,7 @@ unsigned abandoned;
 
 struct mqf mqf;
 
-static unsigned run, cleaned = 0, rec_thresh, chunk_thresh;
+static unsigned run, cleaned = 0, rec_thresh, chunk_thresh, zerocopy;
 static thread_data_t *thread_data;
 
 static pthread_mutex_t running_lock;
@@ -131,39 +192,123 @@ wrk_log_connection(void *mq_worker, unsigned id)
             clientID);
 }
 
+/* Render the wire format of a record on first access, see DATA_Format() */
+static inline void
+wrk_format(dataentry *entry)
+{
+    if (entry->end != 0 && !DATA_FORMATTED(entry))
+        DATA_Format(entry);
+}
+
 static char *
-wrk_get_data(dataentry *entry, worker_data_t *wrk) {
+wrk_get_data(dataentry *entry, struct vsb *sb) {
     CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
     assert(OCCUPIED(entry));
 
     if (entry->end == 0)
         return empty;
+    wrk_format(entry);
+    if (config.ring_size > 0)
+        return entry->data;
 
     chunk_t *chunk = VSTAILQ_FIRST(&entry->chunks);
     CHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
-    assert(OCCUPIED(chunk));
     if (entry->end <= config.chunk_size)
         return chunk->data;
 
-    VSB_clear(wrk->sb);
+    VSB_clear(sb);
     int n = entry->end;
     while (n > 0) {
         CHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
         int cp = n;
-        if (cp > config.chunk_size)
-            cp = config.chunk_size;
-        VSB_bcat(wrk->sb, chunk->data, cp);
+        if (cp > CHUNK_LEN(chunk))
+            cp = CHUNK_LEN(chunk);
+        VSB_bcat(sb, chunk->data, cp);
         n -= cp;
         chunk = VSTAILQ_NEXT(chunk, chunklist);
     }
-    assert(VSB_len(wrk->sb) == entry->end);
-    VSB_finish(wrk->sb);
-    return VSB_data(wrk->sb);
+    assert(VSB_len(sb) == DATA_LEN(entry));
+    VSB_finish(sb);
+    return VSB_data(sb);
+}
+
+/* Point wrk->iov at the chunks of a record, returns the number of entries */
+static int
+wrk_get_iov(dataentry *entry, worker_data_t *wrk)
+{
+    int iovcnt = 0;
+
+    CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    assert(OCCUPIED(entry));
+
+    wrk_format(entry);
+    chunk_t *chunk = VSTAILQ_FIRST(&entry->chunks);
+    int n = entry->end;
+    while (n > 0) {
+        CHECK_OBJ_NOTNULL(chunk, CHUNK_MAGIC);
+        assert(iovcnt < wrk->niov);
+        int cp = n;
+        if (cp > CHUNK_LEN(chunk))
+            cp = CHUNK_LEN(chunk);
+        wrk->iov[iovcnt].iov_base = chunk->data;
+        wrk->iov[iovcnt].iov_len = cp;
+        iovcnt++;
+        n -= cp;
+        chunk = VSTAILQ_NEXT(chunk, chunklist);
+    }
+    return iovcnt;
+}
+
+/* Records that span more than one chunk are sent with MQ_SendV(), if set */
+static inline int
+wrk_use_sendv(dataentry *entry)
+{
+    return mqf.sendv != NULL && config.ring_size == 0
+        && entry->end > config.chunk_size;
+}
+
+/*
+ * With mq.zerocopy, records in one chunk, or in the ring, are sent with
+ * MQ_SendRef()
+ */
+static inline int
+wrk_use_ref(dataentry *entry)
+{
+    return zerocopy
+        && (config.ring_size > 0 || entry->end <= config.chunk_size);
+}
+
+/*
+ * Adapt a worker's thresholds for returning its freelists to the rate at
+ * which it frees records, so that they are returned about once per
+ * RETURN_INTERVAL, bounded by the fixed thresholds rec_thresh and
+ * chunk_thresh.
+ */
+static inline void
+wrk_adapt_thresh(worker_data_t *wrk)
+{
+    double now = VTIM_mono(), t = now - wrk->return_t;
+    unsigned thresh;
+
+    if (t > 0)
+        wrk->return_rate += RETURN_RATE_WEIGHT
+            * (wrk->nfree_rec / t - wrk->return_rate);
+    wrk->return_t = now;
+
+    if (wrk->return_rate * RETURN_INTERVAL >= rec_thresh)
+        thresh = rec_thresh;
+    else
+        thresh = wrk->return_rate * RETURN_INTERVAL;
+    if (thresh == 0)
+        thresh = 1;
+    wrk->rec_thresh = thresh;
+    wrk->chunk_thresh = thresh * (chunk_thresh / rec_thresh);
 }
 
 static inline void
 wrk_return_freelist(worker_data_t *wrk)
 {
+    wrk_adapt_thresh(wrk);
     if (wrk->nfree_rec > 0) {
         DATA_Return_Freerec(&wrk->freerec, wrk->nfree_rec);
         LOG_Log(LOG_DEBUG, "Worker %d: returned %u records to free list",
@@ -172,99 +317,400 @@ wrk_return_freelist(worker_data_t *wrk)
         assert(VSTAILQ_EMPTY(&wrk->freerec));
     }
     if (wrk->nfree_chunk > 0) {
-        DATA_Return_Freechunk(&wrk->freechunk, wrk->nfree_chunk);
+        DATA_Return_Freechunk(wrk->freechunk, wrk->nfree_chunk);
         LOG_Log(LOG_DEBUG, "Worker %d: returned %u chunks to free list",
                 wrk->id, wrk->nfree_chunk);
         wrk->nfree_chunk = 0;
-        assert(VSTAILQ_EMPTY(&wrk->freechunk));
+        for (int c = 0; c < CHUNK_NCLASSES; c++)
+            assert(VSTAILQ_EMPTY(&wrk->freechunk[c]));
     }
 }
 
-static inline void
-wrk_send(void **mq_worker, dataentry *entry, worker_data_t *wrk)
+/*
+ * Handle a failed send of entry, after a first attempt that returned
+ * errnum with the message err. After a non-recoverable error, reconnect
+ * and send again. *reconnect tracks the state of the connection across a
+ * batch of sends: 0 if no reconnect has been attempted yet, >0 if the
+ * connection was renewed and <0 if the reconnect failed, so that
+ * MQ_Reconnect() is called at most once per batch. err is NULL if the
+ * first failure has already been logged. Returns the result of the last
+ * send attempt.
+ */
+static int
+wrk_send_failed(void **mq_worker, dataentry *entry, const char *data,
+                worker_data_t *wrk, int errnum, const char *err,
+                int *reconnect)
 {
-    char *data;
-    const char *err;
-    int errnum;
-    stats_update_t stat = STATS_FAILED;
-    unsigned bytes = 0;
-    
-    CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
-    assert(OCCUPIED(entry));
-    AN(mq_worker);
+    if (err != NULL)
+        LOG_Log(LOG_WARNING, "Worker %d: Failed to send data: %s", wrk->id,
+                err);
+    if (errnum > 0) {
+        wrk->recoverables++;
+        return errnum;
+    }
 
-    data = wrk_get_data(entry, wrk);
-    AZ(memchr(data, '\0', entry->end));
-    errnum = mqf.send(*mq_worker, data, entry->end,
-                      entry->key, entry->keylen, &err);
+    /* Non-recoverable error */
+    if (*reconnect == 0) {
+        LOG_Log(LOG_INFO, "Worker %d: Reconnecting", wrk->id);
+        err = mqf.reconnect(mq_worker);
+        if (err != NULL) {
+            *reconnect = -1;
+            wrk->status = EXIT_FAILURE;
+            LOG_Log(LOG_ALERT, "Worker %d: Reconnect failed (%s)", wrk->id,
+                    err);
+        }
+        else {
+            *reconnect = 1;
+            wrk->reconnects++;
+            wrk_log_connection(*mq_worker, wrk->id);
+            MON_StatsUpdate(STATS_RECONNECT, 0, 0);
+        }
+    }
+    if (*reconnect < 0) {
+        LOG_Log(LOG_ERR, "Worker %d: Data DISCARDED [%.*s]", wrk->id,
+                DATA_LEN(entry), data);
+        return errnum;
+    }
+
+    errnum = mqf.send(*mq_worker, data, DATA_LEN(entry), entry->key,
+                      entry->keylen,
+                      &err);
     if (errnum != 0) {
-        LOG_Log(LOG_WARNING, "Worker %d: Failed to send data: %s",
-                wrk->id, err);
+        LOG_Log(LOG_WARNING, "Worker %d: Failed to send data "
+                "after reconnect: %s", wrk->id, err);
         if (errnum > 0)
             wrk->recoverables++;
         else {
-            /* Non-recoverable error */
-            LOG_Log(LOG_INFO, "Worker %d: Reconnecting", wrk->id);
-            err = mqf.reconnect(mq_worker);
-            if (err != NULL) {
-                wrk->status = EXIT_FAILURE;
-                LOG_Log(LOG_ALERT, "Worker %d: Reconnect failed (%s)", wrk->id,
-                        err);
-                LOG_Log(LOG_ERR, "Worker %d: Data DISCARDED [%.*s]", wrk->id,
-                        entry->end, data);
-            }
-            else {
-                wrk->reconnects++;
-                wrk_log_connection(*mq_worker, wrk->id);
-                MON_StatsUpdate(STATS_RECONNECT, 0, 0);
-                errnum = mqf.send(*mq_worker, data, entry->end,
-                                  entry->key, entry->keylen, &err);
-                if (errnum != 0) {
-                    LOG_Log(LOG_WARNING, "Worker %d: Failed to send data "
-                            "after reconnect: %s", wrk->id, err);
-                    if (errnum > 0)
-                        wrk->recoverables++;
-                    else {
-                        /* Fail after reconnect, give up */
-                        wrk->fails++;
-                        wrk->status = EXIT_FAILURE;
-                        LOG_Log(LOG_ERR, "Worker %d: Data DISCARDED [%.*s]",
-                                wrk->id, entry->end, data);
-                    }
-                }
-            }
+            /* Fail after reconnect, give up */
+            wrk->fails++;
+            wrk->status = EXIT_FAILURE;
+            LOG_Log(LOG_ERR, "Worker %d: Data DISCARDED [%.*s]",
+                    wrk->id, DATA_LEN(entry), data);
         }
     }
+    return errnum;
+}
+
+/* Update stats for a record after sending, and free its storage */
+static inline void
+wrk_release(dataentry *entry, const char *data, worker_data_t *wrk,
+            int errnum)
+{
+    stats_update_t stat = STATS_FAILED;
+    unsigned bytes = 0;
+
     if (errnum == 0) {
-        wrk->sends++;
-        wrk->bytes += entry->end;
+        WRK_ADD(wrk->sends, 1);
+        WRK_ADD(wrk->bytes, DATA_LEN(entry));
         stat = STATS_SENT;
-        bytes = entry->end;
+        bytes = DATA_LEN(entry);
         LOG_Log(LOG_DEBUG, "Worker %d: Successfully sent data [%.*s]", wrk->id,
-                entry->end, data);
+                DATA_LEN(entry), data);
     }
-    unsigned chunks = DATA_Reset(entry, &wrk->freechunk);
+    unsigned chunks = DATA_Reset(entry, wrk->freechunk);
     MON_StatsUpdate(stat, chunks, bytes);
     VSTAILQ_INSERT_HEAD(&wrk->freerec, entry, freelist);
     wrk->nfree_rec++;
     wrk->nfree_chunk += chunks;
 
-    if (RDR_Exhausted() || wrk->nfree_rec > rec_thresh
-        || wrk->nfree_chunk > chunk_thresh)
+    if (RDR_Exhausted() || wrk->nfree_rec > wrk->rec_thresh
+        || wrk->nfree_chunk > wrk->chunk_thresh)
         wrk_return_freelist(wrk);
 }
 
+/*
+ * Send a record with MQ_SendV() directly from its chunks. The data are
+ * only copied to a contiguous buffer for error handling, which resends
+ * with MQ_Send(), and for the debug log.
+ */
+static void
+wrk_sendv(void **mq_worker, dataentry *entry, worker_data_t *wrk)
+{
+    const char *err, *data = empty;
+    int errnum, iovcnt, reconnect = 0;
+
+    iovcnt = wrk_get_iov(entry, wrk);
+    errnum = mqf.sendv(*mq_worker, wrk->iov, iovcnt, entry->key,
+                       entry->keylen, &err);
+    if (errnum != 0 || logconf.level >= LOG_DEBUG)
+        data = wrk_get_data(entry, &wrk->sb[0]);
+    if (errnum != 0)
+        errnum = wrk_send_failed(mq_worker, entry, data, wrk, errnum, err,
+                                 &reconnect);
+    wrk_release(entry, data, wrk, errnum);
+}
+
+/*
+ * Called by the MQ plugin when it is done with a record sent by
+ * MQ_SendRef(), possibly in a thread other than the worker's, so the
+ * storage goes directly back to the global free lists, and the record is
+ * counted in the sending worker's stats only if it was delivered.
+ */
+static void
+wrk_release_ref(void *ref, int status)
+{
+    dataentry *entry;
+    worker_data_t *wrk;
+    struct rechead_s freerec;
+    chunkhead_t freechunk[MAX_CHUNK_CLASSES];
+    unsigned bytes;
+
+    CAST_OBJ_NOTNULL(entry, ref, DATA_MAGIC);
+    assert(OCCUPIED(entry));
+    CAST_OBJ_NOTNULL(wrk, entry->sender, WORKER_DATA_MAGIC);
+    assert(__atomic_load_n(&wrk->refs, __ATOMIC_RELAXED) > 0);
+
+    bytes = DATA_LEN(entry);
+    VSTAILQ_INIT(&freerec);
+    for (int c = 0; c < CHUNK_NCLASSES; c++)
+        VSTAILQ_INIT(&freechunk[c]);
+    unsigned chunks = DATA_Reset(entry, freechunk);
+    if (status == 0) {
+        WRK_ADD(wrk->sends, 1);
+        WRK_ADD(wrk->bytes, bytes);
+        MON_StatsUpdate(STATS_SENT, chunks, bytes);
+    }
+    else
+        MON_StatsUpdate(STATS_FAILED, chunks, 0);
+    VSTAILQ_INSERT_HEAD(&freerec, entry, freelist);
+    DATA_Return_Freerec(&freerec, 1);
+    if (chunks > 0)
+        DATA_Return_Freechunk(freechunk, chunks);
+    (void) __atomic_sub_fetch(&wrk->refs, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Send a record in place with MQ_SendRef(). On success the plugin
+ * owns the record until it calls wrk_release_ref(), which may already
+ * have happened when the call returns, so the entry is not touched
+ * afterward.
+ */
+static void
+wrk_send_ref(void **mq_worker, dataentry *entry, worker_data_t *wrk)
+{
+    char *data;
+    const char *err;
+    int errnum, reconnect = 0;
+    unsigned len;
+
+    data = wrk_get_data(entry, &wrk->sb[0]);
+    len = DATA_LEN(entry);
+    WRK_CHECK_DATA(data, len);
+    LOG_Log(LOG_DEBUG, "Worker %d: Sending data by reference [%.*s]",
+            wrk->id, len, data);
+    entry->sender = wrk;
+    WRK_ADD(wrk->refs, 1);
+    errnum = mqf.send_ref(*mq_worker, data, len, entry->key, entry->keylen,
+                          wrk_release_ref, entry, &err);
+    if (errnum == 0)
+        return;
+    (void) __atomic_sub_fetch(&wrk->refs, 1, __ATOMIC_RELAXED);
+    errnum = wrk_send_failed(mq_worker, entry, data, wrk, errnum, err,
+                             &reconnect);
+    wrk_release(entry, data, wrk, errnum);
+}
+
+static inline void
+wrk_send(void **mq_worker, dataentry *entry, worker_data_t *wrk)
+{
+    char *data;
+    const char *err;
+    int errnum, reconnect = 0;
+    
+    CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+    assert(OCCUPIED(entry));
+    AN(mq_worker);
+
+    wrk_format(entry);
+    if (wrk_use_sendv(entry)) {
+        wrk_sendv(mq_worker, entry, wrk);
+        return;
+    }
+    if (wrk_use_ref(entry)) {
+        wrk_send_ref(mq_worker, entry, wrk);
+        return;
+    }
+
+    data = wrk_get_data(entry, &wrk->sb[0]);
+    WRK_CHECK_DATA(data, DATA_LEN(entry));
+    errnum = mqf.send(*mq_worker, data, DATA_LEN(entry),
+                      entry->key, entry->keylen, &err);
+    if (errnum != 0)
+        errnum = wrk_send_failed(mq_worker, entry, data, wrk, errnum, err,
+                                 &reconnect);
+    wrk_release(entry, data, wrk, errnum);
+}
+
+/*
+ * Send the records from deq[nextdeq] up to deq[end] (exclusive) with one
+ * call to the MQ plugin's MQ_SendBatch(). Records that failed are handled
+ * as in wrk_send(), except that a reconnect is attempted at most once.
+ * The plugin reports a single error message for the batch, which may be
+ * freed by MQ_Reconnect(), so it is logged once before any failed record
+ * is handled.
+ */
+static void
+wrk_send_mq_batch(void **mq_worker, worker_data_t *wrk, unsigned end)
+{
+    dataentry **entries = &wrk->deq[wrk->nextdeq];
+    unsigned n = end - wrk->nextdeq, nfailed = 0;
+    const char *err = NULL;
+    int reconnect = 0;
+
+    AN(mq_worker);
+    assert(n <= config.worker_batch);
+
+    for (unsigned i = 0; i < n; i++) {
+        CHECK_OBJ_NOTNULL(entries[i], DATA_MAGIC);
+        assert(OCCUPIED(entries[i]));
+        wrk->msgs[i].data = wrk_get_data(entries[i], &wrk->sb[i]);
+        WRK_CHECK_DATA(wrk->msgs[i].data, DATA_LEN(entries[i]));
+        wrk->msgs[i].len = DATA_LEN(entries[i]);
+        wrk->msgs[i].key = entries[i]->key;
+        wrk->msgs[i].keylen = entries[i]->keylen;
+        wrk->mqstatus[i] = 0;
+    }
+
+    (void) mqf.send_batch(*mq_worker, wrk->msgs, n, wrk->mqstatus, &err);
+
+    for (unsigned i = 0; i < n; i++)
+        if (wrk->mqstatus[i] != 0)
+            nfailed++;
+    if (nfailed > 0)
+        LOG_Log(LOG_WARNING, "Worker %d: Failed to send %u of %u records "
+                "in batch: %s", wrk->id, nfailed, n,
+                err == NULL ? "unknown error" : err);
+
+    for (unsigned i = 0; i < n; i++) {
+        int errnum = wrk->mqstatus[i];
+
+        if (errnum != 0)
+            errnum = wrk_send_failed(mq_worker, entries[i], wrk->msgs[i].data,
+                                     wrk, errnum, NULL, &reconnect);
+        wrk_release(entries[i], wrk->msgs[i].data, wrk, errnum);
+    }
+    wrk->nextdeq = end;
+}
+
+/*
+ * Send the next record in the current batch; or if the MQ plugin
+ * provides MQ_SendBatch(), the next run of records that are not sent
+ * with MQ_SendV() or MQ_SendRef(), so that records are sent in the order
+ * dequeued.
+ */
+static inline void
+wrk_send_next(void **mq_worker, worker_data_t *wrk)
+{
+    unsigned end = wrk->nextdeq;
+
+    if (mqf.send_batch != NULL)
+        while (end < wrk->ndeq && !wrk_use_sendv(wrk->deq[end])
+               && !wrk_use_ref(wrk->deq[end]))
+            end++;
+    if (end - wrk->nextdeq > 1)
+        wrk_send_mq_batch(mq_worker, wrk, end);
+    else
+        wrk_send(mq_worker, wrk->deq[wrk->nextdeq++], wrk);
+}
+
+/*
+ * Send the records remaining in the current batch. If the worker fails,
+ * the rest of the batch is kept for the restarted thread.
+ */
+static inline void
+wrk_send_batch(void **mq_worker, worker_data_t *wrk)
+{
+    while (wrk->nextdeq < wrk->ndeq) {
+        wrk_send_next(mq_worker, wrk);
+        if (wrk->status == EXIT_FAILURE)
+            return;
+    }
+}
+
+static inline unsigned
+wrk_deq_batch(worker_data_t *wrk)
+{
+    wrk->ndeq = SPMCQ_DeqBatchOwn(wrk->id - 1, wrk->deq, config.worker_batch);
+    wrk->nextdeq = 0;
+    wrk->deqs += wrk->ndeq;
+    if (numa_nodes > 1)
+        for (unsigned i = 0; i < wrk->ndeq; i++)
+            if (wrk->deq[i]->node != wrk->node) {
+                wrk->xnode++;
+                MON_StatsUpdate(STATS_XNODE, 0, 0);
+            }
+    return wrk->ndeq;
+}
+
+/*
+ * The plugin may only serve the releases of records sent by reference
+ * when it is called, so while any are outstanding, the worker polls
+ * instead of parking. Otherwise a worker could park with all of the
+ * records held by the plugin, and never be woken, since the reader has
+ * no free records to submit. Returns non-zero if the worker polled.
+ */
+static int
+wrk_poll(void *mq_worker, worker_data_t *wrk)
+{
+    const char *err;
+
+    if (__atomic_load_n(&wrk->refs, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+    err = mqf.poll(mq_worker, POLL_TIMEOUT);
+    if (err == NULL)
+        return 1;
+    LOG_Log(LOG_WARNING, "Worker %d: Poll failed: %s", wrk->id, err);
+    return 0;
+}
+
+/* Free records left in the batch of a worker that will not be restarted */
+static void
+wrk_discard_batch(worker_data_t *wrk)
+{
+    dataentry *entry;
+    const char *data;
+
+    while (wrk->nextdeq < wrk->ndeq) {
+        entry = wrk->deq[wrk->nextdeq++];
+        CHECK_OBJ_NOTNULL(entry, DATA_MAGIC);
+        data = wrk_get_data(entry, &wrk->sb[0]);
+        LOG_Log(LOG_ERR, "Worker %d: Data DISCARDED [%.*s]", wrk->id,
+                DATA_LEN(entry), data);
+        unsigned chunks = DATA_Reset(entry, wrk->freechunk);
+        MON_StatsUpdate(STATS_FAILED, chunks, 0);
+        VSTAILQ_INSERT_HEAD(&wrk->freerec, entry, freelist);
+        wrk->nfree_rec++;
+        wrk->nfree_chunk += chunks;
+    }
+    wrk_return_freelist(wrk);
+}
+
 static void
 *wrk_main(void *arg)
 {
     worker_data_t *wrk = (worker_data_t *) arg;
     void *mq_worker;
-    dataentry *entry;
     const char *err;
+    int errnum;
 
     CHECK_OBJ_NOTNULL(wrk, WORKER_DATA_MAGIC);
     LOG_Log(LOG_INFO, "Worker %d: starting", wrk->id);
     wrk->state = WRK_INITIALIZING;
+    wrk->status = EXIT_SUCCESS;
+    MON_StatsRegister();
+    if ((errnum = AFF_Thread()) != 0)
+        LOG_Log(LOG_WARNING, "Worker %d: Cannot restore nice value: %s",
+                wrk->id, strerror(errnum));
+    /* with worker.cpus, the pool is the node on which the worker runs */
+    if (numa_nodes > 1 && !EMPTY(config.worker_cpus))
+        wrk->node = numa_self = NUMA_Node();
+    else if (numa_nodes > 1
+             && (errnum = NUMA_Bind_Thread(wrk->node)) != 0)
+        LOG_Log(LOG_WARNING, "Worker %d: Cannot bind to NUMA node %u: %s",
+                wrk->id, wrk->node, strerror(errnum));
+    wrk->waiter.remote = wrk->node != numa_home;
+    SPMCQ_Own(wrk->id - 1, &wrk->waiter);
+    wrk->return_t = VTIM_mono();
 
     err = mqf.worker_init(&mq_worker, wrk->id);
     if (err != NULL) {
@@ -285,52 +731,54 @@ static void
     running++;
     AZ(pthread_mutex_unlock(&running_lock));
 
-    while (run) {
-        entry = SPMCQ_Deq();
-        if (entry != NULL) {
-            wrk->deqs++;
-            wrk_send(&mq_worker, entry, wrk);
+    /* Records left over from a batch before a restart */
+    wrk_send_batch(&mq_worker, wrk);
 
-            if (wrk->status == EXIT_FAILURE)
-                break;
+    while (run && wrk->status != EXIT_FAILURE) {
+        if (wrk_deq_batch(wrk) > 0) {
+            double t = VTIM_mono();
+
+            wrk_send_batch(&mq_worker, wrk);
+            SPMCQ_Served(wrk->nextdeq, VTIM_mono() - t);
             continue;
         }
 
         /* return space before sleeping */
         wrk_return_freelist(wrk);
 
+        if (wrk_poll(mq_worker, wrk))
+            continue;
+
         /*
          * Queue is empty, wait until data are available, or quit is
          * signaled.
          *
-         * Grab the CV lock, which also constitutes an implicit memory
-         * barrier 
+         * Grab the waiter lock, which also constitutes an implicit
+         * memory barrier
          */
         AZ(pthread_mutex_lock(&spmcq_datawaiter_lock));
         /*
          * run is guaranteed to be fresh here
          */
         SPMCQ_Drain();
-        if (run) {
-            wrk->waits++;
-            spmcq_datawaiter++;
-            wrk->state = WRK_WAITING;
-            AZ(pthread_cond_wait(&spmcq_datawaiter_cond,
-                                 &spmcq_datawaiter_lock));
-            spmcq_datawaiter--;
-            wrk->state = WRK_RUNNING;
+        if (!run) {
+            AZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+            break;
         }
-        AZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+        wrk->waits++;
+        wrk->state = WRK_WAITING;
+        SPMCQ_Park(&wrk->waiter);
+        wrk->state = WRK_RUNNING;
     }
 
     wrk->state = WRK_SHUTTINGDOWN;
 
     if (wrk->status != EXIT_FAILURE) {
         /* Prepare to exit, drain the queue */
-        while ((entry = SPMCQ_Deq()) != NULL) {
-            wrk->deqs++;
-            wrk_send(&mq_worker, entry, wrk);
-        }
+        SPMCQ_Own(wrk->id - 1, NULL);
+        while (wrk_deq_batch(wrk) > 0)
+            while (wrk->nextdeq < wrk->ndeq)
+                wrk_send_next(&mq_worker, wrk);
         wrk->status = EXIT_SUCCESS;
     }
     
@@ -355,20 +803,24 @@ static void wrk_cleanup(void)
     if (cleaned) return;
     
     for (int i = 0; i < config.nworkers; i++) {
-        VSB_fini(thread_data[i].wrk_data->sb);
+        worker_data_t *wrk = thread_data[i].wrk_data;
+        for (unsigned j = 0; j < config.worker_batch; j++)
+            VSB_fini(&wrk->sb[j]);
+        free(wrk->sb);
+        free(wrk->recbuf);
+        free(wrk->msgs);
+        free(wrk->mqstatus);
+        free(wrk->iov);
+        free(wrk->deq);
         free(thread_data[i].wrk_data);
     }
     free(thread_data);
-    AZ(pthread_mutex_destroy(&spmcq_datawaiter_lock));
-    AZ(pthread_cond_destroy(&spmcq_datawaiter_cond));
     cleaned = 1;
 }
 
 int
 WRK_Init(void)
 {
-    char *recbuf;
-
     thread_data
         = (thread_data_t *) malloc(config.nworkers * sizeof(thread_data_t));
 
@@ -376,7 +828,12 @@ WRK_Init(void)
         LOG_Log(LOG_ALERT, "Cannot allocate thread data: %s", strerror(errno));
         return(errno);
     }
-    
+
+    rec_thresh = (config.max_records >> 1) / config.nworkers;
+    if (rec_thresh == 0)
+        rec_thresh = 1;
+    chunk_thresh = rec_thresh * DATA_Chunks(config.max_reclen, NULL);
+
     run = 1;
     for (int i = 0; i < config.nworkers; i++) {
         thread_data[i].wrk_data
@@ -389,28 +846,50 @@ WRK_Init(void)
         
         worker_data_t *wrk = thread_data[i].wrk_data;
         wrk->magic = WORKER_DATA_MAGIC;
-        wrk->sb = (struct vsb *) malloc(sizeof(struct vsb));
+        wrk->sb = (struct vsb *) calloc(config.worker_batch,
+                                        sizeof(struct vsb));
         AN(wrk->sb);
-        recbuf = (char *) malloc(config.max_reclen + 1);
-        AN(recbuf);
-        AN(VSB_init(wrk->sb, recbuf, config.max_reclen + 1));
+        wrk->recbuf = (char *) malloc(config.worker_batch
+                                      * (config.max_reclen + 1));
+        AN(wrk->recbuf);
+        for (unsigned j = 0; j < config.worker_batch; j++) {
+            char *recbuf = wrk->recbuf + j * (config.max_reclen + 1);
+            AN(VSB_init(&wrk->sb[j], recbuf, config.max_reclen + 1));
+        }
+        wrk->deq = (dataentry **) calloc(config.worker_batch,
+                                         sizeof(dataentry *));
+        AN(wrk->deq);
+        wrk->msgs = (struct mq_msg *) calloc(config.worker_batch,
+                                             sizeof(struct mq_msg));
+        AN(wrk->msgs);
+        wrk->mqstatus = (int *) calloc(config.worker_batch, sizeof(int));
+        AN(wrk->mqstatus);
+        wrk->niov = CHUNK_MAX;
+        wrk->iov = (struct iovec *) calloc(wrk->niov, sizeof(struct iovec));
+        AN(wrk->iov);
+        wrk->ndeq = wrk->nextdeq = 0;
         VSTAILQ_INIT(&wrk->freerec);
         wrk->nfree_rec = 0;
-        VSTAILQ_INIT(&wrk->freechunk);
+        for (int c = 0; c < MAX_CHUNK_CLASSES; c++)
+            VSTAILQ_INIT(&wrk->freechunk[c]);
         wrk->nfree_chunk = 0;
+        SPMCQ_Waiter_Init(&wrk->waiter, 0);
+        wrk->refs = 0;
+        wrk->rec_thresh = rec_thresh;
+        wrk->chunk_thresh = chunk_thresh;
+        wrk->return_rate = 0.;
         wrk->id = i + 1;
+        /* spread the workers over the NUMA nodes */
+        wrk->node = i % numa_nodes;
         wrk->deqs = wrk->waits = wrk->sends = wrk->fails = wrk->reconnects
-            = wrk->restarts = wrk->recoverables = wrk->bytes = 0;
+            = wrk->restarts = wrk->recoverables = wrk->bytes = wrk->xnode = 0;
         wrk->state = WRK_NOTSTARTED;
     }
 
-    spmcq_datawaiter = 0;
-    AZ(pthread_mutex_init(&spmcq_datawaiter_lock, NULL));
-    AZ(pthread_cond_init(&spmcq_datawaiter_cond, NULL));
-
-    rec_thresh = (config.max_records >> 1) / config.nworkers;
-    chunk_thresh = rec_thresh *
-        ((config.max_reclen + config.chunk_size - 1) / config.chunk_size);
+    zerocopy = config.mq_zerocopy && mqf.send_ref != NULL && mqf.poll != NULL;
+    if (config.mq_zerocopy && !zerocopy)
+        LOG_Log0(LOG_WARNING, "mq.zerocopy is set, but the MQ plugin does not "
+                 "provide MQ_SendRef() and MQ_Poll(), records are copied");
 
     atexit(wrk_cleanup);
     return 0;
@@ -421,6 +900,7 @@ wrk_pthread_attr_init(pthread_attr_t *attr)
 {
     AZ(pthread_attr_init(attr));
     AZ(pthread_attr_setstacksize(attr, config.worker_stack));
+    AFF_Attr(attr, AFF_WORKER);
 }
 
 void
@@ -457,6 +937,8 @@ WRK_Restart(void)
                     wrk->id);
                 abandoned++;
                 wrk->state = WRK_ABANDONED;
+                SPMCQ_Own(wrk->id - 1, NULL);
+                wrk_discard_batch(wrk);
                 continue;
             }
             AZ(pthread_mutex_lock(&running_lock));
@@ -496,10 +978,11 @@ WRK_Stats(void)
         LOG_Log(LOG_INFO,
                 "Worker %d (%s): seen=%lu waits=%lu sent=%lu bytes=%lu "
                 "free_rec=%u free_chunk=%u reconnects=%lu restarts=%lu "
-                "failed_recoverable=%lu failed=%lu",
+                "failed_recoverable=%lu failed=%lu node=%u xnode=%lu",
                 wrk->id, statename[wrk->state], wrk->deqs, wrk->waits,
                 wrk->sends, wrk->bytes, wrk->nfree_rec, wrk->nfree_chunk,
-                wrk->reconnects, wrk->restarts, wrk->recoverables, wrk->fails);
+                wrk->reconnects, wrk->restarts, wrk->recoverables, wrk->fails,
+                wrk->node, wrk->xnode);
     }
 }
 
@@ -520,14 +1003,14 @@ WRK_Halt(void)
 {
     /*
      * must only modify run under spmcq_datawaiter_lock to ensure that
-     * we signal all waiting consumers (otherwise a consumer could go
-     * waiting _after_ we have broadcasted and so miss the event.
+     * we wake up all waiting consumers (otherwise a consumer could go
+     * waiting _after_ we have woken them and so miss the event.
      */
     AZ(pthread_mutex_lock(&spmcq_datawaiter_lock));
     SPMCQ_Drain();
     run = 0;
-    AZ(pthread_cond_broadcast(&spmcq_datawaiter_cond));
     AZ(pthread_mutex_unlock(&spmcq_datawaiter_lock));
+    SPMCQ_WakeAll();
 
     for(int i = 0; i < config.nworkers; i++) {
         AZ(pthread_join(thread_data[i].worker,